@@ -0,0 +1,112 @@
+/*
+ * ENGLANG client - run a script on a resident `englang --serve` process.
+ *
+ *   englang-client [limits] <socket> <script.eng> [args...]
+ *
+ * Standard input (unless it is a terminal) is passed to the script; its
+ * output and errors come back on stdout and stderr, and its exit status
+ * becomes ours.  --max-steps, --max-time and --max-memory ask the server
+ * for tighter limits than it runs scripts with by default.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "englang-wire.h"
+
+static int connect_to(const char *path) {
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof addr);
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof addr.sun_path) {
+        fprintf(stderr, "%s: socket path too long\n", path);
+        return -1;
+    }
+    strcpy(addr.sun_path, path);
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0 || connect(fd, (struct sockaddr *)&addr, sizeof addr) < 0) {
+        perror(path);
+        if (fd >= 0) close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+int main(int argc, char *argv[]) {
+    unsigned long long steps = 0, memory = 0;
+    double seconds = 0;
+    int limited = 0, i = 1;
+    for (; i + 1 < argc && strncmp(argv[i], "--max-", 6) == 0; i += 2) {
+        char *end;
+        int ok;
+        if (strcmp(argv[i], "--max-steps") == 0) {
+            steps = strtoull(argv[i + 1], &end, 10);
+            ok = end != argv[i + 1] && !*end && argv[i + 1][0] != '-' && steps > 0;
+        } else if (strcmp(argv[i], "--max-time") == 0) {
+            seconds = strtod(argv[i + 1], &end);
+            ok = end != argv[i + 1] && !*end && seconds > 0;
+        } else if (strcmp(argv[i], "--max-memory") == 0) {
+            ok = wire_parse_bytes(argv[i + 1], &memory) == 0 && memory > 0;
+        } else {
+            ok = 0;
+        }
+        if (!ok) {
+            fprintf(stderr, "englang-client: bad option %s %s\n", argv[i], argv[i + 1]);
+            return 1;
+        }
+        limited = 1;
+    }
+    if (argc - i < 2) {
+        fprintf(stderr, "Usage: %s [--max-steps N] [--max-time seconds] [--max-memory bytes[K|M|G]]\n"
+                        "       <socket> <script.eng> [args...]\n", argv[0]);
+        return 1;
+    }
+    /* the server may run elsewhere in the filesystem: send an absolute path */
+    char script[PATH_MAX];
+    if (!realpath(argv[i + 1], script)) { perror(argv[i + 1]); return 1; }
+
+    int fd = connect_to(argv[i]);
+    if (fd < 0) return 1;
+
+    int ok = wire_send(fd, WIRE_SCRIPT, script, strlen(script)) == 0;
+    if (ok && limited) {
+        unsigned char b[24];
+        wire_put64(b, steps);
+        wire_put64(b + 8, memory);
+        wire_put_double(b + 16, seconds);
+        ok = wire_send(fd, WIRE_LIMITS, b, sizeof b) == 0;
+    }
+    for (i += 2; ok && i < argc; i++)
+        ok = wire_send(fd, WIRE_ARG, argv[i], strlen(argv[i])) == 0;
+    if (ok && !isatty(0)) {
+        char buf[65536];
+        ssize_t n;
+        while (ok && (n = read(0, buf, sizeof buf)) > 0)
+            ok = wire_send(fd, WIRE_INPUT, buf, n) == 0;
+    }
+    if (ok) ok = wire_send(fd, WIRE_GO, NULL, 0) == 0;
+    if (!ok) { perror("englang-client: send"); close(fd); return 1; }
+
+    int status = 1;
+    for (;;) {
+        char *data;
+        size_t len;
+        int type = wire_recv(fd, &data, &len);
+        if (type < 0) {
+            fprintf(stderr, "englang-client: connection closed before the script finished\n");
+            break;
+        }
+        if (type == WIRE_OUT) fwrite(data, 1, len, stdout);
+        else if (type == WIRE_ERR) fwrite(data, 1, len, stderr);
+        int done = type == WIRE_EXIT && len == 4;
+        if (done) status = (int)wire_get32((unsigned char *)data);
+        free(data);
+        if (done) break;
+    }
+    close(fd);
+    fflush(stdout);
+    return status;
+}
@@ -0,0 +1,155 @@
+/*
+ * ENGLANG wire format, shared by `englang --serve` and englang-client.
+ *
+ * Every message is a frame: a one-byte type, the payload length as 4 bytes
+ * big-endian, then the payload.  A request is any number of SCRIPT, ARG,
+ * INPUT and LIMITS frames ended by GO; the reply is any number of OUT and
+ * ERR frames ended by EXIT.  Nothing here depends on the stream being a
+ * Unix socket.
+ *
+ * Distributed loops use the same framing between a coordinator and its
+ * shard workers: IMAGE frames (the coordinator's state as a snapshot)
+ * followed by CHUNK frames, each after a BUDGET frame and answered with
+ * OUT, ERR, ARRAY and BUDGET frames and EXIT.  Like OUT and ERR, frames of
+ * one type simply continue each other, so nothing has to fit in one frame.
+ */
+#ifndef ENGLANG_WIRE_H
+#define ENGLANG_WIRE_H
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+enum {
+    WIRE_SCRIPT = 'S',  /* path of the script to run */
+    WIRE_ARG    = 'A',  /* one script argument */
+    WIRE_INPUT  = 'I',  /* bytes of the script's standard input */
+    WIRE_LIMITS = 'L',  /* max steps and bytes (8 bytes each), then max seconds (a double) */
+    WIRE_GO     = 'G',  /* end of request */
+    WIRE_OUT    = 'O',  /* bytes of the script's standard output */
+    WIRE_ERR    = 'E',  /* bytes of the script's standard error */
+    WIRE_EXIT   = 'X',  /* exit status, 4 bytes big-endian; end of reply */
+    WIRE_IMAGE  = 'M',  /* snapshot of the state a distributed loop starts from */
+    WIRE_CHUNK  = 'C',  /* start value, step and bound (doubles), first iteration and count (8 bytes each) */
+    WIRE_ARRAY  = 'Y',  /* per gathered array: count, then the elements appended */
+    WIRE_BUDGET = 'B'   /* limits as in LIMITS, steps (8 bytes) and seconds (a double) used so far,
+                           then 1 if the run may not write files, else 0 */
+};
+
+#define WIRE_MAX_FRAME (1 << 24)
+
+static inline int wire_write_all(int fd, const void *data, size_t n) {
+    const char *p = data;
+    while (n > 0) {
+        ssize_t w = send(fd, p, n, MSG_NOSIGNAL);  /* a dead peer is an error, not a signal */
+        if (w < 0 && errno == EINTR) continue;
+        if (w <= 0) return -1;
+        p += w;
+        n -= w;
+    }
+    return 0;
+}
+
+static inline int wire_read_all(int fd, void *data, size_t n) {
+    char *p = data;
+    while (n > 0) {
+        ssize_t r = read(fd, p, n);
+        if (r < 0 && errno == EINTR) continue;
+        if (r <= 0) return -1;
+        p += r;
+        n -= r;
+    }
+    return 0;
+}
+
+static inline void wire_put32(unsigned char *b, uint32_t v) {
+    b[0] = v >> 24; b[1] = v >> 16; b[2] = v >> 8; b[3] = v;
+}
+
+static inline uint32_t wire_get32(const unsigned char *b) {
+    return (uint32_t)b[0] << 24 | (uint32_t)b[1] << 16 | (uint32_t)b[2] << 8 | b[3];
+}
+
+static inline void wire_put64(unsigned char *b, uint64_t v) {
+    wire_put32(b, v >> 32);
+    wire_put32(b + 4, (uint32_t)v);
+}
+
+static inline uint64_t wire_get64(const unsigned char *b) {
+    return (uint64_t)wire_get32(b) << 32 | wire_get32(b + 4);
+}
+
+/* Doubles travel as their IEEE 754 bits. */
+static inline void wire_put_double(unsigned char *b, double d) {
+    uint64_t v;
+    memcpy(&v, &d, 8);
+    wire_put64(b, v);
+}
+
+static inline double wire_get_double(const unsigned char *b) {
+    uint64_t v = wire_get64(b);
+    double d;
+    memcpy(&d, &v, 8);
+    return d;
+}
+
+/* A --max-memory value: bytes, with an optional K, M or G suffix.
+   Returns -1 if it is not one. */
+static inline int wire_parse_bytes(const char *s, unsigned long long *bytes) {
+    char *end;
+    errno = 0;
+    unsigned long long n = strtoull(s, &end, 10);
+    if (end == s || *s == '-' || errno) return -1;
+    int shift = 0;
+    switch (*end) {
+    case 'K': case 'k': shift = 10; end++; break;
+    case 'M': case 'm': shift = 20; end++; break;
+    case 'G': case 'g': shift = 30; end++; break;
+    }
+    if (*end || n > (~0ULL >> shift)) return -1;
+    *bytes = n << shift;
+    return 0;
+}
+
+/* Send `len` bytes as one or more frames of `type`. */
+static inline int wire_send(int fd, int type, const void *data, size_t len) {
+    const char *p = data;
+    do {
+        size_t n = len > WIRE_MAX_FRAME ? WIRE_MAX_FRAME : len;
+        unsigned char head[5];
+        head[0] = type;
+        wire_put32(head + 1, n);
+        if (wire_write_all(fd, head, 5) < 0 || wire_write_all(fd, p, n) < 0)
+            return -1;
+        p += n;
+        len -= n;
+    } while (len > 0);
+    return 0;
+}
+
+static inline int wire_send_int(int fd, int type, int v) {
+    unsigned char b[4];
+    wire_put32(b, (uint32_t)v);
+    return wire_send(fd, type, b, 4);
+}
+
+/* Read one frame.  Returns its type, or -1 at end of stream or on error.
+   *data is malloc'd and NUL-terminated; the caller frees it. */
+static inline int wire_recv(int fd, char **data, size_t *len) {
+    unsigned char head[5];
+    if (wire_read_all(fd, head, 5) < 0) return -1;
+    uint32_t n = wire_get32(head + 1);
+    if (n > WIRE_MAX_FRAME) return -1;
+    char *p = malloc(n + 1);
+    if (!p) return -1;
+    if (wire_read_all(fd, p, n) < 0) { free(p); return -1; }
+    p[n] = '\0';
+    *data = p;
+    *len  = n;
+    return head[0];
+}
+
+#endif
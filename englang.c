@@ -1,6 +1,6 @@
 /*
  * ENGLANG - A Turing-Complete Programming Language with Plain English Syntax
- * 
+ *
  * Syntax Examples:
  *   set x to 10
  *   set y to 20
@@ -14,6 +14,10 @@
  *   pop from stack into x
  *   store x at address 10
  *   load from address 10 into x
+ *   spawn call report with 3 into job
+ *   await job into result
+ *   send x to channel jobs
+ *   receive from channel jobs into x
  */
 
 #include <stdio.h>
@@ -21,18 +25,43 @@
 #include <string.h>
 #include <ctype.h>
 #include <math.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <setjmp.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <signal.h>
+#include <limits.h>
+#include <float.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <unistd.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
+#include "englang-wire.h"
 
 #define MAX_VARS       512
 #define MAX_NAME       64
 #define MAX_LINE       1024
 #define MAX_LINES      8192
 #define MAX_STACK      512
-#define MAX_CALL_STACK 128
+#define MAX_CALL_STACK 4096
 #define MAX_FUNCS      256
 #define MAX_MEM        1024
 #define MAX_ARRAYS     64
-#define MAX_ARRAY_SIZE 1024
+#define MAX_ARRAY_SIZE (1 << 24)
 #define MAX_STRING_POOL 4096
+#define MAX_TOKENS     32
 
 /* ─── Value types ─── */
 typedef enum { TYPE_NUM, TYPE_STR } VType;
@@ -40,22 +69,30 @@ typedef enum { TYPE_NUM, TYPE_STR } VType;
 typedef struct {
     VType type;
     double num;
+    double shown; /* text: the number str was made from (see num_text) */
+    int   text;   /* a number's str holds its text; cleared by anything writing str */
     char  str[256];
 } Value;
 
 /* ─── Variable store ─── */
+/* Names are bound to slots at compile time (Program.var_names); a context
+   holds one Var per slot. */
 typedef struct {
-    char  name[MAX_NAME];
     Value val;
     int   used;
 } Var;
 
 /* ─── Array store ─── */
+/* Elements live in a numeric lane; string elements also get an entry in a
+   parallel lane that is only allocated once the array holds a string, so
+   numeric arrays are plain doubles for the bulk statements. */
 typedef struct {
-    char   name[MAX_NAME];
-    Value  data[MAX_ARRAY_SIZE];
-    int    size;
-    int    used;
+    double *num;
+    char  **str;   /* NULL, or the text of each string element (NULL for numbers) */
+    int     nstr;  /* string elements currently held */
+    int     size;
+    int     cap;
+    int     used;
 } Array;
 
 /* ─── Function definition ─── */
@@ -64,22 +101,217 @@ typedef struct {
     int  start_line; /* line index of first statement inside */
     int  end_line;   /* line index of "end define" */
     char params[8][MAX_NAME];
+    int  param_slots[8];
     int  param_count;
+    int  waits;      /* may park on a task or channel, even via calls */
 } FuncDef;
 
-/* ─── Interpreter state ─── */
-static Var      vars[MAX_VARS];
-static Array    arrays[MAX_ARRAYS];
-static FuncDef  funcs[MAX_FUNCS];
-static int      func_count = 0;
-static double   mem[MAX_MEM]; /* raw memory */
-static double   data_stack[MAX_STACK];
-static int      stack_top = 0;
-static char    *lines[MAX_LINES];
-static int      line_count = 0;
-static int      call_stack[MAX_CALL_STACK]; /* return line indices */
-static int      call_sp = 0;
-/* per-call variable scopes aren't implemented; simple globals */
+/* ─── Compiled program ─── */
+/* Every source line compiles to exactly one instruction, so line indices
+   double as jump targets and as positions in diagnostics. */
+typedef enum {
+    OP_NOP, OP_UNKNOWN,
+    OP_SET, OP_ADD, OP_SUB, OP_MUL, OP_DIV, OP_MOD, OP_POW, OP_CONCAT,
+    OP_INC, OP_DEC,
+    OP_PRINT, OP_SAY, OP_ASK,
+    OP_IF, OP_JUMP, OP_WHILE, OP_REPEAT, OP_REPEAT_END, OP_FOR, OP_FOR_NEXT,
+    OP_CALL, OP_RET, OP_RETURN,
+    OP_PUSH, OP_POP, OP_STORE, OP_LOAD,
+    OP_NEWARRAY, OP_APPEND, OP_GETELEM, OP_SETELEM, OP_SIZE,
+    OP_SQRT, OP_ABS, OP_LEN, OP_TONUM, OP_TOSTR,
+    OP_FIND, OP_SPLIT, OP_REPLACE, OP_SUBSTR, OP_EXTRACT, OP_FORMAT,
+    OP_SPAWN, OP_AWAIT, OP_NEWCHAN, OP_SEND, OP_RECV,
+    OP_REDUCE, OP_MAP,
+    OP_SNAPSHOT,
+    OP_INC_WHILE, OP_DEC_WHILE, OP_MOD_IF,   /* superinstructions */
+    OP_FOR_COUNT,
+    OP_ADD_N, OP_SUB_N, OP_MUL_N, OP_DIV_N, OP_MOD_N,   /* on operands known to be numbers */
+    OP_SET_N, OP_WHILE_END,
+    OP_POWI,
+    OP_GETELEM_U, OP_SETELEM_U,   /* indexed by a for loop's variable */
+    OP_STOP
+} OpCode;
+
+#define OP_COUNT (OP_STOP + 1)
+
+typedef enum { OPD_NUM, OPD_STR, OPD_VAR } OpdKind;
+
+typedef struct {
+    OpdKind     kind;
+    int         slot;  /* OPD_VAR: variable slot */
+    int         typed; /* OPD_VAR: proven to hold a number here (infer_types) */
+    double      num;   /* OPD_NUM: literal value */
+    const char *str;   /* OPD_STR: literal text; OPD_VAR: the bare word */
+} Operand;
+
+typedef enum {
+    CMP_NEVER,   /* malformed condition: false even when negated */
+    CMP_NONE,    /* unrecognised operator: false unless negated */
+    CMP_GT, CMP_LT, CMP_GE, CMP_LE, CMP_EQ, CMP_EMPTY, CMP_ZERO,
+    CMP_MATCH    /* lhs matches the pattern rhs */
+} CmpOp;
+
+typedef struct {
+    CmpOp   op;
+    int     neg;
+    Operand lhs, rhs;
+    const struct Regex *re;   /* match: rhs compiled, when it is a literal */
+} Cond;
+
+/* How a format placeholder is rendered. */
+typedef struct {
+    int  width;   /* at least this many characters, padded with spaces */
+    int  prec;    /* digits after the point, or the most characters of text; -1 if none */
+    char align;   /* '<' or '>'; 0 puts numbers on the right and text on the left */
+    char zero;    /* pad numbers on the right with zeros instead */
+} FmtSpec;
+
+typedef struct Instr {
+    OpCode   op;
+    int      dst;     /* destination variable slot */
+    const char *dst_name; /* the variable written, once share_temporaries may have
+                             given it another's slot; NULL before */
+    int      arr;     /* array or channel slot */
+    int      arr2;    /* destination array of map */
+    int      target;  /* jump target, or the opening line of a block */
+    int      func;    /* index into Program.funcs, -1 if undefined */
+    Operand  a, b, c;
+    Cond     cond;
+    Operand *args;    /* print/say operands, call arguments, format segments */
+    int      nargs;
+    const FmtSpec *fmt; /* format: how each of args is rendered */
+    int      aux;     /* channel element type (-1 any), reduction, mod_if on its result */
+    struct Instr *pre; /* statements hoisted out of the loop this line opens */
+    int      npre;
+    int     *bounds;  /* for: arrays its variable indexes, checked once on entry */
+    int      nbounds;
+    int     *guard;   /* -O2 entry points: variables speculated to hold numbers, and
+                         ~slot of arrays speculated to hold only numbers */
+    int      nguard;
+} Instr;
+
+typedef struct Program {
+    char   **lines;       /* trimmed source, for diagnostics */
+    int      line_count;
+    Instr   *code;        /* code[i] is the compiled form of lines[i] */
+    FuncDef  funcs[MAX_FUNCS];
+    int      func_count;
+    char   **var_names;
+    int      var_count, var_cap;
+    char   **array_names;
+    int      array_count, array_cap;
+    char   **chan_names;
+    int      chan_count, chan_cap;
+    int      return_slot; /* slot of the "return" variable */
+    void   **allocs;      /* everything above that must be freed */
+    int      alloc_count, alloc_cap;
+    atomic_uint *heat;    /* -O2: calls per define line, back-edges per loop head */
+    _Atomic(Instr *) hot_code; /* -O2: the same lines fully optimized, once something is hot */
+    int      respecs;     /* times hot_code was dropped for speculating wrongly */
+    struct Regex *regexes; /* compiled pattern literals (see Regular expressions) */
+} Program;
+
+/* ─── Interpreter context ─── */
+/* Everything a script can observe.  Each task owns one; spawned tasks start
+   from a copy of their parent's, so tasks never share mutable state. */
+typedef struct {
+    const Program *prog;
+    Var    *vars;        /* indexed by variable slot */
+    int     var_count;   /* variables created so far */
+    Array  *arrays;      /* indexed by array slot */
+    int     array_count;
+    double  mem[MAX_MEM]; /* raw memory */
+    double  data_stack[MAX_STACK];
+    int     stack_top;
+    struct Run *run;     /* run this context belongs to */
+    jmp_buf *on_fault;   /* where a fatal error unwinds to (see vm_run) */
+} Interp;
+
+/* ─── Tasks ─── */
+/* A task is an interpreter-level coroutine: a context plus its own call and
+   loop frame stacks.  Nothing about it lives on the C stack between
+   instructions, so any worker thread can resume it. */
+typedef struct {
+    double    from, step, to; /* for: iteration k has the value from + k * step (see for_value) */
+    long long k, trips;    /* for: current iteration, and how many there are */
+    int       count;       /* repeat: iterations left */
+    int       in_bounds;   /* for: every index it takes is inside its guarded arrays */
+    int       keeps;       /* distributed for run here: its entry state is on Task.kept */
+} LoopFrame;
+
+typedef enum { TASK_READY, TASK_DONE } TaskState;
+
+typedef struct Task {
+    struct Run      *run;
+    Interp          *in;
+    int              pc;
+    int             *rets;       /* return line indices of active calls */
+    int              rsp, rcap;
+    LoopFrame       *loops;      /* active repeat/for loops */
+    int              lsp, lcap;
+    Interp         **kept;       /* contexts distributed loops run here started from */
+    int              nkept;
+    int              id;         /* 0 for the main program */
+    TaskState        state;
+    Value            result;
+    pthread_mutex_t  lock;
+    struct Task     *waiters;    /* tasks parked in await on this one */
+    struct Task     *next;       /* run queue / wait list link */
+    pthread_mutex_t *park_lock;  /* released by the scheduler once parked */
+    void           (*native)(void *);  /* helper job instead of script code */
+    void            *native_arg;
+    int              stop_pc;    /* finish when a for loop exits to here */
+    int              fuel;       /* steps left in this time slice */
+    int              slice;      /* steps the slice started with */
+    const Instr     *hot;        /* the -O2 code it runs, if not prog->code (see Tiers) */
+} Task;
+
+/* Growable byte buffer for captured output. */
+typedef struct {
+    char   *data;
+    size_t  len, cap;
+} Buf;
+
+/* Budgets for one run; zero means unlimited. */
+typedef struct {
+    long long steps;     /* back-edges and calls */
+    double    seconds;   /* wall-clock time */
+    size_t    memory;    /* bytes of script data: contexts, array elements, queued messages */
+} Limits;
+
+/* One execution of a program: the main task plus everything it spawns. */
+typedef struct Run {
+    const Program   *prog;
+    pthread_mutex_t  lock;
+    Task           **tasks;      /* spawned tasks; handle n is tasks[n - 1] */
+    int              ntasks, taskcap;
+    int              active;     /* tasks queued or running */
+    int              finishing;
+    int              status;     /* process exit status */
+    atomic_int       halted;     /* tasks stop at their next call/back-edge */
+    atomic_int       done;
+    atomic_llong     steps;      /* back-edges and calls executed */
+    Limits           limits;
+    double           started;    /* clock_now() when the run was created */
+    double           deadline;   /* clock_now() value it must end by; 0 for none */
+    atomic_llong     memory;     /* bytes of script data held now */
+    atomic_llong     peak;       /* and at most */
+    atomic_int      *remaining;  /* runs still going in this batch */
+    _Atomic(struct Channel *) *chans;  /* indexed by channel slot */
+    Task            *main;       /* the main program's task */
+    int              capture;    /* buffer output instead of writing it */
+    int              untrusted;  /* one of a batch or served: may not write files */
+    int              chunk;      /* a shard worker's run of part of a distributed loop */
+    pthread_mutex_t  out_lock;
+    Buf              out, err;   /* captured stdout / stderr */
+    int              input;      /* ask reads from `in` instead of stdin */
+    Buf              in;
+    size_t           in_pos;
+    void           (*on_end)(struct Run *);  /* replaces publishing `done` */
+    void            *owner;
+} Run;
+
+typedef enum { VM_DONE, VM_PARKED, VM_HALTED, VM_YIELD } VMResult;
 
 /* ─── String helpers ─── */
 static char *trim(char *s) {
@@ -93,833 +325,6824 @@ static int startswith(const char *s, const char *prefix) {
     return strncmp(s, prefix, strlen(prefix)) == 0;
 }
 
-/* ─── Variable access ─── */
-static Var *find_var(const char *name) {
-    for (int i = 0; i < MAX_VARS; i++)
-        if (vars[i].used && strcmp(vars[i].name, name) == 0)
-            return &vars[i];
-    return NULL;
+static void *xrealloc(void *p, size_t n) {
+    p = realloc(p, n);
+    if (!p) { fprintf(stderr, "Error: out of memory\n"); exit(1); }
+    return p;
+}
+
+/* ─── Input and output ─── */
+/* A run writes straight to stdout/stderr unless it is one of a batch or
+   served, in which case its output is held until the run is over. */
+static void buf_append(Buf *b, const char *s, size_t n) {
+    if (b->len + n > b->cap) {
+        while (b->len + n > b->cap) b->cap = b->cap ? b->cap * 2 : 256;
+        b->data = xrealloc(b->data, b->cap);
+    }
+    memcpy(b->data + b->len, s, n);
+    b->len += n;
+}
+
+static int  run_fits(const Run *run, long long n);
+static void run_account(Run *run, long long n);
+static void run_exceeded(Run *run, int which);
+
+/* Captured output is script data like any other, so it counts toward the
+   memory limit.  Output that would go over it is dropped and the run
+   stopped; once it is stopping, only what it says on stderr about why is
+   still kept.  Returns 0 if the text was dropped. */
+static int run_capture(Run *run, Buf *b, const char *s, size_t n, int err) {
+    pthread_mutex_lock(&run->out_lock);
+    size_t cap = b->cap;
+    while (b->len + n > cap) cap = cap ? cap * 2 : 256;
+    long long grow = (long long)(cap - b->cap);
+    int kept = !grow || run_fits(run, grow) || (err && atomic_load(&run->halted));
+    if (kept) {
+        run_account(run, grow);
+        buf_append(b, s, n);
+    }
+    pthread_mutex_unlock(&run->out_lock);
+    if (!kept) run_exceeded(run, 'm');
+    return kept;
+}
+
+static void run_write(Run *run, const char *s, size_t n) {
+    if (!run->capture) { fwrite(s, 1, n, stdout); return; }
+    run_capture(run, &run->out, s, n, 0);
+}
+
+static void run_write_err(Run *run, const char *s, size_t n) {
+    if (!run->capture) { fwrite(s, 1, n, stderr); return; }
+    run_capture(run, &run->err, s, n, 1);
+}
+
+static void diag(Run *run, const char *fmt, ...) {
+    char msg[512];
+    va_list ap;
+    va_start(ap, fmt);
+    int n = vsnprintf(msg, sizeof msg, fmt, ap);
+    va_end(ap);
+    if (n < 0) return;
+    if (n >= (int)sizeof msg) n = sizeof msg - 1;
+    run_write_err(run, msg, n);
+}
+
+/* Read one line of input the way fgets would.  Returns 0 at end of input. */
+static int run_read_line(Run *run, char *buf, int size) {
+    if (!run->input) return fgets(buf, size, stdin) != NULL;
+    pthread_mutex_lock(&run->out_lock);
+    int n = 0;
+    while (n < size - 1 && run->in_pos < run->in.len) {
+        char c = run->in.data[run->in_pos++];
+        buf[n++] = c;
+        if (c == '\n') break;
+    }
+    buf[n] = '\0';
+    pthread_mutex_unlock(&run->out_lock);
+    return n > 0;
+}
+
+/* ─── Program storage ─── */
+static void *prog_alloc(Program *p, size_t n) {
+    if (p->alloc_count == p->alloc_cap) {
+        p->alloc_cap = p->alloc_cap ? p->alloc_cap * 2 : 64;
+        p->allocs = xrealloc(p->allocs, p->alloc_cap * sizeof(void *));
+    }
+    void *m = calloc(1, n ? n : 1);
+    if (!m) { fprintf(stderr, "Error: out of memory\n"); exit(1); }
+    p->allocs[p->alloc_count++] = m;
+    return m;
+}
+
+static char *prog_strdup(Program *p, const char *s) {
+    char *d = prog_alloc(p, strlen(s) + 1);
+    strcpy(d, s);
+    return d;
+}
+
+static int intern(Program *p, char ***names, int *count, int *cap, const char *name) {
+    for (int i = 0; i < *count; i++)
+        if (strcmp((*names)[i], name) == 0)
+            return i;
+    if (*count == *cap) {
+        *cap = *cap ? *cap * 2 : 64;
+        *names = xrealloc(*names, *cap * sizeof(char *));
+    }
+    (*names)[*count] = prog_strdup(p, name);
+    return (*count)++;
+}
+
+static int var_slot(Program *p, const char *name) {
+    return intern(p, &p->var_names, &p->var_count, &p->var_cap, name);
+}
+
+static int array_slot(Program *p, const char *name) {
+    return intern(p, &p->array_names, &p->array_count, &p->array_cap, name);
+}
+
+static int chan_slot(Program *p, const char *name) {
+    return intern(p, &p->chan_names, &p->chan_count, &p->chan_cap, name);
+}
+
+static void regexes_free(struct Regex *re);
+
+static void free_program(Program *p) {
+    regexes_free(p->regexes);
+    for (int i = 0; i < p->alloc_count; i++) free(p->allocs[i]);
+    for (int i = 0; i < p->line_count; i++) free(p->lines[i]);
+    free(p->allocs);
+    free(p->lines);
+    free(p->code);
+    free(p->heat);
+    free(p->var_names);
+    free(p->array_names);
+    free(p->chan_names);
+    free(p);
+}
+
+/* ─── Parse tokens from line (space-separated, respecting quotes) ─── */
+/* Past the token at p: a quoted string, or a run of non-space. */
+static const char *token_end(const char *p) {
+    if (*p == '"') {
+        p++;
+        while (*p && *p != '"') p++;
+        return *p ? p + 1 : p;
+    }
+    while (*p && !isspace((unsigned char)*p)) p++;
+    return p;
+}
+
+static int tokenize(const char *line, char tokens[][MAX_NAME], int max_tok) {
+    int count = 0;
+    const char *p = line;
+    while (*p && count < max_tok) {
+        while (isspace((unsigned char)*p)) p++;
+        if (!*p) break;
+        const char *start = p;
+        p = token_end(p);
+        int len = (int)(p - start);
+        if (len >= MAX_NAME) len = MAX_NAME - 1;
+        strncpy(tokens[count], start, len);
+        tokens[count][len] = '\0';
+        count++;
+    }
+    return count;
+}
+
+/* Where token k of line starts (its end if there are fewer).  Tokens are
+   cut at MAX_NAME - 1 bytes, so a string literal whose length or spacing
+   matters, like a pattern, is read from here instead. */
+static const char *token_at(const char *line, int k) {
+    const char *p = line;
+    while (isspace((unsigned char)*p)) p++;
+    for (; k > 0 && *p; k--) {
+        p = token_end(p);
+        while (isspace((unsigned char)*p)) p++;
+    }
+    return p;
+}
+
+/* Token k of line in full. */
+static void token_full(const char *line, int k, char out[MAX_LINE]) {
+    const char *p = token_at(line, k);
+    size_t len = token_end(p) - p;
+    if (len >= MAX_LINE) len = MAX_LINE - 1;
+    memcpy(out, p, len);
+    out[len] = '\0';
+}
+
+/* ─── Regular expressions ─── */
+/* `matches` and `extract` take a pattern in the usual syntax: literals,
+   ., [classes] with ranges and ^, \d \w \s and their negations, ^ and $,
+   groups ( ) and (?: ), alternation | and the repeats * + ? {m} {m,}
+   {m,n}, each lazy with a trailing ?.  A pattern is compiled to an NFA
+   (a small instruction list, as in a Pike VM) once per distinct literal
+   in the program; a pattern held in a variable is compiled when it runs.
+
+   `matches` runs a DFA built lazily from the NFA: each state is a set of
+   NFA positions, and each of its 256 successors is worked out the first
+   time some text needs it, then kept.  Nothing is ever retried, so the
+   time is linear in the text whatever the pattern.  A pattern that needs
+   more than RE_MAX_STATES states carries on by stepping the NFA sets
+   directly, which costs more per byte but no more memory.  `extract` needs
+   the text of groups, which a DFA does not track, so it runs the NFA with
+   positions attached to each thread (a Pike VM): still linear for one
+   match, and the leftmost match wins, preferring what the pattern lists
+   first.  Each further match is looked for from where the last ended, and
+   a pattern like a|a*b reads on to the end of the text before settling
+   on "a", so all the matches can cost the text length times their count;
+   strings are at most 255 bytes, which bounds that. */
+#define RE_MAX_INSTS  2048
+#define RE_MAX_STATES 128
+#define RE_MAX_GROUPS 9
+#define RE_NCAP       (2 * (RE_MAX_GROUPS + 1))
+
+typedef enum { RI_BYTE, RI_SPLIT, RI_JMP, RI_SAVE, RI_BOL, RI_EOL, RI_MATCH } ReOp;
+
+typedef struct {
+    ReOp     op;
+    int      x, y;      /* split: both ways, x preferred; jmp: x; save: slot */
+    uint64_t cls[4];    /* byte: the bytes it takes */
+} ReInst;
+
+/* A DFA state: the NFA positions that are alive, in order. */
+typedef struct ReState {
+    _Atomic(struct ReState *) next[256];
+    int start;          /* before the first byte, where ^ holds */
+    int accept;         /* some match ends here */
+    int accept_end;     /* one would if the text ended here */
+    int n;
+    int set[];
+} ReState;
+
+/* Room for stepping sets: every array holds one entry per instruction
+   (the stack twice over). */
+typedef struct ReWork {
+    int *mark, *stack, *cur, *nxt, *tmp;
+    int  gen;
+} ReWork;
+
+typedef struct Regex {
+    struct Regex   *next;       /* Program.regexes */
+    char           *pattern;
+    ReInst         *inst;
+    int             ninst, ngroups;
+    pthread_mutex_t lock;       /* adding DFA states */
+    ReState        *states[RE_MAX_STATES];
+    int             nstates;
+    _Atomic(ReState *) initial;
+    ReWork         *work;       /* for adding states, under lock */
+    struct Regex   *u8;         /* for UTF-8 text, if . or a class like [^a] is in it */
+} Regex;
+
+#define RE_HAS(cls, b) (((cls)[(b) >> 6] >> ((b) & 63)) & 1)
+#define RE_ADD(cls, b) ((cls)[(b) >> 6] |= (uint64_t)1 << ((b) & 63))
+
+enum { RN_CLASS, RN_CAT, RN_ALT, RN_REPEAT, RN_GROUP, RN_BOL, RN_EOL, RN_EMPTY };
+
+typedef struct ReNode {
+    int      kind;
+    int      min, max, greedy;  /* repeat; max -1 for no limit */
+    int      group;             /* group: its number, 0 for (?: ) */
+    uint64_t cls[4];
+    struct ReNode *a, *b;
+} ReNode;
+
+typedef struct {
+    const char *s;
+    ReNode     *pool;
+    int         nnodes, ngroups;
+    const char *err;
+    ReInst     *inst;
+    int         ninst;
+    int         utf8;   /* emitting the form for UTF-8 text */
+    int         wide;   /* some class takes every non-ASCII byte */
+} ReParse;
+
+static ReNode *re_node(ReParse *rp, int kind, ReNode *a, ReNode *b) {
+    ReNode *n = &rp->pool[rp->nnodes++];
+    memset(n, 0, sizeof *n);
+    n->kind = kind;
+    n->a = a;
+    n->b = b;
+    return n;
+}
+
+static void re_range(uint64_t cls[4], int lo, int hi) {
+    for (int c = lo; c <= hi; c++) RE_ADD(cls, c);
 }
 
-static Var *get_or_create_var(const char *name) {
-    Var *v = find_var(name);
-    if (v) return v;
-    for (int i = 0; i < MAX_VARS; i++) {
-        if (!vars[i].used) {
-            vars[i].used = 1;
-            strncpy(vars[i].name, name, MAX_NAME - 1);
-            vars[i].val.type = TYPE_NUM;
-            vars[i].val.num  = 0;
-            vars[i].val.str[0] = '\0';
-            return &vars[i];
+/* \d \w \s and their negations into cls; 0 if `e` is not one of them. */
+static int re_class_escape(int e, uint64_t cls[4]) {
+    uint64_t c[4] = {0};
+    switch (tolower(e)) {
+    case 'd': re_range(c, '0', '9'); break;
+    case 'w': re_range(c, '0', '9'); re_range(c, 'a', 'z'); re_range(c, 'A', 'Z'); RE_ADD(c, '_'); break;
+    case 's': re_range(c, '\t', '\r'); RE_ADD(c, ' '); break;
+    default:  return 0;
+    }
+    for (int w = 0; w < 4; w++) cls[w] |= isupper(e) ? ~c[w] : c[w];
+    return 1;
+}
+
+/* The byte an escape stands for, or -1 (with rp->err set). */
+static int re_escaped_byte(ReParse *rp, int e) {
+    switch (e) {
+    case 't': return '\t';
+    case 'n': return '\n';
+    case 'r': return '\r';
+    case '\0': rp->err = "trailing \\"; return -1;
+    }
+    if (isalnum(e)) { rp->err = "unknown escape"; return -1; }
+    return (unsigned char)e;
+}
+
+static ReNode *re_alt(ReParse *rp);
+
+static ReNode *re_class(ReParse *rp) {
+    ReNode *n = re_node(rp, RN_CLASS, NULL, NULL);
+    int neg = *rp->s == '^';
+    if (neg) rp->s++;
+    int first = 1;
+    while (*rp->s && (*rp->s != ']' || first)) {
+        first = 0;
+        int lo = (unsigned char)*rp->s++;
+        if (lo == '\\') {
+            int e = (unsigned char)*rp->s++;
+            if (re_class_escape(e, n->cls)) continue;
+            if ((lo = re_escaped_byte(rp, e)) < 0) return NULL;
+        }
+        int hi = lo;
+        if (rp->s[0] == '-' && rp->s[1] && rp->s[1] != ']') {
+            rp->s++;
+            hi = (unsigned char)*rp->s++;
+            if (hi == '\\' && (hi = re_escaped_byte(rp, (unsigned char)*rp->s++)) < 0) return NULL;
+            if (hi < lo) { rp->err = "bad range in [ ]"; return NULL; }
         }
+        re_range(n->cls, lo, hi);
     }
-    fprintf(stderr, "Error: too many variables\n");
-    exit(1);
+    if (*rp->s != ']') { rp->err = "missing ]"; return NULL; }
+    rp->s++;
+    if (neg)
+        for (int w = 0; w < 4; w++) n->cls[w] = ~n->cls[w];
+    return n;
 }
 
-/* ─── Array access ─── */
-static Array *find_array(const char *name) {
-    for (int i = 0; i < MAX_ARRAYS; i++)
-        if (arrays[i].used && strcmp(arrays[i].name, name) == 0)
-            return &arrays[i];
-    return NULL;
+static ReNode *re_atom(ReParse *rp) {
+    int c = (unsigned char)*rp->s++;
+    ReNode *n;
+    switch (c) {
+    case '(': {
+        int group = 0;
+        if (rp->s[0] == '?' && rp->s[1] == ':') rp->s += 2;
+        else if (++rp->ngroups > RE_MAX_GROUPS) { rp->err = "more than 9 groups"; return NULL; }
+        else group = rp->ngroups;
+        ReNode *a = re_alt(rp);
+        if (!a) return NULL;
+        if (*rp->s != ')') { rp->err = "missing )"; return NULL; }
+        rp->s++;
+        n = re_node(rp, RN_GROUP, a, NULL);
+        n->group = group;
+        return n;
+    }
+    case '[':
+        return re_class(rp);
+    case '.':
+        n = re_node(rp, RN_CLASS, NULL, NULL);
+        memset(n->cls, 0xff, sizeof n->cls);
+        return n;
+    case '^':
+        return re_node(rp, RN_BOL, NULL, NULL);
+    case '$':
+        return re_node(rp, RN_EOL, NULL, NULL);
+    case '*': case '+': case '?':
+        rp->err = "nothing to repeat";
+        return NULL;
+    case '\\':
+        n = re_node(rp, RN_CLASS, NULL, NULL);
+        c = (unsigned char)*rp->s++;
+        if (re_class_escape(c, n->cls)) return n;
+        if ((c = re_escaped_byte(rp, c)) < 0) return NULL;
+        RE_ADD(n->cls, c);
+        return n;
+    default:
+        n = re_node(rp, RN_CLASS, NULL, NULL);
+        RE_ADD(n->cls, c);
+        /* a character written in UTF-8 is one atom, so é* repeats all of it */
+        for (int lead = c; lead >= 0xC0 && ((unsigned char)*rp->s & 0xC0) == 0x80; ) {
+            ReNode *b = re_node(rp, RN_CLASS, NULL, NULL);
+            c = (unsigned char)*rp->s++;
+            RE_ADD(b->cls, c);
+            n = re_node(rp, RN_CAT, n, b);
+        }
+        return n;
+    }
+}
+
+/* {m}, {m,} or {m,n} at s: sets the counts and returns the end, or NULL
+   if this is a plain "{". */
+static const char *re_counts(const char *s, int *min, int *max) {
+    char *end;
+    if (!isdigit((unsigned char)s[1])) return NULL;
+    long m = strtol(s + 1, &end, 10), x = m;
+    if (*end == ',') {
+        x = -1;
+        if (isdigit((unsigned char)end[1])) x = strtol(end + 1, &end, 10);
+        else end++;
+    }
+    if (*end != '}') return NULL;
+    *min = m > 1000 ? 1000 : (int)m;
+    *max = x > 1000 ? 1000 : (int)x;
+    return end + 1;
+}
+
+static ReNode *re_repeat(ReParse *rp) {
+    ReNode *a = re_atom(rp);
+    while (a) {
+        int min, max;
+        const char *after;
+        if (*rp->s == '*')      { min = 0; max = -1; after = rp->s + 1; }
+        else if (*rp->s == '+') { min = 1; max = -1; after = rp->s + 1; }
+        else if (*rp->s == '?') { min = 0; max = 1;  after = rp->s + 1; }
+        else if (*rp->s == '{' && (after = re_counts(rp->s, &min, &max))) {
+            if (max >= 0 && max < min) { rp->err = "bad {m,n}"; return NULL; }
+        } else break;
+        rp->s = after;
+        a = re_node(rp, RN_REPEAT, a, NULL);
+        a->min = min;
+        a->max = max;
+        a->greedy = *rp->s != '?';
+        if (!a->greedy) rp->s++;
+    }
+    return a;
+}
+
+static ReNode *re_cat(ReParse *rp) {
+    ReNode *t = NULL;
+    while (*rp->s && *rp->s != '|' && *rp->s != ')') {
+        ReNode *r = re_repeat(rp);
+        if (!r) return NULL;
+        t = t ? re_node(rp, RN_CAT, t, r) : r;
+    }
+    return t ? t : re_node(rp, RN_EMPTY, NULL, NULL);
+}
+
+static ReNode *re_alt(ReParse *rp) {
+    ReNode *t = re_cat(rp);
+    while (t && *rp->s == '|') {
+        rp->s++;
+        ReNode *r = re_cat(rp);
+        t = r ? re_node(rp, RN_ALT, t, r) : NULL;
+    }
+    return t;
+}
+
+static int re_emit(ReParse *rp, ReOp op, int x, int y) {
+    if (rp->ninst == RE_MAX_INSTS) { rp->err = "pattern too large"; return -1; }
+    ReInst *i = &rp->inst[rp->ninst];
+    memset(i, 0, sizeof *i);
+    i->op = op;
+    i->x  = x;
+    i->y  = y;
+    return rp->ninst++;
+}
+
+/* In UTF-8 text a class that takes every non-ASCII byte (., [^...], \D
+   and the like) takes a whole character instead: one of its ASCII bytes,
+   or a lead byte and the continuation bytes that go with it.  The text is
+   known to be valid, so the lead byte alone says how many follow. */
+static int re_compile_char(ReParse *rp, const uint64_t cls[4]) {
+    int at = rp->ninst, end = at + 13;
+    if (end > RE_MAX_INSTS) { rp->err = "pattern too large"; return -1; }
+    re_emit(rp, RI_SPLIT, at + 1, at + 3);
+    int ascii = re_emit(rp, RI_BYTE, 0, 0);
+    re_emit(rp, RI_JMP, end, 0);
+    re_emit(rp, RI_SPLIT, at + 4, at + 6);
+    re_range(rp->inst[re_emit(rp, RI_BYTE, 0, 0)].cls, 0xC2, 0xDF);
+    re_emit(rp, RI_JMP, end - 1, 0);
+    re_emit(rp, RI_SPLIT, at + 7, at + 9);
+    re_range(rp->inst[re_emit(rp, RI_BYTE, 0, 0)].cls, 0xE0, 0xEF);
+    re_emit(rp, RI_JMP, end - 2, 0);
+    re_range(rp->inst[re_emit(rp, RI_BYTE, 0, 0)].cls, 0xF0, 0xF4);
+    for (int k = 0; k < 3; k++)
+        re_range(rp->inst[re_emit(rp, RI_BYTE, 0, 0)].cls, 0x80, 0xBF);
+    rp->inst[ascii].cls[0] = cls[0];
+    rp->inst[ascii].cls[1] = cls[1];
+    return 0;
+}
+
+static int re_compile_node(ReParse *rp, const ReNode *n) {
+    int at;
+    switch (n->kind) {
+    case RN_CLASS:
+        if (n->cls[2] == ~0ULL && n->cls[3] == ~0ULL) {
+            rp->wide = 1;
+            if (rp->utf8) return re_compile_char(rp, n->cls);
+        }
+        if ((at = re_emit(rp, RI_BYTE, 0, 0)) < 0) return -1;
+        memcpy(rp->inst[at].cls, n->cls, sizeof n->cls);
+        return 0;
+    case RN_CAT:
+        return re_compile_node(rp, n->a) < 0 ? -1 : re_compile_node(rp, n->b);
+    case RN_ALT: {
+        int split = re_emit(rp, RI_SPLIT, 0, 0);
+        if (split < 0 || re_compile_node(rp, n->a) < 0) return -1;
+        int jmp = re_emit(rp, RI_JMP, 0, 0);
+        if (jmp < 0) return -1;
+        rp->inst[split].x = split + 1;
+        rp->inst[split].y = rp->ninst;
+        if (re_compile_node(rp, n->b) < 0) return -1;
+        rp->inst[jmp].x = rp->ninst;
+        return 0;
+    }
+    case RN_GROUP:
+        if (n->group && re_emit(rp, RI_SAVE, 2 * n->group, 0) < 0) return -1;
+        if (re_compile_node(rp, n->a) < 0) return -1;
+        return n->group && re_emit(rp, RI_SAVE, 2 * n->group + 1, 0) < 0 ? -1 : 0;
+    case RN_REPEAT: {
+        for (int k = 0; k < n->min; k++)
+            if (re_compile_node(rp, n->a) < 0) return -1;
+        if (n->max < 0) {
+            int split = re_emit(rp, RI_SPLIT, 0, 0);
+            if (split < 0 || re_compile_node(rp, n->a) < 0 || re_emit(rp, RI_JMP, split, 0) < 0) return -1;
+            rp->inst[split].x = n->greedy ? split + 1 : rp->ninst;
+            rp->inst[split].y = n->greedy ? rp->ninst : split + 1;
+            return 0;
+        }
+        /* each optional copy may skip to the end; y chains the splits until then */
+        int chain = -1;
+        for (int k = n->min; k < n->max; k++) {
+            int split = re_emit(rp, RI_SPLIT, 0, chain);
+            if (split < 0 || re_compile_node(rp, n->a) < 0) return -1;
+            chain = split;
+        }
+        while (chain >= 0) {
+            ReInst *s = &rp->inst[chain];
+            int prev = s->y;
+            s->x = n->greedy ? chain + 1 : rp->ninst;
+            s->y = n->greedy ? rp->ninst : chain + 1;
+            chain = prev;
+        }
+        return 0;
+    }
+    case RN_BOL:
+        return re_emit(rp, RI_BOL, 0, 0) < 0 ? -1 : 0;
+    case RN_EOL:
+        return re_emit(rp, RI_EOL, 0, 0) < 0 ? -1 : 0;
+    default:
+        return 0;
+    }
+}
+
+static void regex_free(Regex *re) {
+    if (re->u8) regex_free(re->u8);
+    for (int i = 0; i < re->nstates; i++) free(re->states[i]);
+    pthread_mutex_destroy(&re->lock);
+    if (re->work) free(re->work->mark);
+    free(re->work);
+    free(re->inst);
+    free(re->pattern);
+    free(re);
+}
+
+static void regexes_free(Regex *re) {
+    while (re) {
+        Regex *next = re->next;
+        regex_free(re);
+        re = next;
+    }
+}
+
+/* The whole pattern as group 0, into rp->inst. */
+static void re_compile_root(ReParse *rp, const ReNode *root) {
+    rp->inst  = malloc(RE_MAX_INSTS * sizeof(ReInst));
+    rp->ninst = 0;
+    re_emit(rp, RI_SAVE, 0, 0);
+    re_compile_node(rp, root);
+    re_emit(rp, RI_SAVE, 1, 0);
+    re_emit(rp, RI_MATCH, 0, 0);
+}
+
+static Regex *re_new(const char *pattern, ReParse *rp) {
+    Regex *re = calloc(1, sizeof(Regex));
+    re->pattern = strdup(pattern);
+    re->inst    = xrealloc(rp->inst, rp->ninst * sizeof(ReInst));
+    re->ninst   = rp->ninst;
+    re->ngroups = rp->ngroups;
+    pthread_mutex_init(&re->lock, NULL);
+    return re;
+}
+
+/* Returns NULL, with *err saying why, if the pattern is malformed. */
+static Regex *regex_compile(const char *pattern, const char **err) {
+    size_t len = strlen(pattern);
+    ReParse rp = { pattern };
+    rp.pool = malloc((4 * len + 8) * sizeof(ReNode));
+    ReNode *root = re_alt(&rp);
+    if (root && *rp.s) rp.err = "unmatched )";
+    if (!rp.err) re_compile_root(&rp, root);
+    if (rp.err) {
+        free(rp.pool);
+        free(rp.inst);
+        *err = rp.err;
+        return NULL;
+    }
+    Regex *re = re_new(pattern, &rp);
+    if (rp.wide) {
+        /* the same tree again, taking characters; too large, and UTF-8
+           text is matched byte by byte like any other */
+        rp.utf8 = 1;
+        re_compile_root(&rp, root);
+        if (rp.err) free(rp.inst);
+        else re->u8 = re_new(pattern, &rp);
+    }
+    free(rp.pool);
+    return re;
+}
+
+/* The compiled form of a pattern literal, shared by every line (and every
+   tier) that uses the same text.  NULL if it is malformed. */
+static const Regex *regex_for(Program *p, const char *pattern) {
+    for (Regex *re = p->regexes; re; re = re->next)
+        if (strcmp(re->pattern, pattern) == 0) return re;
+    const char *err;
+    Regex *re = regex_compile(pattern, &err);
+    if (!re) return NULL;
+    re->next = p->regexes;
+    p->regexes = re;
+    return re;
+}
+
+/* ── Sets of NFA positions ── */
+enum { RE_AT_START = 1, RE_AT_END = 2 };
+
+static void re_work_init(ReWork *w, const Regex *re) {
+    int n = re->ninst + 1;
+    w->mark  = calloc(6 * n, sizeof(int));
+    w->stack = w->mark + n;
+    w->cur   = w->stack + 2 * n;
+    w->nxt   = w->cur + n;
+    w->tmp   = w->nxt + n;
+    w->gen   = 0;
 }
 
-static Array *get_or_create_array(const char *name) {
-    Array *a = find_array(name);
-    if (a) return a;
-    for (int i = 0; i < MAX_ARRAYS; i++) {
-        if (!arrays[i].used) {
-            arrays[i].used = 1;
-            strncpy(arrays[i].name, name, MAX_NAME - 1);
-            arrays[i].size = 0;
-            return &arrays[i];
+/* Add pc and everything reachable from it without taking a byte to out[],
+   in priority order, skipping what this round already added. */
+static void re_closure(const Regex *re, ReWork *w, int pc, int flags, int *out, int *n) {
+    int sp = 0;
+    w->stack[sp++] = pc;
+    while (sp > 0) {
+        pc = w->stack[--sp];
+        if (w->mark[pc] == w->gen) continue;
+        w->mark[pc] = w->gen;
+        const ReInst *i = &re->inst[pc];
+        switch (i->op) {
+        case RI_JMP:   w->stack[sp++] = i->x; break;
+        case RI_SPLIT: w->stack[sp++] = i->y; w->stack[sp++] = i->x; break;
+        case RI_SAVE:  w->stack[sp++] = pc + 1; break;
+        case RI_BOL:   if (flags & RE_AT_START) w->stack[sp++] = pc + 1; break;
+        case RI_EOL:
+            if (flags & RE_AT_END) w->stack[sp++] = pc + 1;
+            else out[(*n)++] = pc;      /* holds later if the text ends there */
+            break;
+        default:       out[(*n)++] = pc; break;
         }
     }
-    fprintf(stderr, "Error: too many arrays\n");
-    exit(1);
 }
 
-/* ─── Value resolution ─── */
-static Value resolve(const char *token) {
-    Value v;
-    v.type = TYPE_NUM;
-    v.num  = 0;
-    v.str[0] = '\0';
+/* Where set[] goes on byte c, plus a fresh start, since a match may begin
+   anywhere.  Returns how many positions went into out[]. */
+static int re_step(const Regex *re, ReWork *w, const int *set, int n, int c, int *out) {
+    int m = 0;
+    w->gen++;
+    for (int k = 0; k < n; k++) {
+        const ReInst *i = &re->inst[set[k]];
+        if (i->op == RI_BYTE && RE_HAS(i->cls, c)) re_closure(re, w, set[k] + 1, 0, out, &m);
+    }
+    re_closure(re, w, 0, 0, out, &m);
+    return m;
+}
+
+static int re_accepts(const Regex *re, ReWork *w, const int *set, int n, int flags) {
+    int m = 0;
+    w->gen++;
+    for (int k = 0; k < n; k++) {
+        const ReInst *i = &re->inst[set[k]];
+        if (i->op == RI_MATCH) return 1;
+        if (i->op == RI_EOL && (flags & RE_AT_END)) re_closure(re, w, set[k] + 1, flags, w->tmp, &m);
+    }
+    for (int k = 0; k < m; k++)
+        if (re->inst[w->tmp[k]].op == RI_MATCH) return 1;
+    return 0;
+}
+
+static int re_cmp_int(const void *x, const void *y) {
+    return *(const int *)x - *(const int *)y;
+}
+
+/* The state for set[] (sorted), made if need be; NULL once the cache is
+   full.  Call with re->lock held. */
+static ReState *re_state(Regex *re, const int *set, int n, int start) {
+    for (int i = 0; i < re->nstates; i++) {
+        ReState *st = re->states[i];
+        if (st->start == start && st->n == n && memcmp(st->set, set, n * sizeof(int)) == 0) return st;
+    }
+    if (re->nstates == RE_MAX_STATES) return NULL;
+    ReState *st = calloc(1, sizeof(ReState) + n * sizeof(int));
+    st->start = start;
+    st->n = n;
+    memcpy(st->set, set, n * sizeof(int));
+    st->accept     = re_accepts(re, re->work, set, n, 0);
+    st->accept_end = re_accepts(re, re->work, set, n, RE_AT_END | (start ? RE_AT_START : 0));
+    re->states[re->nstates++] = st;
+    return st;
+}
+
+static ReState *re_initial(const Regex *cre) {
+    Regex *re = (Regex *)cre;
+    ReState *st = atomic_load_explicit(&re->initial, memory_order_acquire);
+    if (st) return st;
+    pthread_mutex_lock(&re->lock);
+    if (!re->work) {
+        re->work = malloc(sizeof(ReWork));
+        re_work_init(re->work, re);
+    }
+    if (!re->initial) {
+        ReWork *w = re->work;
+        int n = 0;
+        w->gen++;
+        re_closure(re, w, 0, RE_AT_START, w->cur, &n);
+        qsort(w->cur, n, sizeof(int), re_cmp_int);
+        atomic_store_explicit(&re->initial, re_state(re, w->cur, n, 1), memory_order_release);
+    }
+    pthread_mutex_unlock(&re->lock);
+    return re->initial;
+}
+
+/* st's successor on byte c, worked out now if no text needed it before. */
+static ReState *re_next(const Regex *cre, ReState *st, int c) {
+    Regex *re = (Regex *)cre;
+    ReState *nx = atomic_load_explicit(&st->next[c], memory_order_acquire);
+    if (nx) return nx;
+    pthread_mutex_lock(&re->lock);
+    nx = atomic_load_explicit(&st->next[c], memory_order_relaxed);
+    if (!nx) {
+        ReWork *w = re->work;
+        int n = re_step(re, w, st->set, st->n, c, w->nxt);
+        qsort(w->nxt, n, sizeof(int), re_cmp_int);
+        nx = re_state(re, w->nxt, n, 0);
+        if (nx) atomic_store_explicit(&st->next[c], nx, memory_order_release);
+    }
+    pthread_mutex_unlock(&re->lock);
+    return nx;
+}
+
+/* Whether the pattern matches anywhere in s[0..n). */
+static int regex_search(const Regex *re, const char *s, size_t n) {
+    ReState *st = re_initial(re);
+    size_t i = 0;
+    for (; i < n && st; i++) {
+        if (st->accept) return 1;
+        ReState *nx = re_next(re, st, (unsigned char)s[i]);
+        if (!nx) break;
+        st = nx;
+    }
+    if (i == n) return st->accept || st->accept_end;
+
+    /* the cache is full: step the sets themselves from here on */
+    ReWork w;
+    re_work_init(&w, re);
+    int m = st->n, found = 0;
+    memcpy(w.cur, st->set, m * sizeof(int));
+    for (; i < n && !found; i++) {
+        m = re_step(re, &w, w.cur, m, (unsigned char)s[i], w.nxt);
+        int *t = w.cur; w.cur = w.nxt; w.nxt = t;
+        found = re_accepts(re, &w, w.cur, m, 0);
+    }
+    if (!found) found = re_accepts(re, &w, w.cur, m, RE_AT_END);
+    free(w.mark);
+    return found;
+}
+
+/* ── Groups ── */
+typedef struct {
+    int pc;
+    int cap[RE_NCAP];   /* start and end of the match and of each group, or -1 */
+} ReThread;
+
+/* Add t and the threads it becomes without taking a byte to list[], in
+   priority order; a position some earlier thread reached is taken. */
+static void re_add_thread(const Regex *re, ReWork *w, ReThread *stack, ReThread *list, int *n,
+                          const ReThread *t, int pos, int flags) {
+    int sp = 0;
+    stack[sp++] = *t;
+    while (sp > 0) {
+        ReThread th = stack[--sp];
+        if (w->mark[th.pc] == w->gen) continue;
+        w->mark[th.pc] = w->gen;
+        const ReInst *i = &re->inst[th.pc];
+        switch (i->op) {
+        case RI_JMP:
+            th.pc = i->x;
+            stack[sp++] = th;
+            break;
+        case RI_SPLIT:
+            stack[sp] = th;
+            stack[sp++].pc = i->y;
+            th.pc = i->x;
+            stack[sp++] = th;
+            break;
+        case RI_SAVE:
+            th.cap[i->x] = pos;
+            th.pc++;
+            stack[sp++] = th;
+            break;
+        case RI_BOL: case RI_EOL:
+            if (flags & (i->op == RI_BOL ? RE_AT_START : RE_AT_END)) {
+                th.pc++;
+                stack[sp++] = th;
+            }
+            break;
+        default:
+            list[(*n)++] = th;
+            break;
+        }
+    }
+}
+
+/* The leftmost match in s[0..n) that starts at `from` or later: fills
+   cap[] with byte offsets and returns 1, or returns 0. */
+static int regex_find(const Regex *re, const char *s, int n, int from, int *cap) {
+    int ni = re->ninst + 1, cn = 0, found = 0;
+    ReWork w;
+    re_work_init(&w, re);
+    ReThread *buf = malloc(4 * ni * sizeof(ReThread)), *clist = buf, *nlist = buf + ni, *stack = buf + 2 * ni;
+    ReThread start;
+    start.pc = 0;
+    for (int k = 0; k < RE_NCAP; k++) start.cap[k] = -1;
+    w.gen++;
+    for (int pos = from; ; pos++) {
+        int c = pos < n ? (unsigned char)s[pos] : -1, nn = 0;
+        if (!found)     /* a later start ranks below every thread already going */
+            re_add_thread(re, &w, stack, clist, &cn, &start, pos,
+                          (pos == 0 ? RE_AT_START : 0) | (pos == n ? RE_AT_END : 0));
+        if (cn == 0 && found) break;
+        w.gen++;
+        for (int k = 0; k < cn; k++) {
+            ReThread *t = &clist[k];
+            const ReInst *i = &re->inst[t->pc];
+            if (i->op == RI_MATCH) {
+                memcpy(cap, t->cap, sizeof t->cap);
+                found = 1;
+                break;      /* the threads after it rank lower */
+            }
+            if (c >= 0 && RE_HAS(i->cls, c)) {
+                t->pc++;
+                re_add_thread(re, &w, stack, nlist, &nn, t, pos + 1, pos + 1 == n ? RE_AT_END : 0);
+            }
+        }
+        ReThread *tl = clist; clist = nlist; nlist = tl;
+        cn = nn;
+        if (pos == n) break;
+    }
+    free(buf);
+    free(w.mark);
+    return found;
+}
+
+/* ─── Operand compilation ─── */
+/* Mirrors the old resolve(): quoted literal, then number, then variable.  A
+   bare word that never becomes a variable reads as its own text. */
+static Operand compile_operand(Program *p, const char *token) {
+    Operand o;
+    memset(&o, 0, sizeof(o));
 
     /* quoted string literal */
     if (token[0] == '"') {
-        v.type = TYPE_STR;
+        char lit[256];
         size_t len = strlen(token);
         size_t copy = (len > 2) ? len - 2 : 0;
         if (copy >= 256) copy = 255;
-        strncpy(v.str, token + 1, copy);
-        v.str[copy] = '\0';
-        return v;
+        strncpy(lit, token + 1, copy);
+        lit[copy] = '\0';
+        o.kind = OPD_STR;
+        o.str  = prog_strdup(p, lit);
+        return o;
     }
 
     /* numeric literal */
     char *end;
     double d = strtod(token, &end);
     if (*end == '\0') {
-        v.type = TYPE_NUM;
-        v.num  = d;
-        return v;
+        o.kind = OPD_NUM;
+        o.num  = d;
+        return o;
     }
 
     /* variable */
-    Var *var = find_var(token);
-    if (var) return var->val;
-
-    /* treat as string */
-    v.type = TYPE_STR;
-    strncpy(v.str, token, 255);
-    return v;
-}
-
-static double resolve_num(const char *token) {
-    Value v = resolve(token);
-    if (v.type == TYPE_STR) return 0;
-    return v.num;
+    o.kind = OPD_VAR;
+    o.slot = var_slot(p, token);
+    o.str  = p->var_names[o.slot];
+    return o;
 }
 
-static const char *resolve_str(const char *token, char *buf, int bufsize) {
-    Value v = resolve(token);
-    if (v.type == TYPE_NUM)
-        snprintf(buf, bufsize, "%g", v.num);
-    else
-        strncpy(buf, v.str, bufsize - 1);
-    return buf;
+/* A pattern literal keeps all of its text: it is never held in a
+   variable, so the 255-byte limit of strings does not cut it short. */
+static Operand pattern_operand(Program *p, const char *token) {
+    if (token[0] != '"') return compile_operand(p, token);
+    char lit[MAX_LINE];
+    size_t len = strlen(token), copy = len > 2 ? len - 2 : 0;
+    memcpy(lit, token + 1, copy);
+    lit[copy] = '\0';
+    Operand o;
+    memset(&o, 0, sizeof(o));
+    o.kind = OPD_STR;
+    o.str  = prog_strdup(p, lit);
+    return o;
 }
 
-/* ─── Function lookup ─── */
-static FuncDef *find_func(const char *name) {
-    for (int i = 0; i < func_count; i++)
-        if (strcmp(funcs[i].name, name) == 0)
-            return &funcs[i];
-    return NULL;
+static Operand const_operand(double d) {
+    Operand o;
+    memset(&o, 0, sizeof(o));
+    o.kind = OPD_NUM;
+    o.num  = d;
+    return o;
 }
 
-/* ─── Condition evaluation ─── */
+/* ─── Condition compilation ─── */
 /*  "<a> is [not] (greater than|less than|equal to|greater than or equal to|less than or equal to) <b>"
     "<a> is [not] empty"
     "<a> is [not] zero"
+    "<a> matches <pattern>", "<a> does not match <pattern>"
 */
-static int eval_condition(const char *cond_str) {
+static Cond compile_condition(Program *p, const char *cond_str) {
+    Cond c;
+    memset(&c, 0, sizeof(c));
+    c.op = CMP_NEVER;
+
     char buf[MAX_LINE];
     strncpy(buf, cond_str, MAX_LINE - 1);
+    buf[MAX_LINE - 1] = '\0';
     char *s = trim(buf);
 
-    /* tokenize into words */
-    char *words[32];
+    /* tokenize into words, a quoted string being one with its spaces kept */
+    char *words[32], store[2 * MAX_LINE];
     int wc = 0;
-    char *tok = strtok(s, " \t");
-    while (tok && wc < 32) {
-        words[wc++] = tok;
-        tok = strtok(NULL, " \t");
+    size_t used = 0;
+    while (*s && wc < 32) {
+        const char *end = token_end(s);
+        size_t len = end - s;
+        words[wc++] = memcpy(store + used, s, len);
+        store[used + len] = '\0';
+        used += len + 1;
+        for (s = (char *)end; isspace((unsigned char)*s); s++) {}
     }
 
-    if (wc < 3) return 0;
+    if (wc < 3) return c;
 
-    /* find "is" */
+    /* find "is", or "matches" / "does not match" */
     int is_idx = -1;
-    for (int i = 0; i < wc; i++)
-        if (strcmp(words[i], "is") == 0) { is_idx = i; break; }
-    if (is_idx < 0) return 0;
+    for (int i = 0; i < wc && is_idx < 0; i++)
+        if (strcmp(words[i], "is") == 0 || strcmp(words[i], "matches") == 0 ||
+            (strcmp(words[i], "does") == 0 && i + 2 < wc && strcmp(words[i + 1], "not") == 0 &&
+             strcmp(words[i + 2], "match") == 0))
+            is_idx = i;
+    if (is_idx < 0) return c;
 
-    /* left operand (could be multi-word but let's take first word(s) before 'is') */
-    char lhs[MAX_NAME] = "";
+    /* left operand is every word before 'is' */
+    char lhs[MAX_LINE] = "";
     for (int i = 0; i < is_idx; i++) {
         if (i) strcat(lhs, " ");
         strcat(lhs, words[i]);
     }
 
-    int neg = 0;
     int op_start = is_idx + 1;
-    if (op_start < wc && strcmp(words[op_start], "not") == 0) {
-        neg = 1;
+    if (op_start < wc && words[is_idx][0] != 'm' && strcmp(words[op_start], "not") == 0) {
+        c.neg = 1;
         op_start++;
     }
 
-    /* rhs is last word(s) after operator */
-    /* detect operator */
-    char op[64] = "";
+    /* detect operator, longest form first */
+    c.op = CMP_NONE;
     int rhs_start = op_start;
-    /* try multi-word operators */
-    if (op_start + 3 < wc &&
+    if (words[is_idx][0] != 'i') {
+        c.op = CMP_MATCH;
+        rhs_start = c.neg ? op_start + 1 : op_start;    /* past "does not match" */
+    } else if (op_start + 3 < wc &&
         strcmp(words[op_start], "greater") == 0 &&
         strcmp(words[op_start+1], "than") == 0 &&
         strcmp(words[op_start+2], "or") == 0 &&
         strcmp(words[op_start+3], "equal") == 0 &&
         op_start+4 < wc && strcmp(words[op_start+4], "to") == 0) {
-        strcpy(op, ">="); rhs_start = op_start + 5;
+        c.op = CMP_GE; rhs_start = op_start + 5;
     } else if (op_start + 3 < wc &&
         strcmp(words[op_start], "less") == 0 &&
         strcmp(words[op_start+1], "than") == 0 &&
         strcmp(words[op_start+2], "or") == 0 &&
         strcmp(words[op_start+3], "equal") == 0 &&
         op_start+4 < wc && strcmp(words[op_start+4], "to") == 0) {
-        strcpy(op, "<="); rhs_start = op_start + 5;
+        c.op = CMP_LE; rhs_start = op_start + 5;
     } else if (op_start + 2 < wc &&
         strcmp(words[op_start], "greater") == 0 &&
         strcmp(words[op_start+1], "than") == 0) {
-        strcpy(op, ">"); rhs_start = op_start + 2;
+        c.op = CMP_GT; rhs_start = op_start + 2;
     } else if (op_start + 2 < wc &&
         strcmp(words[op_start], "less") == 0 &&
         strcmp(words[op_start+1], "than") == 0) {
-        strcpy(op, "<"); rhs_start = op_start + 2;
+        c.op = CMP_LT; rhs_start = op_start + 2;
     } else if (op_start + 2 < wc &&
         strcmp(words[op_start], "equal") == 0 &&
         strcmp(words[op_start+1], "to") == 0) {
-        strcpy(op, "=="); rhs_start = op_start + 2;
+        c.op = CMP_EQ; rhs_start = op_start + 2;
     } else if (op_start < wc && strcmp(words[op_start], "empty") == 0) {
-        strcpy(op, "empty"); rhs_start = op_start + 1;
+        c.op = CMP_EMPTY; rhs_start = op_start + 1;
     } else if (op_start < wc && strcmp(words[op_start], "zero") == 0) {
-        strcpy(op, "zero"); rhs_start = op_start + 1;
+        c.op = CMP_ZERO; rhs_start = op_start + 1;
     }
 
-    char rhs[MAX_NAME] = "";
+    /* right operand is every word after the operator */
+    char rhs[MAX_LINE] = "";
     for (int i = rhs_start; i < wc; i++) {
         if (i > rhs_start) strcat(rhs, " ");
         strcat(rhs, words[i]);
     }
 
-    int result = 0;
-    if (strcmp(op, "empty") == 0) {
-        Value lv = resolve(lhs);
-        if (lv.type == TYPE_STR) result = (lv.str[0] == '\0');
-        else result = 0;
-    } else if (strcmp(op, "zero") == 0) {
-        result = (resolve_num(lhs) == 0);
-    } else if (strcmp(op, ">") == 0) {
-        result = (resolve_num(lhs) > resolve_num(rhs));
-    } else if (strcmp(op, "<") == 0) {
-        result = (resolve_num(lhs) < resolve_num(rhs));
-    } else if (strcmp(op, ">=") == 0) {
-        result = (resolve_num(lhs) >= resolve_num(rhs));
-    } else if (strcmp(op, "<=") == 0) {
-        result = (resolve_num(lhs) <= resolve_num(rhs));
-    } else if (strcmp(op, "==") == 0) {
-        Value lv = resolve(lhs), rv = resolve(rhs);
-        if (lv.type == TYPE_STR || rv.type == TYPE_STR) {
-            char lb[256], rb[256];
-            resolve_str(lhs, lb, 256);
-            resolve_str(rhs, rb, 256);
-            result = (strcmp(lb, rb) == 0);
-        } else {
-            result = (lv.num == rv.num);
-        }
-    }
+    c.lhs = compile_operand(p, lhs);
+    c.rhs = c.op == CMP_MATCH ? pattern_operand(p, rhs) : compile_operand(p, rhs);
+    if (c.op == CMP_MATCH && c.rhs.kind == OPD_STR) c.re = regex_for(p, c.rhs.str);
+    return c;
+}
 
-    return neg ? !result : result;
+/* Condition text is the line from token `from` up to token `to` ("then"),
+   as written. */
+static Cond compile_clause(Program *p, const char *line, int from, int to) {
+    char cond[MAX_LINE];
+    const char *start = token_at(line, from), *end = token_at(line, to);
+    size_t len = end - start;
+    if (len >= MAX_LINE) len = MAX_LINE - 1;
+    memcpy(cond, start, len);
+    cond[len] = '\0';
+    return compile_condition(p, cond);
 }
 
-/* ─── Forward declarations ─── */
-static int execute(int start, int end_excl);
+static int find_token(char tok[][MAX_NAME], int tc, int from, const char *word) {
+    for (int i = from; i < tc; i++)
+        if (strcmp(tok[i], word) == 0) return i;
+    return -1;
+}
 
-/* ─── Find matching "end X" for block starting at line `from` ─── */
-static int find_end(int from, const char *end_keyword) {
-    int depth = 1;
-    for (int i = from + 1; i < line_count; i++) {
-        char *l = trim(lines[i]);
-        if (startswith(l, "if ") || startswith(l, "while ") || startswith(l, "repeat ") || startswith(l, "define "))
-            depth++;
-        if (startswith(l, end_keyword) || startswith(l, "end "))
-            depth--;
-        if (depth == 0) return i;
+static void compile_args(Program *p, Instr *ins, char tok[][MAX_NAME], int from, int to, int skip_and) {
+    ins->args  = prog_alloc(p, (to > from ? to - from : 1) * sizeof(Operand));
+    ins->nargs = 0;
+    for (int i = from; i < to; i++) {
+        if (skip_and && strcmp(tok[i], "and") == 0) continue;
+        ins->args[ins->nargs++] = compile_operand(p, tok[i]);
     }
-    return line_count;
 }
 
-/* ─── Parse tokens from line (space-separated, respecting quotes) ─── */
-static int tokenize(const char *line, char tokens[][MAX_NAME], int max_tok) {
-    int count = 0;
-    const char *p = line;
-    while (*p && count < max_tok) {
-        while (isspace((unsigned char)*p)) p++;
-        if (!*p) break;
-        if (*p == '"') {
-            /* quoted string */
-            const char *start = p++;
-            while (*p && *p != '"') p++;
-            if (*p == '"') p++;
-            int len = (int)(p - start);
-            if (len >= MAX_NAME) len = MAX_NAME - 1;
-            strncpy(tokens[count], start, len);
-            tokens[count][len] = '\0';
-            count++;
-        } else {
-            const char *start = p;
-            while (*p && !isspace((unsigned char)*p)) p++;
-            int len = (int)(p - start);
-            if (len >= MAX_NAME) len = MAX_NAME - 1;
-            strncpy(tokens[count], start, len);
-            tokens[count][len] = '\0';
-            count++;
+static int find_func(const Program *p, const char *name) {
+    for (int i = 0; i < p->func_count; i++)
+        if (strcmp(p->funcs[i].name, name) == 0)
+            return i;
+    return -1;
+}
+
+/* Split a format template into args once, at load time: each run of
+   literal text becomes a string operand, each {name} or {name:spec} the
+   operand for name, with fmt saying how to render it.  A spec is
+   [<|>][0][width][.precision]; {{ and }} stand for braces.  Returns 0 if
+   the template is malformed. */
+static int compile_format(Program *p, Instr *ins, const char *tmpl, size_t n) {
+    int max = 1;
+    for (size_t i = 0; i < n; i++)
+        if (tmpl[i] == '{') max += 2;
+    FmtSpec *fmt = prog_alloc(p, max * sizeof(FmtSpec));
+    ins->args  = prog_alloc(p, max * sizeof(Operand));
+    ins->fmt   = fmt;
+    ins->nargs = 0;
+    char lit[256];
+    size_t ln = 0;
+    for (size_t i = 0; i <= n; i++) {
+        char c = i < n ? tmpl[i] : '\0';
+        if ((c == '{' || c == '}') && i + 1 < n && tmpl[i + 1] == c) {
+            if (ln < 255) lit[ln++] = c;
+            i++;
+            continue;
         }
+        if (c != '{' && i < n) {
+            if (ln < 255) lit[ln++] = c;
+            continue;
+        }
+        if (ln > 0) {   /* the literal run ends here */
+            Operand *o = &ins->args[ins->nargs];
+            lit[ln] = '\0';
+            o->kind = OPD_STR;
+            o->str  = prog_strdup(p, lit);
+            fmt[ins->nargs++].prec = -1;
+            ln = 0;
+        }
+        if (i == n) break;
+
+        size_t end = i + 1, colon = 0;
+        while (end < n && tmpl[end] != '}') {
+            if (tmpl[end] == ':' && !colon) colon = end;
+            end++;
+        }
+        size_t name_end = colon ? colon : end;
+        if (end == n || name_end == i + 1 || name_end - i - 1 >= MAX_NAME) return 0;
+        char name[MAX_NAME];
+        memcpy(name, tmpl + i + 1, name_end - i - 1);
+        name[name_end - i - 1] = '\0';
+        for (char *q = name; *q; q++)
+            if (isspace((unsigned char)*q)) return 0;
+
+        FmtSpec *f = &fmt[ins->nargs];
+        f->prec = -1;
+        if (colon) {
+            const char *q = tmpl + colon + 1, *stop = tmpl + end;
+            if (q < stop && (*q == '<' || *q == '>')) f->align = *q++;
+            if (q < stop && *q == '0') { f->zero = 1; q++; }
+            for (; q < stop && isdigit((unsigned char)*q); q++)
+                if (f->width < 255) f->width = f->width * 10 + (*q - '0');
+            if (q < stop && *q == '.') {
+                if (++q == stop || !isdigit((unsigned char)*q)) return 0;
+                for (f->prec = 0; q < stop && isdigit((unsigned char)*q); q++)
+                    if (f->prec < 255) f->prec = f->prec * 10 + (*q - '0');
+            }
+            if (q != stop) return 0;
+            if (f->width > 255) f->width = 255;
+            if (f->prec > 255) f->prec = 255;
+        }
+        ins->args[ins->nargs++] = compile_operand(p, name);
+        i = end;
     }
-    return count;
+    return 1;
 }
 
-/* ─── Execute a single line, return next line index ─── */
-static int exec_line(int idx) {
-    char buf[MAX_LINE];
-    strncpy(buf, lines[idx], MAX_LINE - 1);
-    char *line = trim(buf);
+/* ─── Compile a single line ─── */
+static void compile_line(Program *p, int idx) {
+    Instr *ins = &p->code[idx];
+    char *line = p->lines[idx];
+    ins->op = OP_NOP;
+    ins->dst = ins->arr = ins->arr2 = ins->target = ins->func = -1;
 
     if (line[0] == '\0' || startswith(line, "#") || startswith(line, "//"))
-        return idx + 1;
+        return;
 
-    char tok[32][MAX_NAME];
-    int tc = tokenize(line, tok, 32);
-    if (tc == 0) return idx + 1;
+    char tok[MAX_TOKENS][MAX_NAME];
+    int tc = tokenize(line, tok, MAX_TOKENS);
+    if (tc == 0) return;
 
     /* ── set <var> to <value/expr> ── */
     if (strcmp(tok[0], "set") == 0 && tc >= 4 && strcmp(tok[2], "to") == 0) {
-        Var *v = get_or_create_var(tok[1]);
-        /* check for expressions: set x to a plus b */
-        if (tc >= 6 && (strcmp(tok[4], "plus") == 0 || strcmp(tok[4], "minus") == 0 ||
-                        strcmp(tok[4], "times") == 0 || strcmp(tok[4], "divided") == 0 ||
-                        strcmp(tok[4], "modulo") == 0 || strcmp(tok[4], "to") == 0)) {
-            /* handled below via add/subtract etc. but let's do inline */
-        }
-        /* simple: set x to <val> */
-        Value val = resolve(tok[3]);
+        ins->dst = var_slot(p, tok[1]);
+        ins->op  = OP_SET;
+        ins->a   = compile_operand(p, tok[3]);
         if (tc > 4) {
             /* set x to a plus/minus/times/divided by/modulo b */
             if (strcmp(tok[4], "plus") == 0 && tc >= 6) {
-                val.type = TYPE_NUM;
-                val.num = resolve_num(tok[3]) + resolve_num(tok[5]);
+                ins->op = OP_ADD; ins->b = compile_operand(p, tok[5]);
             } else if (strcmp(tok[4], "minus") == 0 && tc >= 6) {
-                val.type = TYPE_NUM;
-                val.num = resolve_num(tok[3]) - resolve_num(tok[5]);
+                ins->op = OP_SUB; ins->b = compile_operand(p, tok[5]);
             } else if (strcmp(tok[4], "times") == 0 && tc >= 6) {
-                val.type = TYPE_NUM;
-                val.num = resolve_num(tok[3]) * resolve_num(tok[5]);
+                ins->op = OP_MUL; ins->b = compile_operand(p, tok[5]);
             } else if (strcmp(tok[4], "divided") == 0 && tc >= 7 && strcmp(tok[5], "by") == 0) {
-                double d = resolve_num(tok[6]);
-                val.type = TYPE_NUM;
-                val.num = (d != 0) ? resolve_num(tok[3]) / d : 0;
+                ins->op = OP_DIV; ins->b = compile_operand(p, tok[6]);
             } else if (strcmp(tok[4], "modulo") == 0 && tc >= 6) {
-                long a = (long)resolve_num(tok[3]);
-                long b = (long)resolve_num(tok[5]);
-                val.type = TYPE_NUM;
-                val.num = (b != 0) ? (double)(a % b) : 0;
+                ins->op = OP_MOD; ins->b = compile_operand(p, tok[5]);
             } else if (strcmp(tok[4], "power") == 0 && tc >= 6) {
-                val.type = TYPE_NUM;
-                val.num = pow(resolve_num(tok[3]), resolve_num(tok[5]));
+                ins->op = OP_POW; ins->b = compile_operand(p, tok[5]);
             } else if (strcmp(tok[4], "concatenated") == 0 && tc >= 7 && strcmp(tok[5], "with") == 0) {
-                char lb[256], rb[256];
-                resolve_str(tok[3], lb, 256);
-                resolve_str(tok[6], rb, 256);
-                val.type = TYPE_STR;
-                snprintf(val.str, 256, "%s%s", lb, rb);
+                ins->op = OP_CONCAT; ins->b = compile_operand(p, tok[6]);
             }
         }
-        v->val = val;
-        return idx + 1;
+        return;
     }
 
     /* ── add <a> and <b> into <result> ── */
     if (strcmp(tok[0], "add") == 0 && tc >= 5 && strcmp(tok[2], "and") == 0 && strcmp(tok[4], "into") == 0 && tc >= 6) {
-        Var *r = get_or_create_var(tok[5]);
-        r->val.type = TYPE_NUM;
-        r->val.num  = resolve_num(tok[1]) + resolve_num(tok[3]);
-        return idx + 1;
+        ins->op  = OP_ADD;
+        ins->dst = var_slot(p, tok[5]);
+        ins->a   = compile_operand(p, tok[1]);
+        ins->b   = compile_operand(p, tok[3]);
+        return;
     }
 
     /* ── subtract <a> from <b> into <result> ── */
     if (strcmp(tok[0], "subtract") == 0 && tc >= 6 && strcmp(tok[2], "from") == 0 && strcmp(tok[4], "into") == 0) {
-        Var *r = get_or_create_var(tok[5]);
-        r->val.type = TYPE_NUM;
-        r->val.num  = resolve_num(tok[3]) - resolve_num(tok[1]);
-        return idx + 1;
+        ins->op  = OP_SUB;
+        ins->dst = var_slot(p, tok[5]);
+        ins->a   = compile_operand(p, tok[3]);
+        ins->b   = compile_operand(p, tok[1]);
+        return;
     }
 
     /* ── multiply <a> by <b> into <result> ── */
     if (strcmp(tok[0], "multiply") == 0 && tc >= 6 && strcmp(tok[2], "by") == 0 && strcmp(tok[4], "into") == 0) {
-        Var *r = get_or_create_var(tok[5]);
-        r->val.type = TYPE_NUM;
-        r->val.num  = resolve_num(tok[1]) * resolve_num(tok[3]);
-        return idx + 1;
+        ins->op  = OP_MUL;
+        ins->dst = var_slot(p, tok[5]);
+        ins->a   = compile_operand(p, tok[1]);
+        ins->b   = compile_operand(p, tok[3]);
+        return;
     }
 
     /* ── divide <a> by <b> into <result> ── */
     if (strcmp(tok[0], "divide") == 0 && tc >= 6 && strcmp(tok[2], "by") == 0 && strcmp(tok[4], "into") == 0) {
-        Var *r = get_or_create_var(tok[5]);
-        double d = resolve_num(tok[3]);
-        r->val.type = TYPE_NUM;
-        r->val.num  = (d != 0) ? resolve_num(tok[1]) / d : 0;
-        return idx + 1;
-    }
-
-    /* ── increment <var> ── */
-    if (strcmp(tok[0], "increment") == 0 && tc >= 2) {
-        Var *v = get_or_create_var(tok[1]);
-        double by = (tc >= 4 && strcmp(tok[2], "by") == 0) ? resolve_num(tok[3]) : 1;
-        v->val.type = TYPE_NUM;
-        v->val.num += by;
-        return idx + 1;
+        ins->op  = OP_DIV;
+        ins->dst = var_slot(p, tok[5]);
+        ins->a   = compile_operand(p, tok[1]);
+        ins->b   = compile_operand(p, tok[3]);
+        return;
     }
 
-    /* ── decrement <var> ── */
-    if (strcmp(tok[0], "decrement") == 0 && tc >= 2) {
-        Var *v = get_or_create_var(tok[1]);
-        double by = (tc >= 4 && strcmp(tok[2], "by") == 0) ? resolve_num(tok[3]) : 1;
-        v->val.type = TYPE_NUM;
-        v->val.num -= by;
-        return idx + 1;
+    /* ── increment <var> / decrement <var> [by <n>] ── */
+    if ((strcmp(tok[0], "increment") == 0 || strcmp(tok[0], "decrement") == 0) && tc >= 2) {
+        ins->op  = (tok[0][0] == 'i') ? OP_INC : OP_DEC;
+        ins->dst = var_slot(p, tok[1]);
+        ins->a   = (tc >= 4 && strcmp(tok[2], "by") == 0) ? compile_operand(p, tok[3]) : const_operand(1);
+        return;
     }
 
     /* ── print <val> [and <val2> ...] ── */
     if (strcmp(tok[0], "print") == 0) {
-        char sb[256];
-        /* collect all tokens after "print", skip "and" */
-        int first = 1;
-        for (int i = 1; i < tc; i++) {
-            if (strcmp(tok[i], "and") == 0) continue;
-            if (!first) printf(" ");
-            printf("%s", resolve_str(tok[i], sb, 256));
-            first = 0;
-        }
-        printf("\n");
-        return idx + 1;
+        ins->op = OP_PRINT;
+        compile_args(p, ins, tok, 1, tc, 1);
+        return;
     }
 
     /* ── say <val> ── (alias for print) */
     if (strcmp(tok[0], "say") == 0) {
-        char sb[256];
-        for (int i = 1; i < tc; i++) {
-            if (strcmp(tok[i], "and") == 0) continue;
-            printf("%s ", resolve_str(tok[i], sb, 256));
-        }
-        printf("\n");
-        return idx + 1;
+        ins->op = OP_SAY;
+        compile_args(p, ins, tok, 1, tc, 1);
+        return;
     }
 
     /* ── ask <prompt> into <var> ── */
     if (strcmp(tok[0], "ask") == 0 && tc >= 4) {
-        /* find "into" */
-        int into_idx = -1;
-        for (int i = 1; i < tc; i++)
-            if (strcmp(tok[i], "into") == 0) { into_idx = i; break; }
+        int into_idx = find_token(tok, tc, 1, "into");
         if (into_idx > 0 && into_idx + 1 < tc) {
-            char sb[256];
-            printf("%s ", resolve_str(tok[1], sb, 256));
-            fflush(stdout);
-            char input[256];
-            if (fgets(input, 256, stdin)) {
-                char *nl = strchr(input, '\n');
-                if (nl) *nl = '\0';
-                Var *v = get_or_create_var(tok[into_idx + 1]);
-                char *end;
-                double d = strtod(input, &end);
-                if (*end == '\0' && end != input) {
-                    v->val.type = TYPE_NUM;
-                    v->val.num  = d;
-                } else {
-                    v->val.type = TYPE_STR;
-                    strncpy(v->val.str, input, 255);
-                }
-            }
+            ins->op  = OP_ASK;
+            ins->a   = compile_operand(p, tok[1]);
+            ins->dst = var_slot(p, tok[into_idx + 1]);
         }
-        return idx + 1;
+        return;
     }
 
     /* ── if <condition> then ... [otherwise ...] end if ── */
     if (strcmp(tok[0], "if") == 0) {
-        /* find "then" */
-        int then_idx = -1;
-        for (int i = 1; i < tc; i++)
-            if (strcmp(tok[i], "then") == 0) { then_idx = i; break; }
-        if (then_idx < 0) return idx + 1;
-
-        /* build condition string */
-        char cond[MAX_LINE] = "";
-        for (int i = 1; i < then_idx; i++) {
-            if (i > 1) strcat(cond, " ");
-            strcat(cond, tok[i]);
-        }
-
-        int end_if = find_end(idx, "end if");
-        /* find optional "otherwise" at same depth */
-        int otherwise = -1;
-        int depth = 1;
-        for (int i = idx + 1; i < end_if; i++) {
-            char *l = trim(lines[i]);
-            if (startswith(l, "if ") || startswith(l, "while ") || startswith(l, "repeat ") || startswith(l, "define "))
-                depth++;
-            if (startswith(l, "end ")) depth--;
-            if (depth == 1 && startswith(l, "otherwise")) { otherwise = i; break; }
-        }
-
-        int cond_true = eval_condition(cond);
-        if (cond_true) {
-            int block_end = (otherwise >= 0) ? otherwise : end_if;
-            execute(idx + 1, block_end);
-        } else if (otherwise >= 0) {
-            execute(otherwise + 1, end_if);
-        }
-        return end_if + 1;
+        int then_idx = find_token(tok, tc, 1, "then");
+        if (then_idx < 0) return;
+        ins->op   = OP_IF;
+        ins->cond = compile_clause(p, line, 1, then_idx);
+        return;
     }
 
     /* ── while <condition> then ... end while ── */
     if (strcmp(tok[0], "while") == 0) {
-        int then_idx = -1;
-        for (int i = 1; i < tc; i++)
-            if (strcmp(tok[i], "then") == 0) { then_idx = i; break; }
-        if (then_idx < 0) return idx + 1;
-
-        char cond[MAX_LINE] = "";
-        for (int i = 1; i < then_idx; i++) {
-            if (i > 1) strcat(cond, " ");
-            strcat(cond, tok[i]);
-        }
-
-        int end_while = find_end(idx, "end while");
-        while (eval_condition(cond)) {
-            execute(idx + 1, end_while);
-        }
-        return end_while + 1;
+        int then_idx = find_token(tok, tc, 1, "then");
+        if (then_idx < 0) return;
+        ins->op   = OP_WHILE;
+        ins->cond = compile_clause(p, line, 1, then_idx);
+        return;
     }
 
     /* ── repeat <n> times then ... end repeat ── */
     if (strcmp(tok[0], "repeat") == 0 && tc >= 3 && strcmp(tok[2], "times") == 0) {
-        int n = (int)resolve_num(tok[1]);
-        int end_rep = find_end(idx, "end repeat");
-        for (int i = 0; i < n; i++)
-            execute(idx + 1, end_rep);
-        return end_rep + 1;
+        ins->op = OP_REPEAT;
+        ins->a  = compile_operand(p, tok[1]);
+        return;
     }
 
-    /* ── for <var> from <a> to <b> [step <s>] then ... end for ── */
+    /* ── for <var> from <a> to <b> [step <s>] [distributed [gathering <arr> [and <arr>]...]] then ── */
     if (strcmp(tok[0], "for") == 0 && tc >= 6 && strcmp(tok[2], "from") == 0 && strcmp(tok[4], "to") == 0) {
-        char *varname = tok[1];
-        double from = resolve_num(tok[3]);
-        double to   = resolve_num(tok[5]);
-        double step = 1;
-        if (tc >= 9 && strcmp(tok[6], "step") == 0)
-            step = resolve_num(tok[7]);
-        int end_for = find_end(idx, "end for");
-        Var *v = get_or_create_var(varname);
-        v->val.type = TYPE_NUM;
-        if (step > 0) {
-            for (double d = from; d <= to; d += step) {
-                v->val.num = d;
-                execute(idx + 1, end_for);
-            }
-        } else {
-            for (double d = from; d >= to; d += step) {
-                v->val.num = d;
-                execute(idx + 1, end_for);
+        ins->op  = OP_FOR;
+        ins->dst = var_slot(p, tok[1]);
+        ins->a   = compile_operand(p, tok[3]);
+        ins->b   = compile_operand(p, tok[5]);
+        ins->c   = (tc >= 9 && strcmp(tok[6], "step") == 0) ? compile_operand(p, tok[7]) : const_operand(1);
+        int d = (tc >= 9 && strcmp(tok[6], "step") == 0) ? 8 : 6;
+        if (d < tc && strcmp(tok[d], "distributed") == 0) {
+            /* aux marks the loop; args[i].slot are the gathered arrays */
+            ins->aux = 1;
+            int to = (strcmp(tok[tc - 1], "then") == 0) ? tc - 1 : tc;
+            ins->args  = prog_alloc(p, (to > d ? to - d : 1) * sizeof(Operand));
+            ins->nargs = 0;
+            for (int i = d + 2; d + 1 < to && strcmp(tok[d + 1], "gathering") == 0 && i < to; i++) {
+                if (strcmp(tok[i], "and") == 0 || strcmp(tok[i], "array") == 0) continue;
+                Operand *o = &ins->args[ins->nargs++];
+                memset(o, 0, sizeof *o);
+                o->slot = array_slot(p, tok[i]);
             }
         }
-        return end_for + 1;
+        return;
     }
 
     /* ── define <name> [with <p1> <p2> ...] as ... end define ── */
+    /* registered by collect_funcs; executing the header skips the body */
     if (strcmp(tok[0], "define") == 0 && tc >= 3) {
-        int end_def = find_end(idx, "end define");
-        /* find "as" */
-        int as_idx = -1;
-        for (int i = 2; i < tc; i++)
-            if (strcmp(tok[i], "as") == 0) { as_idx = i; break; }
-
-        FuncDef *f = &funcs[func_count++];
-        strncpy(f->name, tok[1], MAX_NAME - 1);
-        f->start_line = idx + 1;
-        f->end_line   = end_def;
-        f->param_count = 0;
-
-        /* parameters between "with" and "as" */
-        if (as_idx > 0) {
-            int param_start = 2;
-            if (tc > 2 && strcmp(tok[2], "with") == 0) param_start = 3;
-            for (int i = param_start; i < as_idx && f->param_count < 8; i++)
-                strncpy(f->params[f->param_count++], tok[i], MAX_NAME - 1);
-        }
-
-        return end_def + 1;
+        ins->op = OP_JUMP;
+        return;
     }
 
     /* ── call <name> [with <a> <b> ...] ── */
     if (strcmp(tok[0], "call") == 0 && tc >= 2) {
-        FuncDef *f = find_func(tok[1]);
-        if (!f) {
-            fprintf(stderr, "Error: undefined function '%s'\n", tok[1]);
-            return idx + 1;
-        }
-        /* bind parameters */
+        ins->op   = OP_CALL;
+        ins->func = find_func(p, tok[1]);
+        ins->a.str = prog_strdup(p, tok[1]);
         int arg_start = 2;
         if (tc > 2 && strcmp(tok[2], "with") == 0) arg_start = 3;
-        for (int i = 0; i < f->param_count && (arg_start + i) < tc; i++) {
-            Var *pv = get_or_create_var(f->params[i]);
-            pv->val = resolve(tok[arg_start + i]);
+        compile_args(p, ins, tok, arg_start, tc, 0);
+        return;
+    }
+
+    /* ── spawn call <name> [with <a> <b> ...] [into <task>] ── */
+    if (strcmp(tok[0], "spawn") == 0 && tc >= 3 && strcmp(tok[1], "call") == 0) {
+        ins->op   = OP_SPAWN;
+        ins->func = find_func(p, tok[2]);
+        ins->a.str = prog_strdup(p, tok[2]);
+        int arg_end = tc;
+        if (tc >= 5 && strcmp(tok[tc - 2], "into") == 0) {
+            ins->dst = var_slot(p, tok[tc - 1]);
+            arg_end = tc - 2;
+        }
+        int arg_start = 3;
+        if (tc > 3 && strcmp(tok[3], "with") == 0) arg_start = 4;
+        compile_args(p, ins, tok, arg_start, arg_end, 0);
+        return;
+    }
+
+    /* ── create channel <name> [of numbers|strings] [with capacity <n>] ── */
+    if (strcmp(tok[0], "create") == 0 && tc >= 3 && strcmp(tok[1], "channel") == 0) {
+        ins->op  = OP_NEWCHAN;
+        ins->arr = chan_slot(p, tok[2]);
+        ins->aux = -1;
+        int i = 3;
+        if (i + 1 < tc && strcmp(tok[i], "of") == 0) {
+            if (strcmp(tok[i + 1], "numbers") == 0) ins->aux = TYPE_NUM;
+            else if (strcmp(tok[i + 1], "strings") == 0) ins->aux = TYPE_STR;
+            i += 2;
         }
-        execute(f->start_line, f->end_line);
-        return idx + 1;
+        if (i + 2 < tc && strcmp(tok[i], "with") == 0 && strcmp(tok[i + 1], "capacity") == 0)
+            compile_args(p, ins, tok, i + 2, i + 3, 0);
+        return;
+    }
+
+    /* ── send <val> to channel <name> ── */
+    if (strcmp(tok[0], "send") == 0 && tc >= 5 && strcmp(tok[2], "to") == 0 &&
+        strcmp(tok[3], "channel") == 0) {
+        ins->op  = OP_SEND;
+        ins->a   = compile_operand(p, tok[1]);
+        ins->arr = chan_slot(p, tok[4]);
+        return;
+    }
+
+    /* ── receive from channel <name> into <var> ── */
+    if (strcmp(tok[0], "receive") == 0 && tc >= 6 && strcmp(tok[1], "from") == 0 &&
+        strcmp(tok[2], "channel") == 0 && strcmp(tok[4], "into") == 0) {
+        ins->op  = OP_RECV;
+        ins->arr = chan_slot(p, tok[3]);
+        ins->dst = var_slot(p, tok[5]);
+        return;
+    }
+
+    /* ── await <task> [into <var>] ── */
+    if (strcmp(tok[0], "await") == 0 && tc >= 2) {
+        ins->op = OP_AWAIT;
+        ins->a  = compile_operand(p, tok[1]);
+        if (tc >= 4 && strcmp(tok[2], "into") == 0)
+            ins->dst = var_slot(p, tok[3]);
+        return;
     }
 
     /* ── return <value> ── (set special "return" variable) */
     if (strcmp(tok[0], "return") == 0 && tc >= 2) {
-        Var *rv = get_or_create_var("return");
-        rv->val = resolve(tok[1]);
-        return idx + 1;
+        ins->op  = OP_RETURN;
+        ins->dst = p->return_slot;
+        ins->a   = compile_operand(p, tok[1]);
+        return;
     }
 
     /* ── push <val> onto stack ── */
     if (strcmp(tok[0], "push") == 0 && tc >= 4 && strcmp(tok[2], "onto") == 0 && strcmp(tok[3], "stack") == 0) {
-        if (stack_top < MAX_STACK)
-            data_stack[stack_top++] = resolve_num(tok[1]);
-        return idx + 1;
+        ins->op = OP_PUSH;
+        ins->a  = compile_operand(p, tok[1]);
+        return;
     }
 
     /* ── pop from stack into <var> ── */
     if (strcmp(tok[0], "pop") == 0 && tc >= 5 && strcmp(tok[1], "from") == 0 &&
         strcmp(tok[2], "stack") == 0 && strcmp(tok[3], "into") == 0) {
-        Var *v = get_or_create_var(tok[4]);
-        v->val.type = TYPE_NUM;
-        v->val.num  = (stack_top > 0) ? data_stack[--stack_top] : 0;
-        return idx + 1;
+        ins->op  = OP_POP;
+        ins->dst = var_slot(p, tok[4]);
+        return;
     }
 
     /* ── store <val> at address <n> ── */
     if (strcmp(tok[0], "store") == 0 && tc >= 5 && strcmp(tok[2], "at") == 0 &&
         strcmp(tok[3], "address") == 0) {
-        int addr = (int)resolve_num(tok[4]);
-        if (addr >= 0 && addr < MAX_MEM)
-            mem[addr] = resolve_num(tok[1]);
-        return idx + 1;
+        ins->op = OP_STORE;
+        ins->a  = compile_operand(p, tok[1]);
+        ins->b  = compile_operand(p, tok[4]);
+        return;
     }
 
     /* ── load from address <n> into <var> ── */
     if (strcmp(tok[0], "load") == 0 && tc >= 6 && strcmp(tok[1], "from") == 0 &&
         strcmp(tok[2], "address") == 0 && strcmp(tok[4], "into") == 0) {
-        int addr = (int)resolve_num(tok[3]);
-        Var *v = get_or_create_var(tok[5]);
-        v->val.type = TYPE_NUM;
-        v->val.num  = (addr >= 0 && addr < MAX_MEM) ? mem[addr] : 0;
-        return idx + 1;
+        ins->op  = OP_LOAD;
+        ins->a   = compile_operand(p, tok[3]);
+        ins->dst = var_slot(p, tok[5]);
+        return;
     }
 
     /* ── create array <name> ── */
     if (strcmp(tok[0], "create") == 0 && tc >= 3 && strcmp(tok[1], "array") == 0) {
-        get_or_create_array(tok[2]);
-        return idx + 1;
+        ins->op  = OP_NEWARRAY;
+        ins->arr = array_slot(p, tok[2]);
+        return;
     }
 
     /* ── append <val> to array <name> ── */
     if (strcmp(tok[0], "append") == 0 && tc >= 5 && strcmp(tok[2], "to") == 0 &&
         strcmp(tok[3], "array") == 0) {
-        Array *a = get_or_create_array(tok[4]);
-        if (a->size < MAX_ARRAY_SIZE) {
-            a->data[a->size++] = resolve(tok[1]);
-        }
-        return idx + 1;
+        ins->op  = OP_APPEND;
+        ins->a   = compile_operand(p, tok[1]);
+        ins->arr = array_slot(p, tok[4]);
+        return;
     }
 
     /* ── get element <i> of array <name> into <var> ── */
-    if (strcmp(tok[0], "get") == 0 && tc >= 7 && strcmp(tok[1], "element") == 0 &&
+    if (strcmp(tok[0], "get") == 0 && tc >= 8 && strcmp(tok[1], "element") == 0 &&
         strcmp(tok[3], "of") == 0 && strcmp(tok[4], "array") == 0 && strcmp(tok[6], "into") == 0) {
-        int i = (int)resolve_num(tok[2]);
-        Array *a = find_array(tok[5]);
-        Var *v = get_or_create_var(tok[7]);
-        if (a && i >= 0 && i < a->size)
-            v->val = a->data[i];
-        else { v->val.type = TYPE_NUM; v->val.num = 0; }
-        return idx + 1;
+        ins->op  = OP_GETELEM;
+        ins->a   = compile_operand(p, tok[2]);
+        ins->arr = array_slot(p, tok[5]);
+        ins->dst = var_slot(p, tok[7]);
+        return;
     }
 
     /* ── set element <i> of array <name> to <val> ── */
-    if (strcmp(tok[0], "set") == 0 && tc >= 7 && strcmp(tok[1], "element") == 0 &&
+    if (strcmp(tok[0], "set") == 0 && tc >= 8 && strcmp(tok[1], "element") == 0 &&
         strcmp(tok[3], "of") == 0 && strcmp(tok[4], "array") == 0 && strcmp(tok[6], "to") == 0) {
-        int i = (int)resolve_num(tok[2]);
-        Array *a = get_or_create_array(tok[5]);
-        if (i >= 0 && i < MAX_ARRAY_SIZE) {
-            a->data[i] = resolve(tok[7]);
-            if (i >= a->size) a->size = i + 1;
+        ins->op  = OP_SETELEM;
+        ins->a   = compile_operand(p, tok[2]);
+        ins->arr = array_slot(p, tok[5]);
+        ins->b   = compile_operand(p, tok[7]);
+        return;
+    }
+
+    /* ── reduce array <name> with sum|product|min|max into <var> ── */
+    if (strcmp(tok[0], "reduce") == 0 && tc >= 7 && strcmp(tok[1], "array") == 0 &&
+        strcmp(tok[3], "with") == 0 && strcmp(tok[5], "into") == 0) {
+        static const char *ops[] = { "sum", "product", "min", "max" };
+        for (int k = 0; k < 4; k++) {
+            if (strcmp(tok[4], ops[k]) == 0) {
+                ins->op  = OP_REDUCE;
+                ins->aux = k;
+                ins->arr = array_slot(p, tok[2]);
+                ins->dst = var_slot(p, tok[6]);
+                return;
+            }
         }
-        return idx + 1;
+    }
+
+    /* ── map array <name> with <fn> into array <name> ── */
+    if (strcmp(tok[0], "map") == 0 && tc >= 8 && strcmp(tok[1], "array") == 0 &&
+        strcmp(tok[3], "with") == 0 && strcmp(tok[5], "into") == 0 && strcmp(tok[6], "array") == 0) {
+        ins->op   = OP_MAP;
+        ins->arr  = array_slot(p, tok[2]);
+        ins->func = find_func(p, tok[4]);
+        ins->a.str = prog_strdup(p, tok[4]);
+        ins->arr2 = array_slot(p, tok[7]);
+        return;
     }
 
     /* ── size of array <name> into <var> ── */
-    if (strcmp(tok[0], "size") == 0 && tc >= 5 && strcmp(tok[1], "of") == 0 &&
+    if (strcmp(tok[0], "size") == 0 && tc >= 6 && strcmp(tok[1], "of") == 0 &&
         strcmp(tok[2], "array") == 0 && strcmp(tok[4], "into") == 0) {
-        Array *a = find_array(tok[3]);
-        Var *v = get_or_create_var(tok[5]);
-        v->val.type = TYPE_NUM;
-        v->val.num  = a ? a->size : 0;
-        return idx + 1;
+        ins->op  = OP_SIZE;
+        ins->arr = array_slot(p, tok[3]);
+        ins->dst = var_slot(p, tok[5]);
+        return;
     }
 
     /* ── square root of <val> into <var> ── */
     if (strcmp(tok[0], "square") == 0 && tc >= 6 && strcmp(tok[1], "root") == 0 &&
         strcmp(tok[2], "of") == 0 && strcmp(tok[4], "into") == 0) {
-        Var *v = get_or_create_var(tok[5]);
-        v->val.type = TYPE_NUM;
-        v->val.num  = sqrt(resolve_num(tok[3]));
-        return idx + 1;
+        ins->op  = OP_SQRT;
+        ins->a   = compile_operand(p, tok[3]);
+        ins->dst = var_slot(p, tok[5]);
+        return;
     }
 
     /* ── absolute value of <val> into <var> ── */
     if (strcmp(tok[0], "absolute") == 0 && tc >= 6 && strcmp(tok[1], "value") == 0 &&
         strcmp(tok[2], "of") == 0 && strcmp(tok[4], "into") == 0) {
-        Var *v = get_or_create_var(tok[5]);
-        v->val.type = TYPE_NUM;
-        v->val.num  = fabs(resolve_num(tok[3]));
-        return idx + 1;
+        ins->op  = OP_ABS;
+        ins->a   = compile_operand(p, tok[3]);
+        ins->dst = var_slot(p, tok[5]);
+        return;
     }
 
     /* ── length of <str_var> into <var> ── */
     if (strcmp(tok[0], "length") == 0 && tc >= 5 && strcmp(tok[1], "of") == 0 &&
         strcmp(tok[3], "into") == 0) {
-        char sb[256];
-        resolve_str(tok[2], sb, 256);
-        Var *v = get_or_create_var(tok[4]);
-        v->val.type = TYPE_NUM;
-        v->val.num  = strlen(sb);
-        return idx + 1;
+        ins->op  = OP_LEN;
+        ins->a   = compile_operand(p, tok[2]);
+        ins->dst = var_slot(p, tok[4]);
+        return;
     }
 
-    /* ── convert <var> to number ── */
-    if (strcmp(tok[0], "convert") == 0 && tc >= 4 && strcmp(tok[2], "to") == 0 &&
-        strcmp(tok[3], "number") == 0) {
-        Var *v = get_or_create_var(tok[1]);
-        if (v->val.type == TYPE_STR) {
-            v->val.num  = atof(v->val.str);
-            v->val.type = TYPE_NUM;
+    /* ── find <needle> in <str> into <var> ── */
+    if (strcmp(tok[0], "find") == 0 && tc >= 6 && strcmp(tok[2], "in") == 0 &&
+        strcmp(tok[4], "into") == 0) {
+        ins->op  = OP_FIND;
+        ins->a   = compile_operand(p, tok[1]);
+        ins->b   = compile_operand(p, tok[3]);
+        ins->dst = var_slot(p, tok[5]);
+        return;
+    }
+
+    /* ── split <str> by <sep> into array <name> ── */
+    if (strcmp(tok[0], "split") == 0 && tc >= 7 && strcmp(tok[2], "by") == 0 &&
+        strcmp(tok[4], "into") == 0 && strcmp(tok[5], "array") == 0) {
+        ins->op  = OP_SPLIT;
+        ins->a   = compile_operand(p, tok[1]);
+        ins->b   = compile_operand(p, tok[3]);
+        ins->arr = array_slot(p, tok[6]);
+        return;
+    }
+
+    /* ── replace <old> with <new> in <str_var> [into <var>] ── */
+    if (strcmp(tok[0], "replace") == 0 && tc >= 6 && strcmp(tok[2], "with") == 0 &&
+        strcmp(tok[4], "in") == 0) {
+        ins->a = compile_operand(p, tok[1]);
+        ins->b = compile_operand(p, tok[3]);
+        ins->c = compile_operand(p, tok[5]);
+        if (tc >= 8 && strcmp(tok[6], "into") == 0)
+            ins->dst = var_slot(p, tok[7]);
+        else if (ins->c.kind == OPD_VAR)
+            ins->dst = ins->c.slot;     /* in place */
+        ins->op = ins->dst >= 0 ? OP_REPLACE : OP_UNKNOWN;
+        return;
+    }
+
+    /* ── substring of <str> from <i> [to <j>] into <var> ── */
+    if (strcmp(tok[0], "substring") == 0 && tc >= 7 && strcmp(tok[1], "of") == 0 &&
+        strcmp(tok[3], "from") == 0) {
+        int into_idx = (tc >= 9 && strcmp(tok[5], "to") == 0) ? 7 : 5;
+        if (strcmp(tok[into_idx], "into") == 0 && into_idx + 1 < tc) {
+            ins->op  = OP_SUBSTR;
+            ins->a   = compile_operand(p, tok[2]);
+            ins->b   = compile_operand(p, tok[4]);
+            ins->c   = into_idx == 7 ? compile_operand(p, tok[6]) : const_operand(INFINITY);
+            ins->dst = var_slot(p, tok[into_idx + 1]);
         }
-        return idx + 1;
+        return;
     }
 
-    /* ── convert <var> to string ── */
-    if (strcmp(tok[0], "convert") == 0 && tc >= 4 && strcmp(tok[2], "to") == 0 &&
-        strcmp(tok[3], "string") == 0) {
-        Var *v = get_or_create_var(tok[1]);
-        if (v->val.type == TYPE_NUM) {
-            snprintf(v->val.str, 256, "%g", v->val.num);
-            v->val.type = TYPE_STR;
+    /* ── extract <pattern> from <str> into array <name> ── */
+    /* the match is kept as a condition, so passes see what it reads */
+    if (strcmp(tok[0], "extract") == 0 && tc >= 7 && strcmp(tok[2], "from") == 0 &&
+        strcmp(tok[4], "into") == 0 && strcmp(tok[5], "array") == 0) {
+        char pattern[MAX_LINE], text[MAX_LINE];
+        token_full(line, 1, pattern);
+        token_full(line, 3, text);
+        ins->op  = OP_EXTRACT;
+        ins->cond.op  = CMP_MATCH;
+        ins->cond.lhs = compile_operand(p, text);
+        ins->cond.rhs = pattern_operand(p, pattern);
+        if (ins->cond.rhs.kind == OPD_STR) ins->cond.re = regex_for(p, ins->cond.rhs.str);
+        ins->arr = array_slot(p, tok[6]);
+        return;
+    }
+
+    /* ── format "<template>" into <var> ── */
+    /* the template is taken from the line itself, not the (shorter) token */
+    if (strcmp(tok[0], "format") == 0 && tc >= 4 && tok[1][0] == '"' &&
+        strcmp(tok[tc - 2], "into") == 0) {
+        const char *open = strchr(line, '"'), *close = strchr(open + 1, '"');
+        if (close && compile_format(p, ins, open + 1, close - open - 1)) {
+            ins->op  = OP_FORMAT;
+            ins->dst = var_slot(p, tok[tc - 1]);
+        } else {
+            ins->op = OP_UNKNOWN;
         }
-        return idx + 1;
+        return;
+    }
+
+    /* ── convert <var> to number|string ── */
+    if (strcmp(tok[0], "convert") == 0 && tc >= 4 && strcmp(tok[2], "to") == 0 &&
+        (strcmp(tok[3], "number") == 0 || strcmp(tok[3], "string") == 0)) {
+        ins->op  = (tok[3][0] == 'n') ? OP_TONUM : OP_TOSTR;
+        ins->dst = var_slot(p, tok[1]);
+        return;
+    }
+
+    /* ── snapshot to <file> ── */
+    if (strcmp(tok[0], "snapshot") == 0 && tc >= 3 && strcmp(tok[1], "to") == 0) {
+        ins->op = OP_SNAPSHOT;
+        ins->a  = compile_operand(p, tok[2]);
+        return;
     }
 
     /* ── stop ── / ── exit ── */
     if (strcmp(tok[0], "stop") == 0 || strcmp(tok[0], "exit") == 0) {
-        exit(0);
+        ins->op = OP_STOP;
+        return;
     }
 
-    /* ── skip / otherwise / end X (handled by parent) ── */
+    /* ── skip / otherwise / end X (block structure is wired by link_blocks) ── */
     if (strcmp(tok[0], "otherwise") == 0 || startswith(tok[0], "end"))
-        return idx + 1;
+        return;
+
+    /* Unknown instruction: reported each time it executes, as before */
+    ins->op = OP_UNKNOWN;
+}
 
-    /* Unknown instruction */
-    fprintf(stderr, "Warning: unknown instruction on line %d: '%s'\n", idx + 1, line);
-    return idx + 1;
+/* ─── Block structure ─── */
+static int opens_block(const char *l) {
+    return startswith(l, "if ") || startswith(l, "while ") || startswith(l, "repeat ") ||
+           startswith(l, "for ") || startswith(l, "define ");
 }
 
-/* ─── Execute lines [start, end_excl) ─── */
-static int execute(int start, int end_excl) {
-    int i = start;
-    while (i < end_excl && i < line_count) {
-        i = exec_line(i);
+/* Pair every opener with its "end ..." line and turn the block keywords into
+   jumps.  An opener with no matching end runs to the end of the program. */
+static void link_blocks(Program *p) {
+    int *open = malloc((p->line_count + 1) * sizeof(int));
+    int *ends = malloc((p->line_count + 1) * sizeof(int));
+    int *alt  = malloc((p->line_count + 1) * sizeof(int)); /* "otherwise" of an if */
+    int depth = 0;
+    for (int i = 0; i < p->line_count; i++) { ends[i] = p->line_count; alt[i] = -1; }
+
+    for (int i = 0; i < p->line_count; i++) {
+        const char *l = p->lines[i];
+        if (opens_block(l)) {
+            open[depth++] = i;
+        } else if (startswith(l, "end ")) {
+            if (depth > 0) {
+                int o = open[--depth];
+                ends[o] = i;
+                Instr *close = &p->code[i];
+                switch (p->code[o].op) {
+                case OP_WHILE:  close->op = OP_JUMP; close->target = o; break;
+                case OP_REPEAT: close->op = OP_REPEAT_END; close->target = o; break;
+                case OP_FOR:    close->op = OP_FOR_NEXT; close->target = o; break;
+                case OP_JUMP:   close->op = OP_RET; break; /* end define */
+                default: break;
+                }
+            }
+        } else if (startswith(l, "otherwise") && depth > 0) {
+            int o = open[depth - 1];
+            if (p->code[o].op == OP_IF && alt[o] < 0) alt[o] = i;
+        }
     }
-    return i;
+
+    for (int i = 0; i < p->line_count; i++) {
+        Instr *ins = &p->code[i];
+        int after = (ends[i] < p->line_count) ? ends[i] + 1 : p->line_count;
+        switch (ins->op) {
+        case OP_IF:
+            ins->target = (alt[i] >= 0) ? alt[i] + 1 : after;
+            if (alt[i] >= 0) {
+                p->code[alt[i]].op = OP_JUMP;
+                p->code[alt[i]].target = after;
+            }
+            break;
+        case OP_WHILE: case OP_REPEAT: case OP_FOR: case OP_JUMP:
+            if (ins->target < 0) ins->target = after;
+            break;
+        default: break;
+        }
+    }
+    for (int f = 0; f < p->func_count; f++)
+        p->funcs[f].end_line = ends[p->funcs[f].start_line - 1];
+
+    free(open);
+    free(ends);
+    free(alt);
 }
 
 /* ─── First pass: collect function definitions ─── */
-static void collect_funcs(void) {
-    for (int i = 0; i < line_count; i++) {
-        char buf[MAX_LINE];
-        strncpy(buf, lines[i], MAX_LINE - 1);
-        char *line = trim(buf);
-        char tok[32][MAX_NAME];
-        int tc = tokenize(line, tok, 32);
-        if (tc >= 3 && strcmp(tok[0], "define") == 0) {
-            int end_def = find_end(i, "end define");
-            int as_idx = -1;
-            for (int j = 2; j < tc; j++)
-                if (strcmp(tok[j], "as") == 0) { as_idx = j; break; }
-            FuncDef *f = &funcs[func_count++];
-            strncpy(f->name, tok[1], MAX_NAME - 1);
+static void collect_funcs(Program *p) {
+    for (int i = 0; i < p->line_count; i++) {
+        char tok[MAX_TOKENS][MAX_NAME];
+        int tc = tokenize(p->lines[i], tok, MAX_TOKENS);
+        if (tc >= 3 && strcmp(tok[0], "define") == 0 && p->func_count < MAX_FUNCS) {
+            int as_idx = find_token(tok, tc, 2, "as");
+            FuncDef *f = &p->funcs[p->func_count++];
+            snprintf(f->name, MAX_NAME, "%s", tok[1]);
             f->start_line = i + 1;
-            f->end_line   = end_def;
+            f->end_line   = p->line_count;
             f->param_count = 0;
             if (as_idx > 0) {
                 int ps = 2;
                 if (tc > 2 && strcmp(tok[2], "with") == 0) ps = 3;
-                for (int k = ps; k < as_idx && f->param_count < 8; k++)
-                    strncpy(f->params[f->param_count++], tok[k], MAX_NAME - 1);
+                for (int k = ps; k < as_idx && f->param_count < 8; k++) {
+                    snprintf(f->params[f->param_count], MAX_NAME, "%s", tok[k]);
+                    f->param_slots[f->param_count] = var_slot(p, tok[k]);
+                    f->param_count++;
+                }
             }
-            i = end_def;
         }
     }
 }
 
-/* ─── Load source file ─── */
-static void load_file(const char *path) {
-    FILE *f = fopen(path, "r");
-    if (!f) { perror(path); exit(1); }
-    char buf[MAX_LINE];
-    while (fgets(buf, MAX_LINE, f) && line_count < MAX_LINES) {
-        /* strip trailing newline */
-        buf[strcspn(buf, "\r\n")] = '\0';
-        lines[line_count] = strdup(buf);
-        line_count++;
+/* Mark functions that can park (await, send, receive), directly or through
+   the functions they call.  map refuses them: its calls run to completion
+   on helper threads. */
+static void mark_waiting_funcs(Program *p) {
+    for (int changed = 1; changed; ) {
+        changed = 0;
+        for (int f = 0; f < p->func_count; f++) {
+            FuncDef *fd = &p->funcs[f];
+            if (fd->waits) continue;
+            for (int i = fd->start_line; i < fd->end_line && i < p->line_count; i++) {
+                const Instr *ins = &p->code[i];
+                if (ins->op == OP_AWAIT || ins->op == OP_SEND || ins->op == OP_RECV ||
+                    ((ins->op == OP_CALL || ins->op == OP_MAP) && ins->func >= 0 && p->funcs[ins->func].waits)) {
+                    fd->waits = 1;
+                    changed = 1;
+                    break;
+                }
+            }
+        }
     }
-    fclose(f);
 }
 
-int main(int argc, char *argv[]) {
-    if (argc < 2) {
-        fprintf(stderr, "ENGLANG Interpreter v1.0\nUsage: %s <script.eng>\n", argv[0]);
-        fprintf(stderr, "\nLanguage Quick Reference:\n");
-        fprintf(stderr, "  set x to 42\n");
-        fprintf(stderr, "  set greeting to \"Hello, World!\"\n");
-        fprintf(stderr, "  add x and y into result\n");
-        fprintf(stderr, "  subtract a from b into diff\n");
-        fprintf(stderr, "  multiply x by y into product\n");
-        fprintf(stderr, "  divide a by b into quotient\n");
-        fprintf(stderr, "  increment counter\n");
-        fprintf(stderr, "  decrement counter by 5\n");
-        fprintf(stderr, "  print x and y\n");
-        fprintf(stderr, "  ask \"Enter a number:\" into num\n");
-        fprintf(stderr, "  if x is greater than 5 then\n");
-        fprintf(stderr, "    print x\n");
-        fprintf(stderr, "  otherwise\n");
-        fprintf(stderr, "    print \"small\"\n");
-        fprintf(stderr, "  end if\n");
-        fprintf(stderr, "  while x is less than 100 then\n");
-        fprintf(stderr, "    increment x\n");
-        fprintf(stderr, "  end while\n");
-        fprintf(stderr, "  repeat 10 times\n");
-        fprintf(stderr, "    print x\n");
-        fprintf(stderr, "  end repeat\n");
-        fprintf(stderr, "  for i from 1 to 10 step 1 then\n");
-        fprintf(stderr, "    print i\n");
-        fprintf(stderr, "  end for\n");
-        fprintf(stderr, "  define factorial with n as\n");
-        fprintf(stderr, "    ...\n");
-        fprintf(stderr, "  end define\n");
-        fprintf(stderr, "  call factorial with 5\n");
-        fprintf(stderr, "  push 42 onto stack\n");
-        fprintf(stderr, "  pop from stack into x\n");
-        fprintf(stderr, "  store x at address 0\n");
-        fprintf(stderr, "  load from address 0 into y\n");
-        fprintf(stderr, "  create array nums\n");
-        fprintf(stderr, "  append 10 to array nums\n");
-        fprintf(stderr, "  get element 0 of array nums into val\n");
-        fprintf(stderr, "  square root of x into root\n");
-        fprintf(stderr, "  length of mystring into len\n");
+/* ─── Invariant code motion and common subexpressions ─── */
+/* -O picks which passes run after a program is compiled: -O0 none, -O1
+   superinstructions, counted loops and type inference, -O2 (the default)
+   these two first as well.
+
+   An arithmetic statement that runs on every pass of a loop, whose operands
+   nothing in the loop writes and whose result nothing in the loop reads
+   before it, moves to the loop's head: it runs once each time the loop is
+   entered (after the first test passes) and its own line becomes a nop.
+   The end of such a while loop tests the condition itself (while_end), so
+   the head only runs on entry; a task that yields there resumes at the
+   head, which just computes the same values again.  Loops that call,
+   spawn, map, snapshot or distribute are left alone, since those can see
+   or copy every variable before the statement would have run.
+
+   Within a run of lines nothing jumps into or out of, an arithmetic
+   statement that repeats an earlier one whose operands and result are
+   still unchanged becomes set_n, a copy of that result. */
+static int opt_level = 2;
+
+static int opd_uses(const Operand *o, int slot) {
+    return o->kind == OPD_VAR && o->slot == slot;
+}
+
+/* Whether `ins` itself reads variable `slot` (what a call may read aside). */
+static int instr_reads(const Instr *ins, int slot) {
+    if ((ins->op == OP_INC || ins->op == OP_DEC || ins->op == OP_TONUM || ins->op == OP_TOSTR) &&
+        ins->dst == slot)
+        return 1;   /* updated in place */
+    if (opd_uses(&ins->a, slot) || opd_uses(&ins->b, slot) || opd_uses(&ins->c, slot) ||
+        opd_uses(&ins->cond.lhs, slot) || opd_uses(&ins->cond.rhs, slot))
+        return 1;
+    for (int k = 0; k < ins->nargs; k++)
+        if (opd_uses(&ins->args[k], slot)) return 1;
+    for (int k = 0; k < ins->npre; k++)
+        if (instr_reads(&ins->pre[k], slot)) return 1;
+    return 0;
+}
+
+static int pure_arith(OpCode op) {
+    return (op >= OP_ADD && op <= OP_POW) || op == OP_SQRT || op == OP_ABS;
+}
+
+static int same_operand(const Operand *x, const Operand *y) {
+    if (x->kind != y->kind) return 0;
+    switch (x->kind) {
+    case OPD_NUM: return memcmp(&x->num, &y->num, sizeof x->num) == 0;   /* 0 is not -0 */
+    case OPD_STR: return strcmp(x->str, y->str) == 0;
+    default:      return x->slot == y->slot;
+    }
+}
+
+/* Lines that can only run straight on to the next one. */
+static int straight_line(OpCode op) {
+    switch (op) {
+    case OP_IF: case OP_JUMP: case OP_WHILE: case OP_REPEAT: case OP_REPEAT_END:
+    case OP_FOR: case OP_FOR_NEXT: case OP_WHILE_END: case OP_CALL: case OP_RET:
+    case OP_SPAWN: case OP_MAP: case OP_STOP:
+    case OP_INC_WHILE: case OP_DEC_WHILE: case OP_MOD_IF: case OP_FOR_COUNT:
+        return 0;
+    default:
         return 1;
     }
+}
+
+static int written_in(const Program *p, int from, int to, int slot) {
+    int n = 0;
+    for (int i = from; i <= to; i++)
+        if (p->code[i].dst == slot) n++;
+    return n;
+}
+
+static void hoist_invariants(Program *p) {
+    int n = p->line_count;
+    int *level = malloc((n + 1) * sizeof(int));   /* blocks open around each line */
+    Instr *moved = malloc((n + 1) * sizeof(Instr));
+    for (int i = 0, d = 0; i < n; i++) {
+        if (startswith(p->lines[i], "end ") && d > 0) d--;
+        level[i] = d;
+        if (opens_block(p->lines[i])) d++;
+    }
+    for (int h = 0; h < n; h++) {
+        Instr *head = &p->code[h];
+        if (head->op != OP_WHILE && head->op != OP_REPEAT && (head->op != OP_FOR || head->aux))
+            continue;
+        int e = head->target - 1;
+        if (e <= h || e >= n || p->code[e].target != h) continue;   /* no end line */
+        int ok = 1;
+        for (int i = h + 1; i < e && ok; i++) {
+            const Instr *ins = &p->code[i];
+            ok = !(ins->op == OP_CALL || ins->op == OP_SPAWN || ins->op == OP_MAP ||
+                   ins->op == OP_SNAPSHOT || (ins->op == OP_FOR && ins->aux));
+        }
+        int nmoved = 0;
+        for (int j = h + 1; j < e && ok; j++) {
+            Instr *ins = &p->code[j];
+            if (level[j] != level[h] + 1 || !pure_arith(ins->op) || ins->dst < 0) continue;
+            if ((ins->a.kind == OPD_VAR && written_in(p, h, e, ins->a.slot)) ||
+                (ins->b.kind == OPD_VAR && written_in(p, h, e, ins->b.slot)) ||
+                written_in(p, h, e, ins->dst) != 1)
+                continue;
+            int seen = 0;
+            for (int i = h; i < j && !seen; i++) seen = instr_reads(&p->code[i], ins->dst);
+            if (seen) continue;
+            moved[nmoved++] = *ins;
+            memset(ins, 0, sizeof *ins);
+            ins->op = OP_NOP;
+            ins->dst = ins->arr = ins->arr2 = ins->target = ins->func = -1;
+        }
+        if (nmoved) {
+            head->pre  = prog_alloc(p, nmoved * sizeof(Instr));
+            head->npre = nmoved;
+            memcpy(head->pre, moved, nmoved * sizeof(Instr));
+            if (head->op == OP_WHILE) p->code[e].op = OP_WHILE_END;
+        }
+    }
+    free(level);
+    free(moved);
+}
+
+/* Lines where a run of lines starts: anything may jump there, or the line
+   before may not run straight on to it.  The caller frees the result. */
+static char *block_leaders(const Program *p) {
+    int n = p->line_count;
+    char *leader = calloc(n + 1, 1);
+    leader[0] = 1;
+    for (int f = 0; f < p->func_count; f++)
+        if (p->funcs[f].start_line < n) leader[p->funcs[f].start_line] = 1;
+    for (int i = 0; i < n; i++) {
+        const Instr *ins = &p->code[i];
+        if (!straight_line(ins->op)) leader[i + 1] = 1;
+        if (ins->target >= 0 && ins->target <= n) leader[ins->target] = 1;
+        if ((ins->op == OP_REPEAT_END || ins->op == OP_FOR_NEXT || ins->op == OP_FOR_COUNT) &&
+            ins->target < n)
+            leader[ins->target + 1] = 1;
+        if (ins->op == OP_MOD_IF && i + 2 <= n) leader[i + 2] = 1;
+    }
+    return leader;
+}
+
+static void share_subexpressions(Program *p) {
+    int n = p->line_count;
+    char *leader = block_leaders(p);
+    int *avail = malloc((n + 1) * sizeof(int));
+    int navail = 0;
+    for (int i = 0; i < n; i++) {
+        if (leader[i]) navail = 0;
+        Instr *ins = &p->code[i];
+        int fresh = pure_arith(ins->op) && ins->dst >= 0 && !instr_reads(ins, ins->dst);
+        if (pure_arith(ins->op)) {
+            for (int k = 0; k < navail; k++) {
+                const Instr *e = &p->code[avail[k]];
+                if (e->op != ins->op || !same_operand(&e->a, &ins->a) || !same_operand(&e->b, &ins->b))
+                    continue;
+                ins->op = OP_SET_N;
+                memset(&ins->a, 0, sizeof ins->a);
+                memset(&ins->b, 0, sizeof ins->b);
+                ins->a.kind  = OPD_VAR;
+                ins->a.slot  = e->dst;
+                ins->a.typed = 1;
+                ins->a.str   = p->var_names[e->dst];
+                fresh = 0;
+                break;
+            }
+        }
+        if (ins->dst >= 0) {
+            int kept = 0;
+            for (int k = 0; k < navail; k++) {
+                const Instr *e = &p->code[avail[k]];
+                if (e->dst != ins->dst && !instr_reads(e, ins->dst)) avail[kept++] = avail[k];
+            }
+            navail = kept;
+        }
+        if (fresh) avail[navail++] = i;
+    }
+    free(leader);
+    free(avail);
+}
+
+/* ─── Superinstructions ─── */
+/* Branches skip over lines that do nothing (blank lines, comments, "end
+   if"), and the statement pairs that dominate instruction counts (see
+   PROFILE_PAIRS) are fused into the first instruction of the pair:
+
+     increment/decrement, then "end while"   ->  inc_while/dec_while
+     set r to a modulo b, then "if ... then"   ->  mod_if
+
+   The second line keeps its own instruction, so anything that jumps to it
+   still works, and every line still maps to the instruction at its index.
+   With both, a counting while loop costs one dispatch per pass on top of
+   its body. */
+static int skip_nops(const Program *p, int target) {
+    while (target >= 0 && target < p->line_count && p->code[target].op == OP_NOP) target++;
+    return target;
+}
+
+static void fuse_pairs(Program *p) {
+    for (int i = 0; i < p->line_count; i++) {
+        Instr *ins = &p->code[i];
+        /* for keeps its exit line: a distributed loop's shards stop there */
+        if (ins->op == OP_IF || ins->op == OP_WHILE || ins->op == OP_REPEAT ||
+            (ins->op == OP_JUMP && ins->target > i))
+            ins->target = skip_nops(p, ins->target);
+    }
+    for (int i = 0; i + 1 < p->line_count; i++) {
+        Instr *ins = &p->code[i], *next = &p->code[i + 1];
+        /* inc_while never falls through, so nops may sit before "end while" */
+        int end = skip_nops(p, i + 1);
+        const Instr *close = end < p->line_count ? &p->code[end] : next;
+        if ((ins->op == OP_INC || ins->op == OP_DEC) &&
+            (close->op == OP_JUMP || close->op == OP_WHILE_END) &&
+            close->target <= end && p->code[close->target].op == OP_WHILE) {
+            ins->op     = ins->op == OP_INC ? OP_INC_WHILE : OP_DEC_WHILE;
+            ins->target = close->target;
+        } else if (ins->op == OP_MOD && next->op == OP_IF) {
+            ins->op  = OP_MOD_IF;
+            /* "if r is [not] zero" on the remainder itself needs no lookup */
+            ins->aux = next->cond.op == CMP_ZERO && next->cond.lhs.kind == OPD_VAR &&
+                       next->cond.lhs.slot == ins->dst;
+        }
+    }
+}
 
-    memset(vars, 0, sizeof(vars));
-    memset(arrays, 0, sizeof(arrays));
-    memset(mem, 0, sizeof(mem));
+/* ─── Counted loops ─── */
+/* A for loop runs a number of iterations worked out when it starts, counting
+   them in an integer; the loop variable is from + k * step, so a long loop
+   with a fractional step does not drift.  A fractional step seldom divides
+   the range exactly in binary (0.7 / 0.1 is a hair under 7), so the count
+   allows for a few units of rounding in the bounds, and the value never
+   goes past `to`: from 0 to 0.3 step 0.1 ends on 0.3, not on 0.1 * 3
+   (0.30000000000000004).  Integral bounds and steps are counted exactly.
+   When nothing in the body can see
+   the loop variable (no use of it, no calls, nothing that saves or copies
+   the whole state), the loop is a for_count and only writes the variable
+   when it ends. */
+static long long for_trips(double from, double to, double step) {
+    if (step > 0 ? !(from <= to) : !(from >= to)) return 0;
+    if (step == 0) return LLONG_MAX;        /* never ends */
+    double n;
+    if (from == floor(from) && to == floor(to) && step == floor(step))
+        n = floor((to - from + step) / step);
+    else
+        n = floor((to - from) / step + (fabs(from) + fabs(to)) / fabs(step) * 16 * DBL_EPSILON) + 1;
+    if (!(n >= 1)) return 1;                /* a NaN step ends after one pass */
+    return n < 9e18 ? (long long)n : LLONG_MAX;
+}
+
+static double for_value(double from, double step, double to, long long k) {
+    double x = from + k * step;
+    return (step > 0 ? x > to : x < to) ? to : x;
+}
 
-    load_file(argv[1]);
-    collect_funcs();
-    execute(0, line_count);
+/* Whether `ins` may read or write variable `slot`, or the state as a whole. */
+static int instr_touches(const Instr *ins, int slot) {
+    switch (ins->op) {
+    case OP_CALL: case OP_SPAWN: case OP_MAP: case OP_SNAPSHOT: case OP_FOR:
+        return 1;   /* a nested for may be distributed, which copies everything */
+    default:
+        break;
+    }
+    if (ins->dst == slot || instr_reads(ins, slot)) return 1;
+    for (int k = 0; k < ins->npre; k++)
+        if (ins->pre[k].dst == slot) return 1;
     return 0;
 }
+
+static void count_loops(Program *p) {
+    for (int e = 0; e < p->line_count; e++) {
+        Instr *next = &p->code[e];
+        if (next->op != OP_FOR_NEXT) continue;
+        const Instr *head = &p->code[next->target];
+        if (head->aux) continue;    /* distributed */
+        int seen = 0;
+        for (int i = next->target + 1; i < e && !seen; i++)
+            seen = instr_touches(&p->code[i], head->dst);
+        if (!seen) next->op = OP_FOR_COUNT;
+    }
+}
+
+/* ─── Type inference ─── */
+/* A forward dataflow pass works out, for every line, which variables
+   certainly hold numbers when it runs ("num"; a variable nothing has set
+   yet reads as the number 0) and which have certainly been set ("def"; an
+   unset variable used as a value reads as its own name).  Operands proven
+   numeric are marked typed, so reading them skips the tag checks, and
+   arithmetic on two of them becomes an _n instruction on raw doubles.
+   Everything else keeps the generic, checked path.
+
+   Variables are shared by a function and its callers, so the analysis is
+   whole-program: a call flows into the function with its parameters bound
+   and the function's end flows back to every call site. */
+#define TBITS 64
+#define TGET(b, i) (((b)[(i) / TBITS] >> ((i) % TBITS)) & 1)
+#define TSET(b, i) ((b)[(i) / TBITS] |= (uint64_t)1 << ((i) % TBITS))
+#define TCLR(b, i) ((b)[(i) / TBITS] &= ~((uint64_t)1 << ((i) % TBITS)))
+/* an array's bit in "num": it holds only numbers */
+#define TARRAY(p, slot) ((p)->var_count + (slot))
+
+typedef struct {
+    const Program *p;
+    int        words;
+    uint64_t  *num, *def;     /* per line, on entry */
+    char      *seen, *queued;
+    int       *queue, qhead, qlen;
+    int        from;          /* line whose successors are being updated */
+    const uint64_t *spec;     /* per loop head: assumed on the way in (see types_speculate) */
+    const int *loop_end;      /* per loop head: its last line, else -1 */
+    uint64_t  *tmp;
+} Types;
+
+/* Whether opd_value of `o` is certainly a number. */
+static int types_value_num(const Types *ty, const uint64_t *num, const uint64_t *def, const Operand *o) {
+    (void)ty;
+    if (o->kind == OPD_NUM) return 1;
+    return o->kind == OPD_VAR && TGET(num, o->slot) && TGET(def, o->slot);
+}
+
+static void types_set(uint64_t *num, uint64_t *def, int slot, int is_num) {
+    if (slot < 0) return;
+    TSET(def, slot);
+    if (is_num) TSET(num, slot);
+    else TCLR(num, slot);
+}
+
+/* Parameters are bound one after another, as bind_params does. */
+static void types_bind(const Types *ty, uint64_t *num, uint64_t *def, const FuncDef *f, const Instr *ins) {
+    for (int i = 0; i < f->param_count && i < ins->nargs; i++)
+        types_set(num, def, f->param_slots[i], types_value_num(ty, num, def, &ins->args[i]));
+}
+
+/* map binds an element, its index and a zeroed return value. */
+static void types_bind_map(const Program *p, uint64_t *num, uint64_t *def, const FuncDef *f) {
+    if (f->param_count > 0) types_set(num, def, f->param_slots[0], 0);
+    if (f->param_count > 1) types_set(num, def, f->param_slots[1], 1);
+    types_set(num, def, p->return_slot, 1);
+}
+
+static void types_flow(Types *ty, int to, const uint64_t *num, const uint64_t *def) {
+    if (to < 0 || to >= ty->p->line_count) return;
+    if (ty->spec && ty->loop_end[to] >= 0 && (ty->from < to || ty->from > ty->loop_end[to])) {
+        const uint64_t *s = ty->spec + (size_t)to * ty->words;
+        for (int w = 0; w < ty->words; w++) ty->tmp[w] = num[w] | s[w];
+        num = ty->tmp;
+    }
+    uint64_t *tn = ty->num + (size_t)to * ty->words, *td = ty->def + (size_t)to * ty->words;
+    int changed = 0;
+    if (!ty->seen[to]) {
+        memcpy(tn, num, ty->words * sizeof(uint64_t));
+        memcpy(td, def, ty->words * sizeof(uint64_t));
+        ty->seen[to] = 1;
+        changed = 1;
+    } else {
+        for (int w = 0; w < ty->words; w++) {
+            uint64_t n2 = tn[w] & num[w], d2 = td[w] & def[w];
+            if (n2 != tn[w] || d2 != td[w]) changed = 1;
+            tn[w] = n2;
+            td[w] = d2;
+        }
+    }
+    if (changed && !ty->queued[to]) {
+        ty->queued[to] = 1;
+        ty->queue[(ty->qhead + ty->qlen++) % ty->p->line_count] = to;
+    }
+}
+
+static void mark_typed(Operand *o, const uint64_t *num) {
+    if (o->kind == OPD_VAR && TGET(num, o->slot)) o->typed = 1;
+}
+
+static int opd_numeric(const Operand *o) {
+    return o->kind == OPD_NUM || o->typed;
+}
+
+/* One pass to a fixpoint over ty->num and ty->def. */
+static void types_solve(Types *ty, const int *ret_of, const char *mapped) {
+    const Program *p = ty->p;
+    int n = p->line_count, words = ty->words;
+    uint64_t *num = malloc(words * sizeof(uint64_t)), *def = malloc(words * sizeof(uint64_t));
+    uint64_t *en  = malloc(words * sizeof(uint64_t)), *ed  = malloc(words * sizeof(uint64_t));
+    memset(ty->seen, 0, n);
+    memset(ty->queued, 0, n);
+    ty->qhead = ty->qlen = 0;
+
+    /* nothing is set yet, unset variables read as 0 and arrays are empty */
+    memset(num, 0xff, words * sizeof(uint64_t));
+    memset(def, 0, words * sizeof(uint64_t));
+    ty->from = -1;
+    types_flow(ty, 0, num, def);
+
+    while (ty->qlen > 0) {
+        int i = ty->queue[ty->qhead];
+        ty->qhead = (ty->qhead + 1) % n;
+        ty->qlen--;
+        ty->queued[i] = 0;
+        ty->from = i;
+        const Instr *ins = &p->code[i];
+        memcpy(num, ty->num + (size_t)i * words, words * sizeof(uint64_t));
+        memcpy(def, ty->def + (size_t)i * words, words * sizeof(uint64_t));
+        OpCode op = ins->op == OP_INC_WHILE ? OP_INC : ins->op == OP_DEC_WHILE ? OP_DEC
+                  : ins->op == OP_MOD_IF ? OP_MOD : ins->op;
+        const FuncDef *f = ins->func >= 0 ? &p->funcs[ins->func] : NULL;
+        switch (op) {
+        case OP_ADD: case OP_SUB: case OP_MUL: case OP_DIV: case OP_MOD: case OP_POW:
+        case OP_INC: case OP_DEC: case OP_SQRT: case OP_ABS: case OP_LEN: case OP_TONUM: case OP_FIND:
+        case OP_POP: case OP_LOAD: case OP_SIZE: case OP_REDUCE: case OP_SPAWN: case OP_SET_N:
+            types_set(num, def, ins->dst, 1);
+            break;
+        case OP_CONCAT: case OP_TOSTR: case OP_RECV: case OP_AWAIT: case OP_REPLACE: case OP_SUBSTR:
+        case OP_FORMAT:
+            types_set(num, def, ins->dst, 0);
+            break;
+        case OP_GETELEM:
+            types_set(num, def, ins->dst, TGET(num, TARRAY(p, ins->arr)));
+            break;
+        case OP_APPEND:
+            if (!types_value_num(ty, num, def, &ins->a)) TCLR(num, TARRAY(p, ins->arr));
+            break;
+        case OP_SETELEM:
+            if (!types_value_num(ty, num, def, &ins->b)) TCLR(num, TARRAY(p, ins->arr));
+            break;
+        case OP_MAP:
+            TCLR(num, TARRAY(p, ins->arr2));
+            break;
+        case OP_SPLIT: case OP_EXTRACT:
+            TCLR(num, TARRAY(p, ins->arr));
+            break;
+        case OP_ASK:    /* untouched at end of input */
+            TCLR(num, ins->dst);
+            break;
+        case OP_SET: case OP_RETURN:
+            types_set(num, def, ins->dst, types_value_num(ty, num, def, &ins->a));
+            break;
+        default:
+            break;
+        }
+        switch (op) {
+        case OP_IF: case OP_WHILE: case OP_REPEAT: case OP_FOR:
+            if (op == OP_FOR) types_set(num, def, ins->dst, 1);
+            if (op == OP_FOR && ins->aux)   /* shards append what they gather */
+                for (int k = 0; k < ins->nargs; k++) TCLR(num, TARRAY(p, ins->args[k].slot));
+            types_flow(ty, ins->target, num, def);
+            for (int k = 0; k < ins->npre; k++)     /* hoisted statements run on the way in */
+                types_set(num, def, ins->pre[k].dst, 1);
+            types_flow(ty, i + 1, num, def);
+            break;
+        case OP_JUMP: case OP_WHILE_END:
+            types_flow(ty, ins->target, num, def);
+            break;
+        case OP_REPEAT_END:
+            types_flow(ty, ins->target + 1, num, def);
+            types_flow(ty, i + 1, num, def);
+            break;
+        case OP_FOR_NEXT: case OP_FOR_COUNT: {
+            int var = p->code[ins->target].dst;
+            if (op == OP_FOR_COUNT) types_set(num, def, var, 1);   /* written on the way out */
+            types_flow(ty, i + 1, num, def);
+            types_set(num, def, var, 1);
+            types_flow(ty, ins->target + 1, num, def);
+            break;
+        }
+        case OP_CALL:
+            if (!f) { types_flow(ty, i + 1, num, def); break; }
+            types_bind(ty, num, def, f, ins);
+            types_flow(ty, f->start_line, num, def);
+            break;
+        case OP_SPAWN:
+            if (f) {
+                /* the task starts from a copy of the state before the spawn */
+                memcpy(en, ty->num + (size_t)i * words, words * sizeof(uint64_t));
+                memcpy(ed, ty->def + (size_t)i * words, words * sizeof(uint64_t));
+                types_bind(ty, en, ed, f, ins);
+                types_flow(ty, f->start_line, en, ed);
+            }
+            types_flow(ty, i + 1, num, def);
+            break;
+        case OP_MAP:
+            if (f) {
+                memcpy(en, num, words * sizeof(uint64_t));
+                memcpy(ed, def, words * sizeof(uint64_t));
+                types_bind_map(p, en, ed, f);
+                types_flow(ty, f->start_line, en, ed);
+            }
+            types_flow(ty, i + 1, num, def);
+            break;
+        case OP_RET: {
+            int fi = ret_of[i];
+            if (fi < 0) break;
+            for (int c = 0; c < n; c++)
+                if (p->code[c].op == OP_CALL && p->code[c].func == fi)
+                    types_flow(ty, c + 1, num, def);
+            if (mapped[fi]) {
+                /* a map worker calls the function again with the next element */
+                types_bind_map(p, num, def, &p->funcs[fi]);
+                types_flow(ty, p->funcs[fi].start_line, num, def);
+            }
+            break;
+        }
+        case OP_STOP:
+            break;
+        default:
+            types_flow(ty, i + 1, num, def);
+            break;
+        }
+    }
+    free(num);
+    free(def);
+    free(en);
+    free(ed);
+}
+
+/* Speculation: given the state of the task that made a script hot, each
+   loop assumes on entry that the variables it reads and the arrays it
+   indexes, which held numbers then, still do.  Its head checks that every
+   time it runs; anywhere else -O2 code can be entered from -O1 code (the
+   start of a loop body or of a function) checks the same way before
+   switching.  What the assumptions add over what is proven is exactly
+   what gets checked. */
+static void types_speculate(Types *ty, const Interp *seen, uint64_t *spec, int *loop_end) {
+    const Program *p = ty->p;
+    int n = p->line_count, words = ty->words;
+    for (int h = 0; h < n; h++) {
+        const Instr *head = &p->code[h];
+        loop_end[h] = -1;
+        if (!(head->op == OP_WHILE || head->op == OP_REPEAT || (head->op == OP_FOR && !head->aux)))
+            continue;
+        loop_end[h] = head->target - 1;
+        uint64_t *s = spec + (size_t)h * words;
+        for (int i = h; i <= loop_end[h] && i < n; i++) {
+            const Instr *ins = &p->code[i];
+            const Operand *o[5] = { &ins->a, &ins->b, &ins->c, &ins->cond.lhs, &ins->cond.rhs };
+            for (int k = 0; k < 5; k++)
+                if (o[k]->kind == OPD_VAR && seen->vars[o[k]->slot].used &&
+                    seen->vars[o[k]->slot].val.type == TYPE_NUM)
+                    TSET(s, o[k]->slot);
+            for (int k = 0; k < ins->nargs && !(ins->op == OP_FOR && ins->aux); k++)
+                if (ins->args[k].kind == OPD_VAR && seen->vars[ins->args[k].slot].used &&
+                    seen->vars[ins->args[k].slot].val.type == TYPE_NUM)
+                    TSET(s, ins->args[k].slot);
+            if (ins->op == OP_GETELEM && seen->arrays[ins->arr].nstr == 0)
+                TSET(s, TARRAY(p, ins->arr));
+        }
+    }
+}
+
+static void infer_types(Program *p, const Interp *seen) {
+    int n = p->line_count;
+    for (int f = 0; f < p->func_count; f++)
+        if (p->funcs[f].end_line >= n) return;    /* a body that runs off the end of the file */
+    Types ty = { p, (p->var_count + p->array_count + TBITS - 1) / TBITS };
+    if (n == 0 || ty.words == 0) return;
+    size_t rows = (size_t)n * ty.words * sizeof(uint64_t);
+    ty.num    = malloc(rows);
+    ty.def    = malloc(rows);
+    ty.seen   = calloc(n, 1);
+    ty.queued = calloc(n, 1);
+    ty.queue  = malloc(n * sizeof(int));
+    ty.tmp    = malloc(ty.words * sizeof(uint64_t));
+    int *ret_of = malloc(n * sizeof(int));      /* function a RET line ends */
+    char *mapped = calloc(p->func_count + 1, 1);
+    for (int i = 0; i < n; i++) ret_of[i] = -1;
+    for (int f = 0; f < p->func_count; f++) ret_of[p->funcs[f].end_line] = f;
+    for (int i = 0; i < n; i++)
+        if (p->code[i].op == OP_MAP && p->code[i].func >= 0) mapped[p->code[i].func] = 1;
+    types_solve(&ty, ret_of, mapped);
+
+    if (seen) {
+        /* proven facts, then proven and assumed; the difference is guarded */
+        uint64_t *proven = ty.num, *spec = calloc(1, rows);
+        int *loop_end = malloc(n * sizeof(int));
+        char *reached = ty.seen;
+        ty.num  = malloc(rows);
+        ty.seen = calloc(n, 1);
+        types_speculate(&ty, seen, spec, loop_end);
+        ty.spec = spec;
+        ty.loop_end = loop_end;
+        types_solve(&ty, ret_of, mapped);
+        for (int i = 0; i < n; i++) {
+            Instr *ins = &p->code[i];
+            int entry = loop_end[i] >= 0 || (i > 0 && loop_end[i - 1] >= 0);
+            for (int f = 0; f < p->func_count && !entry; f++) entry = p->funcs[f].start_line == i;
+            if (!entry || !ty.seen[i] || !reached[i]) continue;
+            const uint64_t *b = ty.num + (size_t)i * ty.words, *a = proven + (size_t)i * ty.words;
+            int count = 0;
+            for (int k = 0; k < p->var_count + p->array_count; k++) count += TGET(b, k) && !TGET(a, k);
+            if (count == 0) continue;
+            ins->guard = prog_alloc(p, count * sizeof(int));
+            for (int k = 0; k < p->var_count + p->array_count; k++)
+                if (TGET(b, k) && !TGET(a, k))
+                    ins->guard[ins->nguard++] = k < p->var_count ? k : ~(k - p->var_count);
+        }
+        free(proven);
+        free(spec);
+        free(loop_end);
+        free(reached);
+    }
+
+    for (int i = 0; i < n; i++) {
+        if (!ty.seen[i]) continue;
+        Instr *ins = &p->code[i];
+        const uint64_t *in_num = ty.num + (size_t)i * ty.words;
+        mark_typed(&ins->a, in_num);
+        mark_typed(&ins->b, in_num);
+        mark_typed(&ins->c, in_num);
+        mark_typed(&ins->cond.lhs, in_num);
+        mark_typed(&ins->cond.rhs, in_num);
+        for (int k = 0; k < ins->npre; k++) {
+            mark_typed(&ins->pre[k].a, in_num);
+            mark_typed(&ins->pre[k].b, in_num);
+        }
+        if (ins->op != OP_CALL && ins->op != OP_SPAWN)
+            for (int k = 0; k < ins->nargs; k++) mark_typed(&ins->args[k], in_num);
+        if (ins->op >= OP_ADD && ins->op <= OP_MOD && opd_numeric(&ins->a) && opd_numeric(&ins->b))
+            ins->op = OP_ADD_N + (ins->op - OP_ADD);
+    }
+    free(ty.num);
+    free(ty.def);
+    free(ty.seen);
+    free(ty.queued);
+    free(ty.queue);
+    free(ty.tmp);
+    free(ret_of);
+    free(mapped);
+}
+
+/* ─── Strength reduction ─── */
+/* At -O1 and up, arithmetic with a literal operand is rewritten into
+   something cheaper that gives bit for bit the same double:
+
+     both operands literal           ->  set_n of the result, worked out now
+     a times 1, a divided by 1,
+     a minus 0, a plus -0            ->  set_n of a
+     a divided by 2^k                ->  a times 2^-k (the same real number,
+                                         so the same rounding)
+     a power 0                       ->  set_n of 1, as pow gives even for NaN
+     a power n, 1 <= n <= 64         ->  powi: multiplications by squaring
+                                         when a is an integer small enough
+                                         for every product to be exact, which
+                                         is what pow returns then; pow else
+     a modulo +-2^k                  ->  a mask on the long, with the sign
+                                         fixed up as C's % would have it
+
+   a plus 0 stays: it turns -0 into 0. */
+static double long_mod(double a, double b, double pow2) {
+    long la = (long)a;
+    if (pow2 > 0) {     /* |b| as a long, a power of two */
+        long m = (long)pow2 - 1, r = la & m;
+        if (la < 0 && r) r -= m + 1;
+        return (double)r;
+    }
+    long lb = (long)b;
+    /* x modulo -1 is 0, and the smallest long modulo -1 would trap */
+    return (lb != 0 && lb != -1) ? (double)(la % lb) : 0;
+}
+
+/* x to the power n >= 1; `limit` is the largest integer whose nth power
+   is below 2^53. */
+static double powi(double x, int n, double limit) {
+    if (!(fabs(x) <= limit) || x != floor(x)) return pow(x, n);
+    double r = 1, sq = x;
+    for (;;) {
+        if (n & 1) r *= sq;
+        n >>= 1;
+        if (!n) return r;
+        sq *= sq;
+    }
+}
+
+static double powi_limit(int n) {
+    double l = floor(exp2(53.0 / n));
+    for (; l > 1; l--) {
+        double p = 1;
+        for (int k = 0; k < n; k++) p *= l;
+        if (p < 9007199254740992.0) break;
+    }
+    return l;
+}
+
+/* What an arithmetic statement computes (literals folded at compile time,
+   statements hoisted out of loops). */
+static double arith(OpCode op, double a, double b) {
+    switch (op) {
+    case OP_ADD: return a + b;
+    case OP_SUB: return a - b;
+    case OP_MUL: return a * b;
+    case OP_DIV: return (b != 0) ? a / b : 0;
+    case OP_MOD: return long_mod(a, b, 0);
+    case OP_SQRT: return sqrt(a);
+    case OP_ABS:  return fabs(a);
+    default:      return pow(a, b);
+    }
+}
+
+/* |(long)d| if that is a power of two, else 0. */
+static double long_pow2(double d) {
+    if (!(fabs(d) < 9e18)) return 0;
+    long l = (long)d;
+    if (l < 0) l = -l;
+    return l > 0 && (l & (l - 1)) == 0 ? (double)l : 0;
+}
+
+static int is_literal(const Operand *o, double d) {
+    return o->kind == OPD_NUM && memcmp(&o->num, &d, sizeof d) == 0;
+}
+
+static void copy_operand(Instr *ins, const Operand *from) {
+    Operand o = *from;
+    ins->op = OP_SET_N;
+    ins->a  = o;
+    memset(&ins->b, 0, sizeof ins->b);
+}
+
+static void reduce_strength(Program *p) {
+    for (int i = 0; i < p->line_count; i++) {
+        Instr *ins = &p->code[i];
+        if (ins->op == OP_MOD_IF) {
+            if (ins->b.kind == OPD_NUM) ins->c = const_operand(long_pow2(ins->b.num));
+            continue;
+        }
+        int typed = ins->op >= OP_ADD_N && ins->op <= OP_MOD_N;
+        OpCode op = typed ? OP_ADD + (ins->op - OP_ADD_N) : ins->op;
+        if (!pure_arith(op)) continue;
+        const Operand *a = &ins->a, *b = &ins->b;
+        if (a->kind == OPD_NUM && (b->kind == OPD_NUM || op == OP_SQRT || op == OP_ABS)) {
+            Operand r = const_operand(arith(op, a->num, b->num));
+            copy_operand(ins, &r);
+            continue;
+        }
+        int e;
+        switch (op) {
+        case OP_MUL:
+            if (is_literal(b, 1)) copy_operand(ins, a);
+            else if (is_literal(a, 1)) copy_operand(ins, b);
+            break;
+        case OP_DIV:
+            if (b->kind != OPD_NUM || b->num == 0) break;
+            if (is_literal(b, 1)) copy_operand(ins, a);
+            else if (fabs(frexp(b->num, &e)) == 0.5 && isfinite(1 / b->num)) {
+                ins->op = typed ? OP_MUL_N : OP_MUL;
+                ins->b  = const_operand(1 / b->num);
+            }
+            break;
+        case OP_SUB:
+            if (is_literal(b, 0)) copy_operand(ins, a);
+            break;
+        case OP_ADD:
+            if (is_literal(b, -0.0)) copy_operand(ins, a);
+            else if (is_literal(a, -0.0)) copy_operand(ins, b);
+            break;
+        case OP_MOD:
+            if (b->kind == OPD_NUM) ins->c = const_operand(long_pow2(b->num));
+            break;
+        case OP_POW:
+            if (b->kind != OPD_NUM || b->num != floor(b->num) || b->num < 0 || b->num > 64) break;
+            if (b->num == 0) {
+                Operand one = const_operand(1);
+                copy_operand(ins, &one);
+            } else {
+                ins->op = OP_POWI;
+                ins->c  = const_operand(powi_limit((int)b->num));
+            }
+            break;
+        default:
+            break;
+        }
+    }
+}
+
+/* ─── Bounds checks ─── */
+/* At -O2, get element and set element indexed by a for loop's own
+   variable, directly in the loop (not in a nested for or repeat, which has
+   its own frame), become getelem_u and setelem_u.  When the loop starts,
+   the for line checks once that the first and last values of the variable
+   (every value in between lies between them) index inside each array those
+   accesses use; the result is kept in the loop's frame.  With it, the
+   accesses go straight to the element; without it, they take the checked
+   path as before.  Arrays never shrink except when map, split or extract
+   writes into them, so loops that call a function, or write one of the
+   arrays that way, keep their checks; so does any loop whose body writes
+   the variable itself. */
+static int for_in_bounds(const Interp *in, const Instr *ins, double from, double step, double to,
+                         long long trips) {
+    double last = for_value(from, step, to, trips - 1);
+    double lo = from < last ? from : last, hi = from < last ? last : from;
+    if (!(lo >= 0)) return 0;
+    for (int k = 0; k < ins->nbounds; k++) {
+        const Array *a = &in->arrays[ins->bounds[k]];
+        if (!a->used || !(hi < a->size)) return 0;
+    }
+    return 1;
+}
+
+static void check_bounds_once(Program *p) {
+    int n = p->line_count;
+    int *slots = malloc((p->array_count + 1) * sizeof(int));
+    char *mapped = malloc(p->array_count + 1);
+    for (int h = 0; h < n; h++) {
+        Instr *head = &p->code[h];
+        if (head->op != OP_FOR || head->aux) continue;
+        int e = head->target - 1;
+        if (e <= h || e >= n || p->code[e].op != OP_FOR_NEXT || p->code[e].target != h) continue;
+        int var = head->dst, ok = 1;
+        memset(mapped, 0, p->array_count + 1);
+        for (int i = h + 1; i < e && ok; i++) {
+            const Instr *ins = &p->code[i];
+            ok = ins->op != OP_CALL && ins->dst != var;
+            if (ins->op == OP_MAP) mapped[ins->arr2] = 1;
+            if (ins->op == OP_SPLIT || ins->op == OP_EXTRACT) mapped[ins->arr] = 1;
+        }
+        if (!ok) continue;
+        int nslots = 0;
+        for (int i = h + 1; i < e; i++) {
+            Instr *ins = &p->code[i];
+            if ((ins->op == OP_FOR || ins->op == OP_REPEAT || startswith(p->lines[i], "define ")) &&
+                ins->target > i) {
+                i = ins->target - 1;    /* another frame, or code that runs when called */
+                continue;
+            }
+            if ((ins->op != OP_GETELEM && ins->op != OP_SETELEM) || !opd_uses(&ins->a, var) ||
+                mapped[ins->arr])
+                continue;
+            ins->op = ins->op == OP_GETELEM ? OP_GETELEM_U : OP_SETELEM_U;
+            int k = 0;
+            while (k < nslots && slots[k] != ins->arr) k++;
+            if (k == nslots) slots[nslots++] = ins->arr;
+        }
+        if (nslots) {
+            head->bounds  = prog_alloc(p, nslots * sizeof(int));
+            head->nbounds = nslots;
+            memcpy(head->bounds, slots, nslots * sizeof(int));
+        }
+    }
+    free(slots);
+    free(mapped);
+}
+
+/* ─── Dead stores and temporaries ─── */
+/* At -O2, a backward pass works out which variables are live after each
+   line: read later on some path before being overwritten.  Like type
+   inference it is whole-program, since functions share their callers'
+   variables: a call leads into the function with its parameters bound, the
+   function's end leads back to every caller, a task or a map call keeps
+   its "return", spawn and map hand the function a copy of everything, and
+   a snapshot keeps everything.  The end of the main program and stop keep
+   nothing.
+
+   A line that only stores a value (set, arithmetic, get element, ...)
+   into a variable that is not live after it becomes a nop, over and over
+   until nothing more goes.  Then temporaries, variables only ever live
+   inside one run of lines, share slots when they are never live at the
+   same time, so a loop body's scratch values stay in a few hot variables. */
+static void live_reads(const Instr *ins, uint64_t *b) {
+    const Operand *o[5] = { &ins->a, &ins->b, &ins->c, &ins->cond.lhs, &ins->cond.rhs };
+    for (int k = 0; k < 5; k++)
+        if (o[k]->kind == OPD_VAR) TSET(b, o[k]->slot);
+    for (int k = 0; k < ins->nargs; k++)
+        if (ins->args[k].kind == OPD_VAR) TSET(b, ins->args[k].slot);
+    for (int k = 0; k < ins->npre; k++) live_reads(&ins->pre[k], b);
+    switch (ins->op) {
+    case OP_INC: case OP_DEC: case OP_INC_WHILE: case OP_DEC_WHILE: case OP_TONUM: case OP_TOSTR:
+    case OP_FOR: case OP_ASK:   /* updated in place, or left alone on some path */
+        if (ins->dst >= 0) TSET(b, ins->dst);
+        break;
+    default:
+        break;
+    }
+}
+
+/* Lines that only store into dst, so can go if it is dead. */
+static int store_only(OpCode op) {
+    switch (op) {
+    case OP_SET: case OP_ADD: case OP_SUB: case OP_MUL: case OP_DIV: case OP_MOD: case OP_POW:
+    case OP_CONCAT: case OP_INC: case OP_DEC: case OP_RETURN: case OP_LOAD: case OP_GETELEM:
+    case OP_SIZE: case OP_SQRT: case OP_ABS: case OP_LEN: case OP_TONUM: case OP_TOSTR:
+    case OP_FIND: case OP_REPLACE: case OP_SUBSTR: case OP_FORMAT:
+    case OP_REDUCE: case OP_ADD_N: case OP_SUB_N: case OP_MUL_N: case OP_DIV_N: case OP_MOD_N:
+    case OP_SET_N: case OP_POWI: case OP_GETELEM_U:
+        return 1;
+    default:
+        return 0;
+    }
+}
+
+typedef struct {
+    const Program *p;
+    int        words;
+    uint64_t  *in, *out;    /* per line; line n (the end) has nothing live */
+    int       *ret_of;      /* function a RET line ends, or -1 */
+    char      *keeps_return; /* per function: spawned or mapped */
+} Live;
+
+#define LROW(rows, i) ((rows) + (size_t)(i) * lv->words)
+
+static void live_solve(Live *lv) {
+    const Program *p = lv->p;
+    int n = p->line_count, words = lv->words;
+    uint64_t *in = malloc(words * sizeof(uint64_t)), *fn = malloc(words * sizeof(uint64_t));
+    memset(lv->in, 0, (size_t)(n + 1) * words * sizeof(uint64_t));
+    for (int changed = 1; changed; ) {
+        changed = 0;
+        for (int i = n - 1; i >= 0; i--) {
+            const Instr *ins = &p->code[i];
+            const FuncDef *f = ins->func >= 0 ? &p->funcs[ins->func] : NULL;
+            uint64_t *out = LROW(lv->out, i);
+            memset(out, 0, words * sizeof(uint64_t));
+            memset(fn, 0, words * sizeof(uint64_t));
+            int succ[2] = { i + 1, -1 }, kill = store_only(ins->op) || ins->op == OP_POP;
+            switch (ins->op) {
+            case OP_IF: case OP_WHILE: case OP_REPEAT: case OP_FOR:
+                succ[1] = ins->target;
+                break;
+            case OP_JUMP: case OP_WHILE_END: case OP_INC_WHILE: case OP_DEC_WHILE:
+                succ[0] = ins->target;
+                break;
+            case OP_REPEAT_END: case OP_FOR_NEXT: case OP_FOR_COUNT:
+                succ[1] = ins->target + 1;
+                break;
+            case OP_CALL: case OP_SPAWN: case OP_MAP:
+                if (!f) break;
+                memcpy(fn, LROW(lv->in, f->start_line), words * sizeof(uint64_t));
+                for (int k = 0; k < f->param_count; k++) TCLR(fn, f->param_slots[k]);
+                if (ins->op == OP_CALL) succ[0] = -1;
+                break;
+            case OP_RET:
+                succ[0] = -1;
+                if (lv->ret_of[i] < 0) break;
+                for (int c = 0; c < n; c++)
+                    if (p->code[c].op == OP_CALL && p->code[c].func == lv->ret_of[i])
+                        for (int w = 0; w < words; w++) out[w] |= LROW(lv->in, c + 1)[w];
+                if (lv->keeps_return[lv->ret_of[i]]) TSET(out, p->return_slot);
+                break;
+            case OP_SNAPSHOT:
+                memset(out, 0xff, words * sizeof(uint64_t));
+                break;
+            case OP_STOP:
+                succ[0] = -1;
+                break;
+            default:
+                break;
+            }
+            for (int k = 0; k < 2; k++)
+                if (succ[k] >= 0 && succ[k] <= n)
+                    for (int w = 0; w < words; w++) out[w] |= LROW(lv->in, succ[k])[w];
+            memcpy(in, out, words * sizeof(uint64_t));
+            if (kill && ins->dst >= 0) TCLR(in, ins->dst);
+            if (ins->op == OP_SPAWN && ins->dst >= 0) TCLR(in, ins->dst);   /* set after the copy */
+            for (int w = 0; w < words; w++) in[w] |= fn[w];
+            live_reads(ins, in);
+            if (memcmp(in, LROW(lv->in, i), words * sizeof(uint64_t)) != 0) {
+                memcpy(LROW(lv->in, i), in, words * sizeof(uint64_t));
+                changed = 1;
+            }
+        }
+    }
+    free(in);
+    free(fn);
+}
+
+static void remove_dead_stores(Live *lv) {
+    Program *p = (Program *)lv->p;
+    for (int removed = 1; removed; ) {
+        removed = 0;
+        live_solve(lv);
+        for (int i = 0; i < p->line_count; i++) {
+            Instr *ins = &p->code[i];
+            if (!store_only(ins->op) || ins->dst < 0 || TGET(LROW(lv->out, i), ins->dst)) continue;
+            int *guard = ins->guard, nguard = ins->nguard;    /* still an entry point */
+            memset(ins, 0, sizeof *ins);
+            ins->op = OP_NOP;
+            ins->dst = ins->arr = ins->arr2 = ins->target = ins->func = -1;
+            ins->guard = guard;
+            ins->nguard = nguard;
+            removed = 1;
+        }
+    }
+}
+
+static void rename_slot(Operand *o, const int *to) {
+    if (o->kind == OPD_VAR) o->slot = to[o->slot];
+}
+
+static void rename_instr(Instr *ins, const int *to, char **names) {
+    if (ins->dst >= 0) {
+        ins->dst_name = names[ins->dst];
+        ins->dst = to[ins->dst];
+    }
+    rename_slot(&ins->a, to);
+    rename_slot(&ins->b, to);
+    rename_slot(&ins->c, to);
+    rename_slot(&ins->cond.lhs, to);
+    rename_slot(&ins->cond.rhs, to);
+    for (int k = 0; k < ins->nargs; k++) rename_slot(&ins->args[k], to);
+    for (int k = 0; k < ins->npre; k++) rename_instr(&ins->pre[k], to, names);
+}
+
+/* Slots written by line i. */
+static void live_writes(const Program *p, int i, uint64_t *b) {
+    const Instr *ins = &p->code[i];
+    if (ins->dst >= 0) TSET(b, ins->dst);
+    for (int k = 0; k < ins->npre; k++) TSET(b, ins->pre[k].dst);
+    if ((ins->op == OP_FOR_NEXT || ins->op == OP_FOR_COUNT) && p->code[ins->target].dst >= 0)
+        TSET(b, p->code[ins->target].dst);
+}
+
+static void share_temporaries(Live *lv) {
+    Program *p = (Program *)lv->p;
+    int n = p->line_count, nv = p->var_count, words = lv->words;
+    char *leader = block_leaders(p);
+    uint64_t *temp = calloc(words, sizeof(uint64_t));
+    memset(temp, 0xff, words * sizeof(uint64_t));
+    /* never temporaries: live where a run of lines starts or across a
+       snapshot, call parameters, loop variables and "return" */
+    for (int i = 0; i <= n; i++) {
+        const uint64_t *row = i < n && p->code[i].op == OP_SNAPSHOT ? LROW(lv->out, i)
+                            : leader[i] ? LROW(lv->in, i) : NULL;
+        if (row)
+            for (int w = 0; w < words; w++) temp[w] &= ~row[w];
+    }
+    for (int f = 0; f < p->func_count; f++)
+        for (int k = 0; k < p->funcs[f].param_count; k++) TCLR(temp, p->funcs[f].param_slots[k]);
+    for (int i = 0; i < n; i++)
+        if (p->code[i].op == OP_FOR && p->code[i].dst >= 0) TCLR(temp, p->code[i].dst);
+    TCLR(temp, p->return_slot);
+
+    /* interference: live together after a line, or written by it while another is live */
+    uint64_t *clash = calloc((size_t)nv * words, sizeof(uint64_t));
+    uint64_t *w = malloc(words * sizeof(uint64_t)), *live = malloc(words * sizeof(uint64_t));
+    int *list = malloc((nv + 1) * sizeof(int));
+    for (int i = 0; i < n; i++) {
+        memset(w, 0, words * sizeof(uint64_t));
+        live_writes(p, i, w);
+        live_reads(&p->code[i], w);     /* an operand and the result never share */
+        for (int k = 0; k < words; k++) live[k] = (LROW(lv->out, i)[k] | w[k]) & temp[k];
+        int m = 0;
+        for (int v = 0; v < nv; v++)
+            if (TGET(live, v)) list[m++] = v;
+        for (int x = 0; x < m; x++)
+            for (int y = 0; y < m; y++)
+                if (x != y) TSET(clash + (size_t)list[x] * words, list[y]);
+    }
+
+    /* greedy colouring; each colour is the slot of its first member */
+    int *to = malloc((nv + 1) * sizeof(int));
+    uint64_t *members = calloc((size_t)nv * words, sizeof(uint64_t));
+    int *colours = malloc((nv + 1) * sizeof(int)), ncolours = 0;
+    for (int v = 0; v < nv; v++) {
+        to[v] = v;
+        if (!TGET(temp, v)) continue;
+        int c = 0;
+        for (; c < ncolours; c++) {
+            const uint64_t *mem = members + (size_t)colours[c] * words;
+            int free_ = 1;
+            for (int k = 0; k < words && free_; k++) free_ = !(mem[k] & clash[(size_t)v * words + k]);
+            if (free_) break;
+        }
+        if (c == ncolours) colours[ncolours++] = v;
+        to[v] = colours[c];
+        TSET(members + (size_t)colours[c] * words, v);
+    }
+    for (int i = 0; i < n; i++) {
+        Instr *ins = &p->code[i];
+        rename_instr(ins, to, p->var_names);
+        /* a temporary's type never matters where it is not live */
+        int kept = 0;
+        for (int k = 0; k < ins->nguard; k++)
+            if (ins->guard[k] < 0 || !TGET(temp, ins->guard[k])) ins->guard[kept++] = ins->guard[k];
+        ins->nguard = kept;
+    }
+
+    free(leader);
+    free(temp);
+    free(clash);
+    free(w);
+    free(live);
+    free(list);
+    free(to);
+    free(members);
+    free(colours);
+}
+
+static void trim_variables(Program *p) {
+    int n = p->line_count;
+    for (int f = 0; f < p->func_count; f++)
+        if (p->funcs[f].end_line >= n) return;    /* a body that runs off the end of the file */
+    Live lv = { p, (p->var_count + TBITS - 1) / TBITS };
+    if (n == 0 || lv.words == 0) return;
+    lv.in  = calloc((size_t)(n + 1) * lv.words, sizeof(uint64_t));
+    lv.out = calloc((size_t)(n + 1) * lv.words, sizeof(uint64_t));
+    lv.ret_of = malloc(n * sizeof(int));
+    lv.keeps_return = calloc(p->func_count + 1, 1);
+    for (int i = 0; i < n; i++) lv.ret_of[i] = -1;
+    for (int f = 0; f < p->func_count; f++) lv.ret_of[p->funcs[f].end_line] = f;
+    for (int i = 0; i < n; i++)
+        if ((p->code[i].op == OP_SPAWN || p->code[i].op == OP_MAP) && p->code[i].func >= 0)
+            lv.keeps_return[p->code[i].func] = 1;
+    remove_dead_stores(&lv);
+    share_temporaries(&lv);
+    free(lv.in);
+    free(lv.out);
+    free(lv.ret_of);
+    free(lv.keeps_return);
+}
+
+/* Fills p->code from p->lines, optimized to `level`.  At -O2, `seen` is
+   the state to speculate from, if any. */
+static void compile_code(Program *p, int level, const Interp *seen) {
+    for (int i = 0; i < p->line_count; i++)
+        compile_line(p, i);
+    link_blocks(p);
+    mark_waiting_funcs(p);
+    if (level >= 2) {
+        hoist_invariants(p);
+        share_subexpressions(p);
+    }
+    if (level >= 1) {
+        fuse_pairs(p);
+        count_loops(p);
+        infer_types(p, level >= 2 ? seen : NULL);
+        reduce_strength(p);
+    }
+    if (level >= 2) {
+        check_bounds_once(p);
+        trim_variables(p);
+    }
+}
+
+static Program *compile_program(char **lines, int line_count) {
+    Program *p = calloc(1, sizeof(Program));
+    p->lines      = lines;
+    p->line_count = line_count;
+    p->code       = calloc(line_count + 1, sizeof(Instr));
+    p->return_slot = var_slot(p, "return");
+    collect_funcs(p);
+    /* -O2 starts from the -O1 code and tiers up where it is hot (see Tiers) */
+    compile_code(p, opt_level >= 2 ? 1 : opt_level, NULL);
+    if (opt_level >= 2) p->heat = calloc(line_count + 1, sizeof(atomic_uint));
+    return p;
+}
+
+/* ─── Load source file ─── */
+static char *read_source(const char *path, size_t *len) {
+    FILE *f = fopen(path, "r");
+    if (!f) return NULL;
+    size_t n = 0, cap = 4096;
+    char *text = xrealloc(NULL, cap);
+    size_t got;
+    while ((got = fread(text + n, 1, cap - n, f)) > 0) {
+        n += got;
+        if (n == cap) text = xrealloc(text, cap *= 2);
+    }
+    fclose(f);
+    *len = n;
+    return text;
+}
+
+static Program *compile_source(const char *text, size_t len) {
+    char **lines = malloc(MAX_LINES * sizeof(char *));
+    int line_count = 0;
+    char buf[MAX_LINE];
+    size_t pos = 0;
+    /* cut lines the way fgets(buf, MAX_LINE, f) would */
+    while (pos < len && line_count < MAX_LINES) {
+        int n = 0;
+        while (n < MAX_LINE - 1 && pos < len) {
+            char c = text[pos++];
+            buf[n++] = c;
+            if (c == '\n') break;
+        }
+        buf[n] = '\0';
+        /* strip trailing newline */
+        buf[strcspn(buf, "\r\n")] = '\0';
+        lines[line_count] = strdup(trim(buf));
+        line_count++;
+    }
+    return compile_program(lines, line_count);
+}
+
+static Program *load_file(const char *path) {
+    size_t len;
+    char *text = read_source(path, &len);
+    if (!text) { perror(path); exit(1); }
+    Program *p = compile_source(text, len);
+    free(text);
+    return p;
+}
+
+/* ─── Contexts ─── */
+/* Script data is charged to its run as it is allocated (n < 0 when freed),
+   for --max-memory.  What a line allocates in one go (array growth, a
+   spawned context, a map's results, a channel's queue, captured output) is
+   checked with run_fits first; the interpreter loop catches the rest. */
+static int run_fits(const Run *run, long long n) {
+    return !run->limits.memory ||
+           atomic_load_explicit(&run->memory, memory_order_relaxed) + n <= (long long)run->limits.memory;
+}
+
+static void run_account(Run *run, long long n) {
+    long long used = atomic_fetch_add_explicit(&run->memory, n, memory_order_relaxed) + n;
+    long long peak = atomic_load_explicit(&run->peak, memory_order_relaxed);
+    while (used > peak &&
+           !atomic_compare_exchange_weak_explicit(&run->peak, &peak, used,
+                                                  memory_order_relaxed, memory_order_relaxed))
+        ;
+}
+
+static size_t interp_bytes(const Program *prog) {
+    return sizeof(Interp) + (prog->var_count + 1) * sizeof(Var) + (prog->array_count + 1) * sizeof(Array);
+}
+
+static Interp *interp_new(const Program *prog, struct Run *run) {
+    Interp *in = calloc(1, sizeof(Interp));
+    in->prog   = prog;
+    in->run    = run;
+    in->vars   = calloc(prog->var_count + 1, sizeof(Var));
+    in->arrays = calloc(prog->array_count + 1, sizeof(Array));
+    if (!in->vars || !in->arrays) { fprintf(stderr, "Error: out of memory\n"); exit(1); }
+    run_account(run, interp_bytes(prog));
+    return in;
+}
+
+/* What an array's lanes and strings take. */
+static size_t array_bytes(const Array *a) {
+    size_t n = a->cap * sizeof(double);
+    if (a->str) {
+        n += a->cap * sizeof(char *);
+        for (int k = 0; k < a->size; k++)
+            if (a->str[k]) n += strlen(a->str[k]) + 1;
+    }
+    return n;
+}
+
+static size_t arrays_bytes(const Interp *in) {
+    size_t n = 0;
+    for (int i = 0; i < in->prog->array_count; i++) n += array_bytes(&in->arrays[i]);
+    return n;
+}
+
+/* What interp_clone(in) will charge. */
+static size_t context_bytes(const Interp *in) {
+    return interp_bytes(in->prog) + arrays_bytes(in);
+}
+
+static Interp *interp_clone(const Interp *src) {
+    const Program *prog = src->prog;
+    Interp *in = malloc(sizeof(Interp));
+    memcpy(in, src, sizeof(Interp));
+    in->vars   = malloc((prog->var_count + 1) * sizeof(Var));
+    in->arrays = malloc((prog->array_count + 1) * sizeof(Array));
+    memcpy(in->vars, src->vars, (prog->var_count + 1) * sizeof(Var));
+    memcpy(in->arrays, src->arrays, (prog->array_count + 1) * sizeof(Array));
+    for (int i = 0; i < prog->array_count; i++) {
+        Array *a = &in->arrays[i];
+        const Array *sa = &src->arrays[i];
+        if (!a->num) continue;
+        a->num = xrealloc(NULL, a->cap * sizeof(double));
+        memcpy(a->num, sa->num, a->cap * sizeof(double));
+        if (!a->str) continue;
+        a->str = calloc(a->cap, sizeof(char *));
+        for (int k = 0; k < a->size; k++)
+            if (sa->str[k]) a->str[k] = strdup(sa->str[k]);
+    }
+    run_account(in->run, context_bytes(in));
+    return in;
+}
+
+static void array_clear(Interp *in, Array *a) {
+    run_account(in->run, -(long long)array_bytes(a));
+    if (a->str) {
+        for (int k = 0; k < a->size; k++) free(a->str[k]);
+        free(a->str);
+    }
+    free(a->num);
+    a->num  = NULL;
+    a->str  = NULL;
+    a->nstr = a->size = a->cap = 0;
+}
+
+static void interp_free(Interp *in) {
+    if (!in) return;
+    for (int i = 0; i < in->prog->array_count; i++)
+        array_clear(in, &in->arrays[i]);
+    run_account(in->run, -(long long)interp_bytes(in->prog));
+    free(in->arrays);
+    free(in->vars);
+    free(in);
+}
+
+/* ─── Variable access ─── */
+/* Limits hit while running end only the run that hit them: report and unwind
+   to the vm_run (or map worker) that owns the context. */
+static void fatal(Interp *in, const char *msg) {
+    diag(in->run, "Error: %s\n", msg);
+    longjmp(*in->on_fault, 1);
+}
+
+static Var *var_ref(Interp *in, int slot) {
+    Var *v = &in->vars[slot];
+    if (!v->used) {
+        if (in->var_count >= MAX_VARS) {
+            fatal(in, "too many variables");
+        }
+        in->var_count++;
+        v->used = 1;
+        v->val.type = TYPE_NUM;
+        v->val.num  = 0;
+        v->val.text = 0;
+        v->val.str[0] = '\0';
+    }
+    return v;
+}
+
+/* ─── Array access ─── */
+static Array *find_array(Interp *in, int slot) {
+    return in->arrays[slot].used ? &in->arrays[slot] : NULL;
+}
+
+static Array *array_ref(Interp *in, int slot) {
+    Array *a = &in->arrays[slot];
+    if (!a->used) {
+        if (in->array_count >= MAX_ARRAYS) {
+            fatal(in, "too many arrays");
+        }
+        in->array_count++;
+        a->used = 1;
+        a->size = 0;
+    }
+    return a;
+}
+
+/* Bytes that making room for index n would add to the array. */
+static long long array_growth(const Array *a, int n, int *capp) {
+    if (n < a->cap) return 0;
+    int cap = a->cap ? a->cap : 16;
+    while (cap <= n) cap *= 2;
+    if (cap > MAX_ARRAY_SIZE) cap = MAX_ARRAY_SIZE;
+    if (capp) *capp = cap;
+    return (long long)(cap - a->cap) * (a->str ? sizeof(double) + sizeof(char *) : sizeof(double));
+}
+
+/* Whether that stays within the run's memory limit. */
+static int array_fits(Interp *in, const Array *a, int n) {
+    return run_fits(in->run, array_growth(a, n, NULL));
+}
+
+/* Make room for index n; slots between the old size and n read as 0. */
+static void array_reserve(Interp *in, Array *a, int n) {
+    int cap;
+    long long bytes = array_growth(a, n, &cap);
+    if (!bytes) return;
+    run_account(in->run, bytes);
+    a->num = xrealloc(a->num, cap * sizeof(double));
+    memset(a->num + a->cap, 0, (cap - a->cap) * sizeof(double));
+    if (a->str) {
+        a->str = xrealloc(a->str, cap * sizeof(char *));
+        memset(a->str + a->cap, 0, (cap - a->cap) * sizeof(char *));
+    }
+    a->cap = cap;
+}
+
+static void array_get(const Array *a, int i, Value *v) {
+    v->num  = a->num[i];
+    v->text = 0;
+    if (a->str && a->str[i]) {
+        v->type = TYPE_STR;
+        strcpy(v->str, a->str[i]);
+    } else {
+        v->type = TYPE_NUM;
+        v->str[0] = '\0';
+    }
+}
+
+/* Store into an index below cap. */
+static void array_put(Interp *in, Array *a, int i, const Value *v) {
+    a->num[i] = v->num;
+    if (v->type == TYPE_STR) {
+        long long n = strlen(v->str) + 1;
+        if (!a->str) {
+            a->str = calloc(a->cap, sizeof(char *));
+            n += a->cap * sizeof(char *);
+        }
+        if (a->str[i]) {
+            n -= strlen(a->str[i]) + 1;
+            free(a->str[i]);
+        }
+        else a->nstr++;
+        a->str[i] = strdup(v->str);
+        run_account(in->run, n);
+    } else if (a->str && a->str[i]) {
+        run_account(in->run, -(long long)(strlen(a->str[i]) + 1));
+        free(a->str[i]);
+        a->str[i] = NULL;
+        a->nstr--;
+    }
+}
+
+/* ─── Value resolution ─── */
+/* Typed-in text (ask, script arguments) is a number if all of it parses as
+   one, a string otherwise. */
+static void parse_input(const char *s, Value *v) {
+    char *end;
+    double d = strtod(s, &end);
+    if (*end == '\0' && end != s) {
+        v->type = TYPE_NUM;
+        v->num  = d;
+    } else {
+        v->type = TYPE_STR;
+        v->text = 0;
+        snprintf(v->str, 256, "%s", s);
+    }
+}
+
+static Value opd_value(const Interp *in, const Operand *o) {
+    Value v;
+    v.type = TYPE_NUM;
+    v.num  = 0;
+    v.text = 0;
+    v.str[0] = '\0';
+    switch (o->kind) {
+    case OPD_NUM:
+        v.num = o->num;
+        break;
+    case OPD_STR:
+        v.type = TYPE_STR;
+        strcpy(v.str, o->str);
+        break;
+    case OPD_VAR:
+        if (in->vars[o->slot].used) return in->vars[o->slot].val;
+        v.type = TYPE_STR;
+        strncpy(v.str, o->str, 255);
+        break;
+    }
+    return v;
+}
+
+static double opd_num(const Interp *in, const Operand *o) {
+    if (o->typed) return in->vars[o->slot].val.num;
+    if (o->kind == OPD_NUM) return o->num;
+    if (o->kind == OPD_VAR) {
+        const Var *v = &in->vars[o->slot];
+        if (v->used && v->val.type == TYPE_NUM) return v->val.num;
+    }
+    return 0;
+}
+
+static int opd_is_str(const Interp *in, const Operand *o) {
+    if (o->kind == OPD_VAR) {
+        const Var *v = &in->vars[o->slot];
+        return !v->used || v->val.type == TYPE_STR;
+    }
+    return o->kind == OPD_STR;
+}
+
+/* The text of a number.  It is made the first time something needs it and
+   kept in str, which a number otherwise leaves unused, so printing or
+   comparing the same value again is a check of its bits, and a new number
+   is noticed without every store having to say so. */
+static const char *num_text(Value *v) {
+    if (!v->text || memcmp(&v->shown, &v->num, sizeof v->num) != 0) {
+        snprintf(v->str, 256, "%g", v->num);
+        v->shown = v->num;
+        v->text  = 1;
+    }
+    return v->str;
+}
+
+/* Text of an operand; number literals are formatted into buf, and a
+   variable holding a number keeps its text (the cache is the task's own). */
+static const char *opd_str(const Interp *in, const Operand *o, char *buf, int bufsize) {
+    if (o->kind == OPD_NUM) {
+        snprintf(buf, bufsize, "%g", o->num);
+        return buf;
+    }
+    if (o->kind == OPD_VAR) {
+        Var *v = &in->vars[o->slot];
+        if (!v->used) return o->str;
+        if (v->val.type == TYPE_NUM) return num_text(&v->val);
+        return v->val.str;
+    }
+    return o->str;
+}
+
+/* ─── Text search ─── */
+/* find, split and replace all come down to looking for a needle in a
+   string.  The vector loops try 32 (AVX2) or 16 (SSE2) starting positions
+   at once against the needle's first and last bytes and compare the whole
+   needle only where both match; the scalar loop finishes the tail, and is
+   all there is elsewhere. */
+static const char *text_find(const char *h, size_t hn, const char *nd, size_t nn) {
+    if (nn == 0) return h;
+    if (nn > hn) return NULL;
+    size_t i = 0, last = hn - nn;   /* last position the needle can start at */
+#ifdef __AVX2__
+    __m256i f32 = _mm256_set1_epi8(nd[0]), l32 = _mm256_set1_epi8(nd[nn - 1]);
+    for (; i + 32 <= last + 1; i += 32) {
+        __m256i x = _mm256_loadu_si256((const __m256i *)(h + i));
+        __m256i y = _mm256_loadu_si256((const __m256i *)(h + i + nn - 1));
+        unsigned m = _mm256_movemask_epi8(_mm256_and_si256(_mm256_cmpeq_epi8(x, f32),
+                                                           _mm256_cmpeq_epi8(y, l32)));
+        for (; m; m &= m - 1)
+            if (memcmp(h + i + __builtin_ctz(m), nd, nn) == 0) return h + i + __builtin_ctz(m);
+    }
+#endif
+#ifdef __SSE2__
+    __m128i f16 = _mm_set1_epi8(nd[0]), l16 = _mm_set1_epi8(nd[nn - 1]);
+    for (; i + 16 <= last + 1; i += 16) {
+        __m128i x = _mm_loadu_si128((const __m128i *)(h + i));
+        __m128i y = _mm_loadu_si128((const __m128i *)(h + i + nn - 1));
+        unsigned m = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(x, f16), _mm_cmpeq_epi8(y, l16)));
+        for (; m; m &= m - 1)
+            if (memcmp(h + i + __builtin_ctz(m), nd, nn) == 0) return h + i + __builtin_ctz(m);
+    }
+#endif
+    for (; i <= last; i++)
+        if (h[i] == nd[0] && h[i + nn - 1] == nd[nn - 1] && memcmp(h + i, nd, nn) == 0)
+            return h + i;
+    return NULL;
+}
+
+/* Strings are bytes, but length, positions and split count characters:
+   in text that is valid UTF-8 each encoded code point is one character,
+   and text that is not (stray bytes from some other encoding) counts one
+   per byte.  Most text is ASCII, where the two agree, so the vector loops
+   first skip the ASCII prefix, and most strings end there.  Otherwise the
+   rest is validated, and characters are counted 16 or 32 bytes at a time
+   as the bytes that do not continue a sequence (0x80-0xBF). */
+static size_t text_ascii(const char *s, size_t n) {
+    size_t i = 0;
+#ifdef __AVX2__
+    for (; i + 32 <= n; i += 32) {
+        unsigned m = _mm256_movemask_epi8(_mm256_loadu_si256((const __m256i *)(s + i)));
+        if (m) return i + __builtin_ctz(m);
+    }
+#endif
+#ifdef __SSE2__
+    for (; i + 16 <= n; i += 16) {
+        unsigned m = _mm_movemask_epi8(_mm_loadu_si128((const __m128i *)(s + i)));
+        if (m) return i + __builtin_ctz(m);
+    }
+#endif
+    while (i < n && !(s[i] & 0x80)) i++;
+    return i;
+}
+
+/* Well-formed UTF-8: no stray continuation bytes, truncated or overlong
+   sequences, surrogates, or code points past U+10FFFF. */
+static int utf8_valid(const char *s, size_t n) {
+    const unsigned char *u = (const unsigned char *)s;
+    for (size_t i = 0; i < n; ) {
+        unsigned c = u[i], min, cp;
+        size_t k;
+        if (c < 0x80) { i += text_ascii(s + i, n - i); continue; }
+        if (c >= 0xC2 && c <= 0xDF) k = 1, min = 0x80;
+        else if ((c & 0xF0) == 0xE0) k = 2, min = 0x800;
+        else if (c >= 0xF0 && c <= 0xF4) k = 3, min = 0x10000;
+        else return 0;
+        if (n - i <= k) return 0;
+        cp = c & (0x3F >> k);
+        for (size_t j = 1; j <= k; j++) {
+            if ((u[i + j] & 0xC0) != 0x80) return 0;
+            cp = cp << 6 | (u[i + j] & 0x3F);
+        }
+        if (cp < min || cp > 0x10FFFF || (cp >= 0xD800 && cp <= 0xDFFF)) return 0;
+        i += k + 1;
+    }
+    return 1;
+}
+
+/* Bytes of s[0..n) that start a character. */
+static size_t utf8_leads(const char *s, size_t n) {
+    size_t i = 0, count = 0;
+#ifdef __AVX2__
+    __m256i c32 = _mm256_set1_epi8(-65);    /* 0xBF: continuation bytes are the signed ones below it */
+    for (; i + 32 <= n; i += 32)
+        count += __builtin_popcount(_mm256_movemask_epi8(
+            _mm256_cmpgt_epi8(_mm256_loadu_si256((const __m256i *)(s + i)), c32)));
+#endif
+#ifdef __SSE2__
+    __m128i c16 = _mm_set1_epi8(-65);
+    for (; i + 16 <= n; i += 16)
+        count += __builtin_popcount(_mm_movemask_epi8(
+            _mm_cmpgt_epi8(_mm_loadu_si128((const __m128i *)(s + i)), c16)));
+#endif
+    for (; i < n; i++)
+        count += (s[i] & 0xC0) != 0x80;
+    return count;
+}
+
+/* The character position of byte b of s[0..n). */
+static size_t text_index(const char *s, size_t n, size_t b) {
+    size_t k = text_ascii(s, n);
+    if (b <= k || !utf8_valid(s + k, n - k)) return b;
+    return k + utf8_leads(s + k, b - k);
+}
+
+static size_t text_chars(const char *s, size_t n) {
+    return text_index(s, n, n);
+}
+
+/* The byte where character i of s[0..n) starts, or n past the end. */
+static size_t text_offset(const char *s, size_t n, size_t i) {
+    size_t k = text_ascii(s, n);
+    if (i <= k || !utf8_valid(s + k, n - k)) return i < n ? i : n;
+    for (i -= k; k < n; k++)
+        if ((s[k] & 0xC0) != 0x80 && i-- == 0) break;
+    return k;
+}
+
+/* Whether s[0..n) is UTF-8 beyond ASCII, so patterns take whole
+   characters in it (see Regular expressions). */
+static int text_utf8(const char *s, size_t n) {
+    size_t k = text_ascii(s, n);
+    return k < n && utf8_valid(s + k, n - k);
+}
+
+/* Every occurrence of `from` in s (left to right, not overlapping) becomes
+   `to`; the result is cut at 255 bytes like any other string. */
+static void text_replace(const char *s, const char *from, const char *to, char out[256]) {
+    size_t sn = strlen(s), fn = strlen(from), tn = strlen(to), o = 0;
+    const char *p = s, *end = s + sn, *hit;
+    while (fn && o < 255 && (hit = text_find(p, end - p, from, fn))) {
+        size_t k = hit - p;
+        if (k > 255 - o) k = 255 - o;
+        memcpy(out + o, p, k);
+        o += k;
+        k = tn < 255 - o ? tn : 255 - o;
+        memcpy(out + o, to, k);
+        o += k;
+        p = hit + fn;
+    }
+    size_t rest = end - p;
+    if (rest > 255 - o) rest = 255 - o;
+    memcpy(out + o, p, rest);
+    out[o + rest] = '\0';
+}
+
+/* Render a format line's segments straight into out, in one pass; like
+   every string value, the result stops at 255 characters.  A number is
+   written with %g unless a precision asks for fixed digits. */
+static void text_format(const Interp *in, const Instr *ins, char out[256]) {
+    size_t o = 0;
+    for (int k = 0; k < ins->nargs && o < 255; k++) {
+        const Operand *a = &ins->args[k];
+        const FmtSpec *f = &ins->fmt[k];
+        char nb[512];
+        const char *s;
+        size_t sn, pad = 0;
+        if (!opd_is_str(in, a)) {
+            static const char *const forms[2][3] = {
+                { "%*.*g", "%-*.*g", "%0*.*g" }, { "%*.*f", "%-*.*f", "%0*.*f" }
+            };
+            int how = f->align == '<' ? 1 : f->zero ? 2 : 0;
+            /* a negative precision is no precision: %g's six digits */
+            snprintf(nb, sizeof nb, forms[f->prec >= 0][how], f->width, f->prec, opd_num(in, a));
+            s  = nb;
+            sn = strlen(s);
+        } else {
+            s  = opd_str(in, a, nb, 256);
+            sn = strlen(s);
+            if (f->width || f->prec >= 0) {   /* both count characters */
+                if (f->prec >= 0) sn = text_offset(s, sn, f->prec);
+                size_t chars = text_chars(s, sn);
+                if ((size_t)f->width > chars) pad = f->width - chars;
+            }
+        }
+        size_t room = 255 - o;
+        if (f->align == '>' && pad) {
+            size_t k = pad < room ? pad : room;
+            memset(out + o, ' ', k);
+            o += k;
+            room -= k;
+            pad = 0;
+        }
+        if (sn > room) sn = room;
+        memcpy(out + o, s, sn);
+        o += sn;
+        room -= sn;
+        if (pad > room) pad = room;
+        memset(out + o, ' ', pad);
+        o += pad;
+    }
+    out[o] = '\0';
+}
+
+/* Replace a's elements with n strings, piece i being len[i] bytes at
+   at[i].  Each is copied once, straight into the array's string lane.
+   Returns 0, leaving the array empty, if they would not fit in the run's
+   memory limit. */
+static int array_set_pieces(Interp *in, Array *a, const char *const *at, const int *len, int n) {
+    array_clear(in, a);
+    if (n == 0) return 1;
+    if (!array_fits(in, a, n - 1)) return 0;
+    array_reserve(in, a, n - 1);
+    a->str = calloc(a->cap, sizeof(char *));
+    long long bytes = a->cap * sizeof(char *);
+    for (int i = 0; i < n; i++) {
+        a->str[i] = xrealloc(NULL, len[i] + 1);
+        memcpy(a->str[i], at[i], len[i]);
+        a->str[i][len[i]] = '\0';
+        a->num[i] = 0;
+        bytes += len[i] + 1;
+    }
+    a->size = a->nstr = n;
+    run_account(in->run, bytes);
+    return 1;
+}
+
+/* The pieces of s between occurrences of sep, or its single characters if
+   sep is empty, into a. */
+static int text_split(Interp *in, Array *a, const char *s, const char *sep) {
+    int sn = strlen(s), pn = strlen(sep), n = 0;
+    const char *at[256];    /* at most one piece per byte, plus one */
+    int len[256];
+    if (pn == 0) {
+        int multi = text_chars(s, sn) < (size_t)sn;   /* valid UTF-8, not all ASCII */
+        for (int i = 0; i < sn; n++) {
+            int k = 1;
+            while (multi && i + k < sn && (s[i + k] & 0xC0) == 0x80) k++;
+            at[n]  = s + i;
+            len[n] = k;
+            i += k;
+        }
+    } else {
+        const char *p = s, *end = s + sn, *hit;
+        while ((hit = text_find(p, end - p, sep, pn))) {
+            at[n] = p;
+            len[n++] = hit - p;
+            p = hit + pn;
+        }
+        at[n] = p;
+        len[n++] = end - p;
+    }
+    return array_set_pieces(in, a, at, len, n);
+}
+
+/* Every match of re in s, left to right, into a; or, if the pattern has
+   groups, the text of each group of each match (empty for a group that
+   took no part).  Text with no match at all is ruled out by the DFA alone. */
+static int text_extract(Interp *in, Array *a, const Regex *re, const char *s) {
+    int n = strlen(s), cap[RE_NCAP], count = 0, room = 0, *len = NULL;
+    const char **at = NULL;
+    int utf8 = text_utf8(s, n);
+    if (utf8 && re->u8) re = re->u8;
+    if (regex_search(re, s, n)) {
+        for (int from = 0; from <= n && regex_find(re, s, n, from, cap); ) {
+            if (cap[1] > cap[0]) {
+                from = cap[1];
+            } else {    /* after an empty match, on from the next character */
+                from = cap[1] + 1;
+                while (utf8 && from < n && (s[from] & 0xC0) == 0x80) from++;
+            }
+            for (int g = re->ngroups ? 1 : 0; g <= re->ngroups; g++) {
+                if (count == room) {
+                    room = room ? room * 2 : 16;
+                    at  = xrealloc(at, room * sizeof(char *));
+                    len = xrealloc(len, room * sizeof(int));
+                }
+                at[count]    = s + (cap[2 * g] >= 0 ? cap[2 * g] : 0);
+                len[count++] = cap[2 * g] >= 0 ? cap[2 * g + 1] - cap[2 * g] : 0;
+            }
+        }
+    }
+    int ok = array_set_pieces(in, a, at, len, count);
+    free(at);
+    free(len);
+    return ok;
+}
+
+/* The compiled pattern of a match: its literal's, or else one compiled now
+   from the text the pattern operand holds, which the caller frees.  NULL,
+   once reported, if the pattern is malformed. */
+static const Regex *cond_regex(const Interp *in, const Cond *c, Regex **fresh) {
+    *fresh = NULL;
+    if (c->re) return c->re;
+    char pb[256];
+    const char *pattern = opd_str(in, &c->rhs, pb, 256), *err;
+    if (!(*fresh = regex_compile(pattern, &err)))
+        diag(in->run, "Error: bad pattern \"%s\": %s\n", pattern, err);
+    return *fresh;
+}
+
+/* ─── Condition evaluation ─── */
+static int eval_condition(const Interp *in, const Cond *c) {
+    int result = 0;
+    switch (c->op) {
+    case CMP_NEVER:
+        return 0;
+    case CMP_NONE:
+        break;
+    case CMP_EMPTY:
+        if (c->lhs.kind == OPD_STR) result = (c->lhs.str[0] == '\0');
+        else if (c->lhs.kind == OPD_VAR && in->vars[c->lhs.slot].used &&
+                 in->vars[c->lhs.slot].val.type == TYPE_STR)
+            result = (in->vars[c->lhs.slot].val.str[0] == '\0');
+        break;
+    case CMP_ZERO:
+        result = (opd_num(in, &c->lhs) == 0);
+        break;
+    case CMP_GT: result = (opd_num(in, &c->lhs) >  opd_num(in, &c->rhs)); break;
+    case CMP_LT: result = (opd_num(in, &c->lhs) <  opd_num(in, &c->rhs)); break;
+    case CMP_GE: result = (opd_num(in, &c->lhs) >= opd_num(in, &c->rhs)); break;
+    case CMP_LE: result = (opd_num(in, &c->lhs) <= opd_num(in, &c->rhs)); break;
+    case CMP_EQ:
+        if (opd_is_str(in, &c->lhs) || opd_is_str(in, &c->rhs)) {
+            char lb[256], rb[256];
+            result = (strcmp(opd_str(in, &c->lhs, lb, 256), opd_str(in, &c->rhs, rb, 256)) == 0);
+        } else {
+            result = (opd_num(in, &c->lhs) == opd_num(in, &c->rhs));
+        }
+        break;
+    case CMP_MATCH: {
+        Regex *fresh;
+        const Regex *re = cond_regex(in, c, &fresh);
+        if (!re) return 0;      /* malformed: false even when negated */
+        char lb[256];
+        const char *s = opd_str(in, &c->lhs, lb, 256);
+        size_t n = strlen(s);
+        result = regex_search(re->u8 && text_utf8(s, n) ? re->u8 : re, s, n);
+        if (fresh) regex_free(fresh);
+        break;
+    }
+    }
+    return c->neg ? !result : result;
+}
+
+/* ─── Scheduler ─── */
+/* M:N: any number of tasks multiplexed over a fixed set of worker threads.
+   The thread that starts a run works the queue too, so scripts that never
+   spawn never create a thread. */
+static pthread_mutex_t rq_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t  rq_cv   = PTHREAD_COND_INITIALIZER;
+static Task *rq_head, *rq_tail;
+static atomic_int rq_len;           /* tasks waiting in the queue */
+static int   opt_jobs = 0;          /* worker threads, 0 = one per CPU */
+static int   workers_started = 0;
+
+static VMResult vm_run(Task *t);
+
+static void rq_push(Task *t) {
+    pthread_mutex_lock(&rq_lock);
+    t->next = NULL;
+    if (rq_tail) rq_tail->next = t;
+    else rq_head = t;
+    rq_tail = t;
+    atomic_fetch_add_explicit(&rq_len, 1, memory_order_relaxed);
+    pthread_cond_signal(&rq_cv);
+    pthread_mutex_unlock(&rq_lock);
+}
+
+/* Next queued task.  With `until`, returns NULL once *until drops to zero
+   (the runs being waited for are all over); workers pass NULL. */
+static Task *rq_pop(atomic_int *until) {
+    pthread_mutex_lock(&rq_lock);
+    while (!rq_head && !(until && atomic_load(until) == 0))
+        pthread_cond_wait(&rq_cv, &rq_lock);
+    Task *t = NULL;
+    if (!(until && atomic_load(until) == 0)) {
+        t = rq_head;
+        rq_head = t->next;
+        if (!rq_head) rq_tail = NULL;
+        atomic_fetch_sub_explicit(&rq_len, 1, memory_order_relaxed);
+    }
+    pthread_mutex_unlock(&rq_lock);
+    return t;
+}
+
+static void task_schedule(Task *t) {
+    pthread_mutex_lock(&t->run->lock);
+    t->run->active++;
+    pthread_mutex_unlock(&t->run->lock);
+    rq_push(t);
+}
+
+/* Queue fn(arg) to run on a worker as a job of no run. */
+static void job_schedule(void (*fn)(void *), void *arg) {
+    Task *t = calloc(1, sizeof(Task));
+    t->native     = fn;
+    t->native_arg = arg;
+    pthread_mutex_init(&t->lock, NULL);
+    rq_push(t);
+}
+
+/* Returns nonzero if this was what ended the run, rather than something
+   that came before it. */
+static int run_halt(Run *run, int status) {
+    pthread_mutex_lock(&run->lock);
+    int first = !run->finishing;
+    if (first) {
+        run->finishing = 1;
+        run->status = status;
+    }
+    atomic_store(&run->halted, 1);
+    pthread_mutex_unlock(&run->lock);
+    return first;
+}
+
+/* A queued or running task of `run` is done with its turn.  Returns nonzero
+   if that was the last one; the caller then calls run_end once it no longer
+   touches anything the run owns. */
+static int run_release(Run *run) {
+    int done = 0;
+    pthread_mutex_lock(&run->lock);
+    if (--run->active == 0) {
+        if (!run->finishing) {
+            diag(run, "Error: deadlock, every task is waiting\n");
+            run->finishing = 1;
+            run->status = 1;
+            atomic_store(&run->halted, 1);
+        }
+        done = 1;
+    }
+    pthread_mutex_unlock(&run->lock);
+    return done;
+}
+
+/* Publish that `run` is over; whoever waits on it may free it after this. */
+static void run_end(Run *run) {
+    if (run->on_end) { run->on_end(run); return; }
+    pthread_mutex_lock(&rq_lock);
+    atomic_store(&run->done, 1);
+    if (run->remaining) atomic_fetch_sub(run->remaining, 1);
+    pthread_cond_broadcast(&rq_cv);
+    pthread_mutex_unlock(&rq_lock);
+}
+
+static void task_finish(Task *t) {
+    Value r;
+    const Var *rv = &t->in->vars[t->in->prog->return_slot];
+    if (rv->used) r = rv->val;
+    else { r.type = TYPE_NUM; r.num = 0; r.text = 0; r.str[0] = '\0'; }
+
+    pthread_mutex_lock(&t->lock);
+    t->result = r;
+    t->state  = TASK_DONE;
+    Task *w = t->waiters;
+    t->waiters = NULL;
+    pthread_mutex_unlock(&t->lock);
+
+    while (w) {
+        Task *next = w->next;
+        task_schedule(w);
+        w = next;
+    }
+    if (t->id != 0) {
+        interp_free(t->in);
+        t->in = NULL;
+    }
+}
+
+static void run_task(Task *t) {
+    Run *run = t->run;
+    if (t->native) {
+        t->native(t->native_arg);
+        pthread_mutex_destroy(&t->lock);
+        free(t);
+        if (run && run_release(run)) run_end(run);
+        return;
+    }
+    VMResult r = atomic_load(&run->halted) ? VM_HALTED : vm_run(t);
+    if (r == VM_YIELD) {
+        rq_push(t);     /* to the back of the queue: still counted active */
+        return;
+    }
+    if (r == VM_PARKED) {
+        /* release the waited-on object only now that t is off this thread */
+        pthread_mutex_t *l = t->park_lock;
+        int done = run_release(run);
+        pthread_mutex_unlock(l);
+        if (done) run_end(run);
+        return;
+    }
+    if (r == VM_DONE) {
+        task_finish(t);
+        if (t->id == 0) run_halt(run, 0);   /* main program finished */
+    }
+    if (run_release(run)) run_end(run);
+}
+static void *worker_main(void *arg) {
+    (void)arg;
+    for (;;) run_task(rq_pop(NULL));
+    return NULL;
+}
+
+static int worker_total(void) {
+    return opt_jobs > 0 ? opt_jobs : (int)sysconf(_SC_NPROCESSORS_ONLN);
+}
+
+static void start_workers(void) {
+    pthread_mutex_lock(&rq_lock);
+    if (!workers_started) {
+        workers_started = 1;
+        int n = worker_total();
+        for (int i = 1; i < n; i++) {
+            pthread_t th;
+            if (pthread_create(&th, NULL, worker_main, NULL) == 0)
+                pthread_detach(th);
+        }
+    }
+    pthread_mutex_unlock(&rq_lock);
+}
+
+/* ─── Channels ─── */
+/* The queue itself is a bounded MPMC ring (Vyukov): senders and receivers
+   each claim a cell with one CAS and take no lock.  The channel lock is
+   only for parking, and for the overflow list that lets an unbounded
+   channel keep accepting values once its ring is full.  Senders stay on
+   the overflow list until it drains, which keeps each sender's values in
+   order. */
+#define CHAN_RING 1024   /* ring size of an unbounded channel */
+
+typedef struct {
+    atomic_size_t seq;
+    Value         val;
+} Cell;
+
+typedef struct {
+    Cell         *cells;
+    size_t        size;
+    char          pad0[64];
+    atomic_size_t head;   /* next cell to fill */
+    char          pad1[64];
+    atomic_size_t tail;   /* next cell to drain */
+    char          pad2[64];
+} Ring;
+
+typedef struct Channel {
+    Ring            ring;
+    int             bounded;
+    int             kind;          /* VType every value must have, -1 for any */
+    const char     *name;
+    pthread_mutex_t lock;
+    Task           *recv_head, *recv_tail;   /* parked receivers */
+    Task           *send_head, *send_tail;   /* parked senders */
+    atomic_int      recv_waiting, send_waiting;
+    Value          *overflow;      /* unbounded only, guarded by lock */
+    int             ov_head, ov_count, ov_cap;
+    atomic_int      ov_pending;
+} Channel;
+
+static void ring_init(Ring *r, size_t size) {
+    r->cells = xrealloc(NULL, size * sizeof(Cell));
+    r->size  = size;
+    for (size_t i = 0; i < size; i++)
+        atomic_init(&r->cells[i].seq, i);
+    atomic_init(&r->head, 0);
+    atomic_init(&r->tail, 0);
+}
+
+static int ring_push(Ring *r, const Value *v) {
+    size_t pos = atomic_load_explicit(&r->head, memory_order_relaxed);
+    Cell *c;
+    for (;;) {
+        c = &r->cells[pos % r->size];
+        size_t seq = atomic_load_explicit(&c->seq, memory_order_acquire);
+        intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+        if (diff == 0) {
+            if (atomic_compare_exchange_weak_explicit(&r->head, &pos, pos + 1,
+                    memory_order_relaxed, memory_order_relaxed))
+                break;
+        } else if (diff < 0) {
+            return 0;   /* full */
+        } else {
+            pos = atomic_load_explicit(&r->head, memory_order_relaxed);
+        }
+    }
+    c->val = *v;
+    atomic_store_explicit(&c->seq, pos + 1, memory_order_release);
+    return 1;
+}
+
+static int ring_pop(Ring *r, Value *v) {
+    size_t pos = atomic_load_explicit(&r->tail, memory_order_relaxed);
+    Cell *c;
+    for (;;) {
+        c = &r->cells[pos % r->size];
+        size_t seq = atomic_load_explicit(&c->seq, memory_order_acquire);
+        intptr_t diff = (intptr_t)seq - (intptr_t)(pos + 1);
+        if (diff == 0) {
+            if (atomic_compare_exchange_weak_explicit(&r->tail, &pos, pos + 1,
+                    memory_order_relaxed, memory_order_relaxed))
+                break;
+        } else if (diff < 0) {
+            return 0;   /* empty */
+        } else {
+            pos = atomic_load_explicit(&r->tail, memory_order_relaxed);
+        }
+    }
+    *v = c->val;
+    atomic_store_explicit(&c->seq, pos + r->size, memory_order_release);
+    return 1;
+}
+
+static Channel *chan_new(const char *name, int kind, int bounded, int capacity) {
+    Channel *ch = calloc(1, sizeof(Channel));
+    ch->name    = name;
+    ch->kind    = kind;
+    ch->bounded = bounded;
+    ring_init(&ch->ring, bounded ? (capacity > 0 ? capacity : 1) : CHAN_RING);
+    pthread_mutex_init(&ch->lock, NULL);
+    return ch;
+}
+
+static void chan_free(Channel *ch) {
+    pthread_mutex_destroy(&ch->lock);
+    free(ch->ring.cells);
+    free(ch->overflow);
+    free(ch);
+}
+
+static void waitq_push(Task **head, Task **tail, Task *t) {
+    t->next = NULL;
+    if (*tail) (*tail)->next = t;
+    else *head = t;
+    *tail = t;
+}
+
+/* Wake the longest-waiting task on one side of the channel, if any. */
+static void chan_wake(Channel *ch, Task **head, Task **tail, atomic_int *waiting) {
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load(waiting) == 0) return;
+    pthread_mutex_lock(&ch->lock);
+    Task *t = *head;
+    if (t) {
+        *head = t->next;
+        if (!*head) *tail = NULL;
+        atomic_fetch_sub(waiting, 1);
+    }
+    pthread_mutex_unlock(&ch->lock);
+    if (t) task_schedule(t);
+}
+
+/* Returns 0 with ch->lock held when `t` has to park until there is room,
+   or -1 if an unbounded channel's queue cannot grow within the memory
+   limit. */
+static int chan_send(Task *t, Channel *ch, const Value *v) {
+    if ((ch->bounded || atomic_load(&ch->ov_pending) == 0) && ring_push(&ch->ring, v)) {
+        chan_wake(ch, &ch->recv_head, &ch->recv_tail, &ch->recv_waiting);
+        return 1;
+    }
+    pthread_mutex_lock(&ch->lock);
+    if (!ch->bounded) {
+        if (ch->ov_count == ch->ov_cap) {
+            int cap = ch->ov_cap ? ch->ov_cap * 2 : 64;
+            if (!run_fits(t->run, (long long)(cap - ch->ov_cap) * sizeof(Value))) {
+                pthread_mutex_unlock(&ch->lock);
+                return -1;
+            }
+            run_account(t->run, (long long)(cap - ch->ov_cap) * sizeof(Value));
+            Value *ov = xrealloc(NULL, cap * sizeof(Value));
+            for (int i = 0; i < ch->ov_count; i++)
+                ov[i] = ch->overflow[(ch->ov_head + i) % ch->ov_cap];
+            free(ch->overflow);
+            ch->overflow = ov;
+            ch->ov_head  = 0;
+            ch->ov_cap   = cap;
+        }
+        ch->overflow[(ch->ov_head + ch->ov_count++) % ch->ov_cap] = *v;
+        atomic_fetch_add(&ch->ov_pending, 1);
+        pthread_mutex_unlock(&ch->lock);
+        chan_wake(ch, &ch->recv_head, &ch->recv_tail, &ch->recv_waiting);
+        return 1;
+    }
+    /* announce before the last try so a receiver draining the ring sees us */
+    atomic_fetch_add(&ch->send_waiting, 1);
+    if (ring_push(&ch->ring, v)) {
+        atomic_fetch_sub(&ch->send_waiting, 1);
+        pthread_mutex_unlock(&ch->lock);
+        chan_wake(ch, &ch->recv_head, &ch->recv_tail, &ch->recv_waiting);
+        return 1;
+    }
+    waitq_push(&ch->send_head, &ch->send_tail, t);
+    t->park_lock = &ch->lock;
+    return 0;
+}
+
+/* Returns 0 with ch->lock held when `t` has to park until a value arrives. */
+static int chan_recv(Task *t, Channel *ch, Value *v) {
+    if (ring_pop(&ch->ring, v)) {
+        chan_wake(ch, &ch->send_head, &ch->send_tail, &ch->send_waiting);
+        return 1;
+    }
+    pthread_mutex_lock(&ch->lock);
+    if (ch->ov_count > 0) {
+        *v = ch->overflow[ch->ov_head];
+        ch->ov_head = (ch->ov_head + 1) % ch->ov_cap;
+        ch->ov_count--;
+        atomic_fetch_sub(&ch->ov_pending, 1);
+        pthread_mutex_unlock(&ch->lock);
+        return 1;
+    }
+    atomic_fetch_add(&ch->recv_waiting, 1);
+    if (ring_pop(&ch->ring, v)) {
+        atomic_fetch_sub(&ch->recv_waiting, 1);
+        pthread_mutex_unlock(&ch->lock);
+        chan_wake(ch, &ch->send_head, &ch->send_tail, &ch->send_waiting);
+        return 1;
+    }
+    waitq_push(&ch->recv_head, &ch->recv_tail, t);
+    t->park_lock = &ch->lock;
+    return 0;
+}
+
+/* The run's channel in `slot`, created on first use.  Channels belong to the
+   run rather than a context, so every task sees the same ones. */
+static Channel *run_channel(Run *run, int slot, int kind, int bounded, int capacity) {
+    Channel *ch = atomic_load_explicit(&run->chans[slot], memory_order_acquire);
+    if (ch) return ch;
+    pthread_mutex_lock(&run->lock);
+    ch = atomic_load_explicit(&run->chans[slot], memory_order_relaxed);
+    if (!ch) {
+        ch = chan_new(run->prog->chan_names[slot], kind, bounded, capacity);
+        run_account(run, (long long)ch->ring.size * sizeof(Cell));
+        atomic_store_explicit(&run->chans[slot], ch, memory_order_release);
+    }
+    pthread_mutex_unlock(&run->lock);
+    return ch;
+}
+
+/* ─── Tasks ─── */
+static Task *task_new(Run *run, Interp *in, int pc) {
+    Task *t = calloc(1, sizeof(Task));
+    run_account(run, sizeof(Task));
+    t->run = run;
+    t->in  = in;
+    t->pc  = pc;
+    t->state = TASK_READY;
+    t->stop_pc = -1;
+    pthread_mutex_init(&t->lock, NULL);
+    return t;
+}
+
+static void task_free(Task *t) {
+    interp_free(t->in);
+    while (t->nkept > 0) interp_free(t->kept[--t->nkept]);
+    free(t->kept);
+    run_account(t->run, -(long long)sizeof(Task));
+    pthread_mutex_destroy(&t->lock);
+    free(t->rets);
+    free(t->loops);
+    free(t);
+}
+
+static int run_register(Run *run, Task *t) {
+    pthread_mutex_lock(&run->lock);
+    if (run->ntasks == run->taskcap) {
+        run->taskcap = run->taskcap ? run->taskcap * 2 : 16;
+        run->tasks = xrealloc(run->tasks, run->taskcap * sizeof(Task *));
+    }
+    run->tasks[run->ntasks++] = t;
+    t->id = run->ntasks;
+    pthread_mutex_unlock(&run->lock);
+    return t->id;
+}
+
+static Task *run_lookup(Run *run, int id) {
+    Task *t = NULL;
+    pthread_mutex_lock(&run->lock);
+    if (id >= 1 && id <= run->ntasks) t = run->tasks[id - 1];
+    pthread_mutex_unlock(&run->lock);
+    return t;
+}
+
+static Limits opt_limits;   /* --max-steps, --max-time, --max-memory */
+
+static double clock_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Hold `run` to `lim` from now on, counting from when it was created. */
+static void run_limit(Run *run, const Limits *lim) {
+    run->limits   = *lim;
+    run->deadline = lim->seconds > 0 ? run->started + lim->seconds : 0;
+}
+
+/* A fresh run of `prog`, with its main task ready to be scheduled.  It gets
+   the process-wide limits; run_limit can change them before it starts. */
+static Run *run_new(const Program *prog) {
+    Run *run = calloc(1, sizeof(Run));
+    run->prog = prog;
+    run->started = clock_now();
+    run_limit(run, &opt_limits);
+    run->chans = calloc(prog->chan_count + 1, sizeof(*run->chans));
+    pthread_mutex_init(&run->lock, NULL);
+    pthread_mutex_init(&run->out_lock, NULL);
+    run->main = task_new(run, interp_new(prog, run), 0);
+    return run;
+}
+
+static int run_over_memory(Run *run) {
+    return run->limits.memory &&
+           atomic_load_explicit(&run->memory, memory_order_relaxed) > (long long)run->limits.memory;
+}
+
+/* Which limit, if any, the run has gone over: 's'teps, 't'ime or 'm'emory. */
+static int run_over_limit(Run *run) {
+    if (run->limits.steps && atomic_load_explicit(&run->steps, memory_order_relaxed) >= run->limits.steps)
+        return 's';
+    if (run->deadline && clock_now() >= run->deadline) return 't';
+    if (run_over_memory(run)) return 'm';
+    return 0;
+}
+
+/* Stop a run that went over a limit, saying how far it got. */
+static void run_exceeded(Run *run, int which) {
+    if (!run_halt(run, 1)) return;
+    char what[64];
+    if (which == 's') snprintf(what, sizeof what, "step limit of %lld", run->limits.steps);
+    else if (which == 't') snprintf(what, sizeof what, "time limit of %g s", run->limits.seconds);
+    else snprintf(what, sizeof what, "memory limit of %zu bytes", run->limits.memory);
+    diag(run, "Error: %s reached (%lld steps, %.3f s, peak memory %lld bytes)\n", what,
+         (long long)atomic_load(&run->steps), clock_now() - run->started, (long long)atomic_load(&run->peak));
+}
+
+/* Script arguments go into the array `args`, if the program uses one. */
+static void run_set_args(Run *run, int argc, char **argv) {
+    const Program *prog = run->prog;
+    for (int slot = 0; slot < prog->array_count; slot++) {
+        if (strcmp(prog->array_names[slot], "args") != 0) continue;
+        Array *a = array_ref(run->main->in, slot);
+        if (argc > MAX_ARRAY_SIZE) argc = MAX_ARRAY_SIZE;
+        if (argc > 0) array_reserve(run->main->in, a, argc - 1);
+        for (int i = 0; i < argc; i++) {
+            Value v = {0};
+            parse_input(argv[i], &v);
+            array_put(run->main->in, a, i, &v);
+        }
+        a->size = argc;
+    }
+}
+
+static void run_free(Run *run) {
+    task_free(run->main);
+    for (int i = 0; i < run->ntasks; i++) task_free(run->tasks[i]);
+    free(run->tasks);
+    for (int i = 0; i < run->prog->chan_count; i++)
+        if (run->chans[i]) chan_free(run->chans[i]);
+    free(run->chans);
+    free(run->out.data);
+    free(run->err.data);
+    free(run->in.data);
+    pthread_mutex_destroy(&run->out_lock);
+    pthread_mutex_destroy(&run->lock);
+    free(run);
+}
+
+/* Execute the run to completion, working the queue on this thread. */
+static int run_main(Run *run) {
+    atomic_int remaining = 1;
+    run->remaining = &remaining;
+    task_schedule(run->main);
+    Task *t;
+    while ((t = rq_pop(&remaining)))
+        run_task(t);
+    return run->status;
+}
+
+/* ─── Frame stacks ─── */
+static int push_ret(Task *t, int pc) {
+    if (t->rsp == t->rcap) {
+        if (t->rcap >= MAX_CALL_STACK) return 0;
+        t->rcap = t->rcap ? t->rcap * 2 : 16;
+        t->rets = xrealloc(t->rets, t->rcap * sizeof(int));
+    }
+    t->rets[t->rsp++] = pc;
+    return 1;
+}
+
+static LoopFrame *push_loop(Task *t) {
+    if (t->lsp == t->lcap) {
+        t->lcap = t->lcap ? t->lcap * 2 : 16;
+        t->loops = xrealloc(t->loops, t->lcap * sizeof(LoopFrame));
+    }
+    LoopFrame *lf = &t->loops[t->lsp++];
+    memset(lf, 0, sizeof *lf);
+    return lf;
+}
+
+/* Bind call arguments to a function's parameters in `dst`, reading them
+   from `src` (the caller's context; the same context for a plain call). */
+static void bind_params(Interp *dst, const Interp *src, const FuncDef *f, const Instr *ins) {
+    for (int i = 0; i < f->param_count && i < ins->nargs; i++) {
+        Var *pv = var_ref(dst, f->param_slots[i]);
+        pv->val = opd_value(src, &ins->args[i]);
+    }
+}
+
+/* ─── Bulk array statements ─── */
+/* Work is cut into fixed blocks that the calling task and helper jobs on
+   the scheduler claim from a shared counter.  The blocks, not the threads,
+   decide how results combine, so the answer is the same for any -j. */
+#define REDUCE_BLOCK 4096
+#define MAP_BLOCK    64
+
+typedef enum { RED_SUM, RED_PRODUCT, RED_MIN, RED_MAX } ReduceOp;
+
+typedef struct Par {
+    int             nblocks;
+    atomic_int      next;       /* next unclaimed block */
+    atomic_int      finished;   /* blocks completed */
+    atomic_int      refs;       /* caller plus helpers still holding this */
+    atomic_int      failed;
+    pthread_mutex_t lock;
+    pthread_cond_t  cv;
+    void         *(*enter)(struct Par *);            /* per-participant state */
+    void          (*block)(struct Par *, void *, int);
+    void          (*leave)(struct Par *, void *);
+    /* reduce */
+    ReduceOp        op;
+    const double   *x;
+    int             n;
+    double         *partial;    /* one result per block */
+    /* map */
+    Task           *caller;
+    const FuncDef  *func;
+    const Array    *src;
+    Value          *out;
+} Par;
+
+static void par_release(Par *p) {
+    if (atomic_fetch_sub(&p->refs, 1) != 1) return;
+    pthread_mutex_destroy(&p->lock);
+    pthread_cond_destroy(&p->cv);
+    free(p);
+}
+
+static void par_work(void *arg) {
+    Par *p = arg;
+    void *state = NULL;
+    int b;
+    while ((b = atomic_fetch_add(&p->next, 1)) < p->nblocks) {
+        if (!state && p->enter) state = p->enter(p);
+        if (!atomic_load(&p->failed)) p->block(p, state, b);
+        if (atomic_fetch_add(&p->finished, 1) + 1 == p->nblocks) {
+            pthread_mutex_lock(&p->lock);
+            pthread_cond_broadcast(&p->cv);
+            pthread_mutex_unlock(&p->lock);
+        }
+    }
+    if (state && p->leave) p->leave(p, state);
+    par_release(p);
+}
+
+/* Run every block of `p`, on the caller's thread and on up to one helper
+   per extra worker.  Returns once all blocks are complete. */
+static void par_run(Task *t, Par *p) {
+    int helpers = worker_total() - 1;
+    if (helpers > p->nblocks - 1) helpers = p->nblocks - 1;
+    pthread_mutex_init(&p->lock, NULL);
+    pthread_cond_init(&p->cv, NULL);
+    atomic_store(&p->refs, helpers + 2);   /* helpers, our par_work, our wait */
+    if (helpers > 0) start_workers();
+    for (int i = 0; i < helpers; i++) {
+        Task *h = calloc(1, sizeof(Task));
+        h->run = t->run;
+        h->native = par_work;
+        h->native_arg = p;
+        pthread_mutex_init(&h->lock, NULL);
+        task_schedule(h);
+    }
+    par_work(p);
+    pthread_mutex_lock(&p->lock);
+    while (atomic_load(&p->finished) < p->nblocks)
+        pthread_cond_wait(&p->cv, &p->lock);
+    pthread_mutex_unlock(&p->lock);
+}
+
+static double reduce_apply(ReduceOp op, double a, double b) {
+    switch (op) {
+    case RED_SUM:     return a + b;
+    case RED_PRODUCT: return a * b;
+    case RED_MIN:     return (a < b) ? a : b;
+    default:          return (a > b) ? a : b;
+    }
+}
+
+/* Eight interleaved lanes, folded in a fixed order at the end.  The SSE2
+   loop keeps the lanes in four registers and rounds exactly like the
+   scalar one. */
+static double reduce_block(ReduceOp op, const double *x, int n) {
+    static const double ident[] = { 0, 1, INFINITY, -INFINITY };
+    double lane[8];
+    int i = 0;
+    for (int j = 0; j < 8; j++) lane[j] = ident[op];
+#ifdef __SSE2__
+    __m128d v0 = _mm_set1_pd(ident[op]), v1 = v0, v2 = v0, v3 = v0;
+    for (; i + 8 <= n; i += 8) {
+        __m128d x0 = _mm_loadu_pd(x + i),     x1 = _mm_loadu_pd(x + i + 2);
+        __m128d x2 = _mm_loadu_pd(x + i + 4), x3 = _mm_loadu_pd(x + i + 6);
+        switch (op) {
+        case RED_SUM:
+            v0 = _mm_add_pd(v0, x0); v1 = _mm_add_pd(v1, x1);
+            v2 = _mm_add_pd(v2, x2); v3 = _mm_add_pd(v3, x3);
+            break;
+        case RED_PRODUCT:
+            v0 = _mm_mul_pd(v0, x0); v1 = _mm_mul_pd(v1, x1);
+            v2 = _mm_mul_pd(v2, x2); v3 = _mm_mul_pd(v3, x3);
+            break;
+        case RED_MIN:
+            v0 = _mm_min_pd(v0, x0); v1 = _mm_min_pd(v1, x1);
+            v2 = _mm_min_pd(v2, x2); v3 = _mm_min_pd(v3, x3);
+            break;
+        case RED_MAX:
+            v0 = _mm_max_pd(v0, x0); v1 = _mm_max_pd(v1, x1);
+            v2 = _mm_max_pd(v2, x2); v3 = _mm_max_pd(v3, x3);
+            break;
+        }
+    }
+    _mm_storeu_pd(lane, v0);     _mm_storeu_pd(lane + 2, v1);
+    _mm_storeu_pd(lane + 4, v2); _mm_storeu_pd(lane + 6, v3);
+#else
+    for (; i + 8 <= n; i += 8)
+        for (int j = 0; j < 8; j++)
+            lane[j] = reduce_apply(op, lane[j], x[i + j]);
+#endif
+    for (; i < n; i++)
+        lane[i & 7] = reduce_apply(op, lane[i & 7], x[i]);
+    return reduce_apply(op,
+        reduce_apply(op, reduce_apply(op, lane[0], lane[1]), reduce_apply(op, lane[2], lane[3])),
+        reduce_apply(op, reduce_apply(op, lane[4], lane[5]), reduce_apply(op, lane[6], lane[7])));
+}
+
+/* Pairwise combination of the per-block results. */
+static double reduce_tree(ReduceOp op, const double *v, int n) {
+    if (n == 1) return v[0];
+    int h = n / 2;
+    return reduce_apply(op, reduce_tree(op, v, h), reduce_tree(op, v + h, n - h));
+}
+
+static void reduce_par_block(Par *p, void *state, int b) {
+    (void)state;
+    int start = b * REDUCE_BLOCK;
+    int len = (p->n - start < REDUCE_BLOCK) ? p->n - start : REDUCE_BLOCK;
+    p->partial[b] = reduce_block(p->op, p->x + start, len);
+}
+
+/* String elements count as 0, as they do everywhere numbers are read. */
+static double array_reduce(Task *t, const Array *a, ReduceOp op) {
+    if (!a || a->size == 0)
+        return (op == RED_PRODUCT) ? 1 : 0;
+    const double *x = a->num;
+    double *masked = NULL;
+    if (a->nstr > 0) {
+        masked = xrealloc(NULL, a->size * sizeof(double));
+        for (int i = 0; i < a->size; i++)
+            masked[i] = a->str[i] ? 0 : a->num[i];
+        x = masked;
+    }
+    int nblocks = (a->size + REDUCE_BLOCK - 1) / REDUCE_BLOCK;
+    double result;
+    if (nblocks == 1) {
+        result = reduce_block(op, x, a->size);
+    } else {
+        Par *p = calloc(1, sizeof(Par));
+        double *partial = xrealloc(NULL, nblocks * sizeof(double));
+        p->nblocks = nblocks;
+        p->block   = reduce_par_block;
+        p->op      = op;
+        p->x       = x;
+        p->n       = a->size;
+        p->partial = partial;
+        par_run(t, p);
+        par_release(p);
+        result = reduce_tree(op, partial, nblocks);
+        free(partial);
+    }
+    free(masked);
+    return result;
+}
+
+/* What mapping over src takes while it runs: the results, and a context
+   for each participant. */
+static long long map_bytes(const Task *t, const Array *src) {
+    int n = src ? src->size : 0;
+    if (n == 0) return 0;
+    long long parts = (n + MAP_BLOCK - 1) / MAP_BLOCK;
+    if (parts > worker_total()) parts = worker_total();
+    return (long long)n * sizeof(Value) + parts * (long long)(context_bytes(t->in) + sizeof(Task));
+}
+
+/* Each participant calls the function in its own copy of the caller's
+   context, through a private task that never touches the run queue. */
+static void *map_enter(Par *p) {
+    return task_new(p->caller->run, interp_clone(p->caller->in), 0);
+}
+
+static void map_leave(Par *p, void *state) {
+    (void)p;
+    task_free(state);
+}
+
+static void map_block(Par *p, void *state, int b) {
+    Task *sub = state;
+    const FuncDef *f = p->func;
+    int end = (b + 1) * MAP_BLOCK;
+    if (end > p->src->size) end = p->src->size;
+    /* this may be a helper thread: fatal errors must unwind to here */
+    jmp_buf fault;
+    if (setjmp(fault)) {
+        run_halt(sub->run, 1);
+        atomic_store(&p->failed, 1);
+        return;
+    }
+    sub->in->on_fault = &fault;
+    for (int i = b * MAP_BLOCK; i < end; i++) {
+        if (f->param_count > 0)
+            array_get(p->src, i, &var_ref(sub->in, f->param_slots[0])->val);
+        if (f->param_count > 1) {
+            Var *iv = var_ref(sub->in, f->param_slots[1]);
+            iv->val.type = TYPE_NUM;
+            iv->val.num  = i;
+        }
+        Var *rv = var_ref(sub->in, sub->in->prog->return_slot);
+        rv->val.type = TYPE_NUM;
+        rv->val.num  = 0;
+        sub->pc = f->start_line;
+        sub->rsp = sub->lsp = 0;
+        VMResult r;
+        while ((r = vm_run(sub)) == VM_YIELD)
+            ;   /* a map call keeps its helper thread */
+        if (r != VM_DONE) {
+            atomic_store(&p->failed, 1);
+            return;
+        }
+        p->out[i] = sub->in->vars[sub->in->prog->return_slot].val;
+    }
+}
+
+/* Returns 0 if the run was halted by one of the calls. */
+static int array_map(Task *t, const FuncDef *f, const Array *src, Array *dst) {
+    int n = src ? src->size : 0;
+    Value *out = NULL;
+    if (n > 0) {
+        Par *p = calloc(1, sizeof(Par));
+        out = xrealloc(NULL, n * sizeof(Value));
+        run_account(t->run, (long long)n * sizeof(Value));
+        p->nblocks = (n + MAP_BLOCK - 1) / MAP_BLOCK;
+        p->enter   = map_enter;
+        p->block   = map_block;
+        p->leave   = map_leave;
+        p->caller  = t;
+        p->func    = f;
+        p->src     = src;
+        p->out     = out;
+        par_run(t, p);
+        int failed = atomic_load(&p->failed);
+        par_release(p);
+        run_account(t->run, -(long long)n * sizeof(Value));
+        if (failed) { free(out); return 0; }
+    }
+    array_clear(t->in, dst);
+    if (n > 0) array_reserve(t->in, dst, n - 1);
+    for (int i = 0; i < n; i++)
+        array_put(t->in, dst, i, &out[i]);
+    dst->size = n;
+    free(out);
+    return 1;
+}
+
+/* ─── Snapshots ─── */
+/* `snapshot to <file>` saves the main task's whole state; --restore maps the
+   image back in and carries on from the line after the snapshot.  The image
+   holds the program source (functions come back by compiling it again),
+   every variable and array, mem, the data stack and the call and loop
+   stacks.  Everything is fixed-size and 8-byte aligned, so restoring reads
+   straight out of the mapping.  Channels and other tasks are not saved. */
+#define SNAP_MAGIC   "ENGSNAP"
+#define SNAP_VERSION 1
+
+typedef struct {
+    char     magic[8];
+    uint32_t version;
+    uint32_t endian;              /* 0x01020304 as written */
+    uint32_t var_size, frame_size; /* sizeof(Var), sizeof(LoopFrame) */
+    int32_t  pc, stack_top, rsp, lsp, nvars, narrays;
+    uint64_t source_off, source_len;
+    uint64_t vars_off, arrays_off, rets_off, loops_off, mem_off, stack_off;
+    uint64_t size;                /* of the whole image */
+} SnapHeader;
+
+typedef struct {
+    int32_t  used, size, nstr, pad;
+    uint64_t num_off;             /* `size` doubles */
+    uint64_t str_off;             /* `nstr` SnapStr records */
+} SnapArray;
+
+typedef struct {
+    int32_t index, len;           /* then len bytes, padded to 8 */
+} SnapStr;
+
+/* Append and pad to 8 bytes; returns the offset written at. */
+static uint64_t snap_put(Buf *b, const void *data, size_t n) {
+    static const char zero[8];
+    uint64_t off = b->len;
+    if (n) buf_append(b, data, n);
+    if (b->len % 8) buf_append(b, zero, 8 - b->len % 8);
+    return off;
+}
+
+/* Build the image of t's state, to resume at `pc`, into b. */
+static void snapshot_image(const Task *t, int pc, Buf *b) {
+    const Interp *in = t->in;
+    const Program *prog = in->prog;
+    SnapHeader h;
+    memset(&h, 0, sizeof h);
+    memcpy(h.magic, SNAP_MAGIC, 8);
+    h.version    = SNAP_VERSION;
+    h.endian     = 0x01020304;
+    h.var_size   = sizeof(Var);
+    h.frame_size = sizeof(LoopFrame);
+    h.pc         = pc;
+    h.stack_top  = in->stack_top;
+    h.rsp        = t->rsp;
+    h.lsp        = t->lsp;
+    h.nvars      = prog->var_count + 1;
+    h.narrays    = prog->array_count;
+
+    b->len = 0;
+    snap_put(b, &h, sizeof h);
+    h.source_off = b->len;
+    for (int i = 0; i < prog->line_count; i++) {
+        buf_append(b, prog->lines[i], strlen(prog->lines[i]));
+        buf_append(b, "\n", 1);
+    }
+    h.source_len = b->len - h.source_off;
+    snap_put(b, NULL, 0);
+    h.vars_off = snap_put(b, in->vars, h.nvars * sizeof(Var));
+
+    SnapArray *tab = calloc(h.narrays + 1, sizeof(SnapArray));
+    for (int i = 0; i < h.narrays; i++) {
+        const Array *a = &in->arrays[i];
+        if (!a->used) continue;
+        tab[i].used = 1;
+        tab[i].size = a->size;
+        tab[i].num_off = snap_put(b, a->num, a->size * sizeof(double));
+        tab[i].str_off = b->len;
+        for (int j = 0; a->str && j < a->size; j++) {
+            if (!a->str[j]) continue;
+            SnapStr rec = { j, (int32_t)strlen(a->str[j]) };
+            snap_put(b, &rec, sizeof rec);
+            snap_put(b, a->str[j], rec.len);
+            tab[i].nstr++;
+        }
+    }
+    h.arrays_off = snap_put(b, tab, h.narrays * sizeof(SnapArray));
+    free(tab);
+    h.rets_off  = snap_put(b, t->rets, t->rsp * sizeof(int));
+    h.loops_off = snap_put(b, t->loops, t->lsp * sizeof(LoopFrame));
+    h.mem_off   = snap_put(b, in->mem, sizeof in->mem);
+    h.stack_off = snap_put(b, in->data_stack, in->stack_top * sizeof(double));
+    h.size = b->len;
+    memcpy(b->data, &h, sizeof h);
+}
+
+/* Write t's state, to resume at `pc`.  Returns 0, or -1 with errno set. */
+static int snapshot_write(const Task *t, int pc, const char *path) {
+    Buf b = {0};
+    snapshot_image(t, pc, &b);
+
+    /* write beside the target and rename, so a reader never sees half */
+    char tmp[4096];
+    snprintf(tmp, sizeof tmp, "%s.tmp", path);
+    FILE *f = fopen(tmp, "wb");
+    int ok = f && fwrite(b.data, 1, b.len, f) == b.len;
+    if (f && fclose(f) != 0) ok = 0;
+    if (ok && rename(tmp, path) != 0) ok = 0;
+    if (!ok) {
+        int e = errno;
+        remove(tmp);
+        errno = e;
+    }
+    free(b.data);
+    return ok ? 0 : -1;
+}
+
+/* Bounds-checked pointer into a mapped image. */
+static const void *snap_at(const char *img, const SnapHeader *h, uint64_t off, uint64_t n) {
+    if (off > h->size || n > h->size - off) return NULL;
+    return img + off;
+}
+
+/* A run that resumes the image img[0..size).  Unless *progp is already the
+   image's program, it is compiled from the saved source and returned there.
+   Problems are reported against `name`, and NULL returned. */
+static Run *snapshot_load(const char *img, size_t size, Program **progp, const char *name) {
+    const SnapHeader *h = (const SnapHeader *)img;
+    if (size < sizeof(SnapHeader) || memcmp(h->magic, SNAP_MAGIC, 8) != 0 ||
+        h->version != SNAP_VERSION || h->endian != 0x01020304 || h->var_size != sizeof(Var) ||
+        h->frame_size != sizeof(LoopFrame) || h->size != size) {
+        fprintf(stderr, "%s: not a snapshot made by this englang\n", name);
+        return NULL;
+    }
+
+    Program *prog = *progp;
+    int own = !prog;
+    if (own) {
+        const char *source = snap_at(img, h, h->source_off, h->source_len);
+        prog = source ? compile_source(source, h->source_len) : NULL;
+    }
+    const Var *vars = NULL;
+    const SnapArray *tab = NULL;
+    const int *rets = NULL;
+    const LoopFrame *loops = NULL;
+    const double *mem = NULL, *stack = NULL;
+    if (prog && h->nvars == prog->var_count + 1 && h->narrays == prog->array_count &&
+        h->pc >= 0 && h->pc <= prog->line_count && h->stack_top >= 0 && h->stack_top <= MAX_STACK &&
+        h->rsp >= 0 && h->rsp <= MAX_CALL_STACK && h->lsp >= 0) {
+        vars  = snap_at(img, h, h->vars_off, (uint64_t)h->nvars * sizeof(Var));
+        tab   = snap_at(img, h, h->arrays_off, (uint64_t)h->narrays * sizeof(SnapArray));
+        rets  = snap_at(img, h, h->rets_off, (uint64_t)h->rsp * sizeof(int));
+        loops = snap_at(img, h, h->loops_off, (uint64_t)h->lsp * sizeof(LoopFrame));
+        mem   = snap_at(img, h, h->mem_off, MAX_MEM * sizeof(double));
+        stack = snap_at(img, h, h->stack_off, (uint64_t)h->stack_top * sizeof(double));
+    }
+    Run *run = NULL;
+    int ok = vars && tab && rets && loops && mem && stack;
+    if (ok) {
+        run = run_new(prog);
+        Task *t = run->main;
+        Interp *in = t->in;
+        memcpy(in->vars, vars, h->nvars * sizeof(Var));
+        for (int i = 0; i < h->nvars; i++) {
+            in->vars[i].val.str[255] = '\0';
+            in->vars[i].val.text = 0;
+            if (in->vars[i].used) in->var_count++;
+        }
+        for (int i = 0; ok && i < h->narrays; i++) {
+            if (!tab[i].used) continue;
+            int n = tab[i].size;
+            const double *num = snap_at(img, h, tab[i].num_off, (uint64_t)n * sizeof(double));
+            if (n < 0 || n > MAX_ARRAY_SIZE || !num) { ok = 0; break; }
+            Array *a = array_ref(in, i);
+            if (n > 0) {
+                array_reserve(in, a, n - 1);
+                memcpy(a->num, num, n * sizeof(double));
+            }
+            a->size = n;
+            uint64_t off = tab[i].str_off;
+            for (int k = 0; ok && k < tab[i].nstr; k++) {
+                const SnapStr *rec = snap_at(img, h, off, sizeof(SnapStr));
+                const char *str = rec ? snap_at(img, h, off + sizeof(SnapStr), rec->len) : NULL;
+                if (!str || rec->len < 0 || rec->len > 255 || rec->index < 0 || rec->index >= n) {
+                    ok = 0;
+                    break;
+                }
+                Value v;
+                v.type = TYPE_STR;
+                v.num  = a->num[rec->index];
+                memcpy(v.str, str, rec->len);
+                v.str[rec->len] = '\0';
+                array_put(in, a, rec->index, &v);
+                off += sizeof(SnapStr) + ((rec->len + 7) & ~7);
+            }
+        }
+        memcpy(in->mem, mem, sizeof in->mem);
+        memcpy(in->data_stack, stack, h->stack_top * sizeof(double));
+        in->stack_top = h->stack_top;
+        for (int i = 0; i < h->rsp; i++) {
+            if (rets[i] < 0 || rets[i] > prog->line_count) ok = 0;
+            push_ret(t, rets[i]);
+        }
+        for (int i = 0; i < h->lsp; i++) {
+            LoopFrame *lf = push_loop(t);
+            *lf = loops[i];
+            lf->keeps = 0;      /* the contexts they refer to are not in the image */
+        }
+        t->pc = h->pc;
+    }
+    if (!ok) {
+        fprintf(stderr, "%s: damaged snapshot\n", name);
+        if (run) run_free(run);
+        if (own && prog) free_program(prog);
+        return NULL;
+    }
+    *progp = prog;
+    return run;
+}
+
+/* A run that resumes the image file at `path`, with its program in *progp. */
+static Run *snapshot_restore(const char *path, Program **progp) {
+    int fd = open(path, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        perror(path);
+        if (fd >= 0) close(fd);
+        return NULL;
+    }
+    size_t size = st.st_size;
+    const char *img = size >= sizeof(SnapHeader)
+        ? mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+    close(fd);
+    if (img == MAP_FAILED) {
+        fprintf(stderr, "%s: not a snapshot made by this englang\n", path);
+        return NULL;
+    }
+    *progp = NULL;
+    Run *run = snapshot_load(img, size, progp, path);
+    munmap((void *)img, size);
+    return run;
+}
+
+/* ─── Distributed loops ─── */
+/* With --shards N, a `for ... distributed` loop is cut into chunks that N
+   worker processes (this program again, started with --shard-worker) run
+   side by side.  Every chunk starts from the state the loop was entered
+   with, sent to each worker once as a snapshot image.  What comes back is
+   the chunk's output and what it appended to the gathered arrays, merged
+   here in iteration order; anything else a chunk changes is dropped, so
+   iterations must not depend on one another.  Without shards, or for a
+   loop that would never end, the loop runs here and what it changes is
+   dropped the same way (dist_keep).  Each chunk carries what is left of
+   the run's limits, and the time limit is kept here while waiting. */
+#define MAX_SHARDS       64
+#define CHUNKS_PER_SHARD 4
+
+static int opt_shards = 0;
+static pthread_mutex_t shard_lock = PTHREAD_MUTEX_INITIALIZER;
+static int shard_fd[MAX_SHARDS];
+static int shard_count;
+
+/* Start worker processes up to opt_shards.  Returns how many there are. */
+static int shards_start(void) {
+    while (shard_count < opt_shards && shard_count < MAX_SHARDS) {
+        int sv[2];
+        if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv) != 0) break;
+        char fdarg[16], level[4];
+        snprintf(fdarg, sizeof fdarg, "%d", sv[1]);
+        snprintf(level, sizeof level, "-O%d", opt_level);   /* compile the image's program the same way */
+        pid_t pid = fork();
+        if (pid == 0) {
+            fcntl(sv[1], F_SETFD, 0);   /* this end survives the exec */
+            execl("/proc/self/exe", "englang", level, "--shard-worker", fdarg, (char *)NULL);
+            _exit(127);
+        }
+        close(sv[1]);
+        if (pid < 0) { close(sv[0]); break; }
+        shard_fd[shard_count++] = sv[0];
+    }
+    return shard_count;
+}
+
+/* After a failure the workers' streams can't be trusted: let them go. */
+static void shards_stop(void) {
+    for (int i = 0; i < shard_count; i++) close(shard_fd[i]);
+    shard_count = 0;
+}
+
+typedef struct {
+    long long first, trips;  /* the chunk's first iteration, and how many */
+    Buf       out, err, arrays;
+    int       status;
+    int       done;          /* its EXIT came */
+    long long steps;         /* the run's steps when it was sent, then what it took */
+} Chunk;
+
+/* A run's limits and what it has used of them, as a BUDGET frame. */
+static void budget_put(unsigned char msg[41], const Run *run) {
+    wire_put64(msg, (uint64_t)run->limits.steps);
+    wire_put64(msg + 8, (uint64_t)run->limits.memory);
+    wire_put_double(msg + 16, run->limits.seconds);
+    wire_put64(msg + 24, (uint64_t)atomic_load(&run->steps));
+    wire_put_double(msg + 32, clock_now() - run->started);
+    msg[40] = run->untrusted != 0;
+}
+
+/* Each chunk is sent with what is left of the run's budget, and runs
+   under it as if it were still the same run. */
+static int chunk_send(int fd, Chunk *c, const Run *run, double from, double step, double to) {
+    unsigned char msg[41];
+    budget_put(msg, run);
+    c->steps = atomic_load(&run->steps);
+    if (wire_send(fd, WIRE_BUDGET, msg, sizeof msg) != 0) return -1;
+    wire_put_double(msg, from);
+    wire_put_double(msg + 8, step);
+    wire_put_double(msg + 16, to);
+    wire_put64(msg + 24, (uint64_t)c->first);
+    wire_put64(msg + 32, (uint64_t)c->trips);
+    return wire_send(fd, WIRE_CHUNK, msg, 40);
+}
+
+static int chunk_read(int fd, Chunk *c) {
+    char *data;
+    size_t len;
+    int type;
+    while ((type = wire_recv(fd, &data, &len)) > 0) {
+        Buf *b = type == WIRE_OUT ? &c->out : type == WIRE_ERR ? &c->err
+               : type == WIRE_ARRAY ? &c->arrays : NULL;
+        if (b && len) buf_append(b, data, len);
+        if (type == WIRE_EXIT && len == 4) c->status = (int)wire_get32((unsigned char *)data);
+        if (type == WIRE_BUDGET && len == 41) {
+            long long used = (long long)wire_get64((unsigned char *)data + 24) - c->steps;
+            c->steps = used > 0 ? used : 0;
+        }
+        free(data);
+        if (type == WIRE_EXIT) { c->done = 1; return 0; }
+    }
+    return -1;
+}
+
+/* Gathered elements: 'N' and 8 bytes, or 'S', a 2-byte length and bytes. */
+static void gather_put(Buf *b, const Array *a, int from) {
+    int n = a->used && a->size > from ? a->size - from : 0;
+    unsigned char head[9];
+    wire_put32(head, n);
+    buf_append(b, (char *)head, 4);
+    for (int i = from; i < from + n; i++) {
+        if (a->str && a->str[i]) {
+            size_t len = strlen(a->str[i]);
+            head[0] = 'S';
+            head[1] = len >> 8;
+            head[2] = len;
+            buf_append(b, (char *)head, 3);
+            buf_append(b, a->str[i], len);
+        } else {
+            head[0] = 'N';
+            wire_put_double(head + 1, a->num[i]);
+            buf_append(b, (char *)head, 9);
+        }
+    }
+}
+
+/* Append one gathered array's elements from *p to `a`.  Returns 0 if the
+   data was well formed. */
+static int gather_get(Interp *in, const unsigned char **p, const unsigned char *end, Array *a) {
+    if (end - *p < 4) return -1;
+    uint32_t n = wire_get32(*p);
+    *p += 4;
+    for (uint32_t k = 0; k < n; k++) {
+        Value v;
+        if (*p < end && **p == 'N' && end - *p >= 9) {
+            v.type = TYPE_NUM;
+            v.num  = wire_get_double(*p + 1);
+            v.str[0] = '\0';
+            *p += 9;
+        } else if (*p < end && **p == 'S' && end - *p >= 3) {
+            size_t len = (size_t)(*p)[1] << 8 | (*p)[2];
+            if (len > 255 || (size_t)(end - *p) < 3 + len) return -1;
+            v.type = TYPE_STR;
+            v.num  = 0;
+            memcpy(v.str, *p + 3, len);
+            v.str[len] = '\0';
+            *p += 3 + len;
+        } else {
+            return -1;
+        }
+        if (a->size < MAX_ARRAY_SIZE) {
+            array_reserve(in, a, a->size);
+            array_put(in, a, a->size++, &v);
+        }
+    }
+    return 0;
+}
+
+/* Run the distributed loop at `pc` on the shards.  Returns 1 if it should
+   run here instead, 0 when it is done, or -1 after halting the run. */
+static int dist_for(Task *t, int pc, double from, double step, double to, long long count) {
+    Run *run = t->run;
+    Interp *in = t->in;
+    const Instr *ins = &in->prog->code[pc];
+
+    if (count == LLONG_MAX) return 1;       /* never ends */
+    pthread_mutex_lock(&shard_lock);
+    int nshards = shards_start();
+    if (nshards == 0) { pthread_mutex_unlock(&shard_lock); return 1; }
+    int nchunks = count < (long long)nshards * CHUNKS_PER_SHARD ? (int)count : nshards * CHUNKS_PER_SHARD;
+    Chunk *ch = calloc(nchunks, sizeof(Chunk));
+    int c;
+    for (c = 0; c < nchunks; c++) {
+        ch[c].first = c * (count / nchunks) + (c < count % nchunks ? c : count % nchunks);
+        ch[c].trips = count / nchunks + (c < count % nchunks);
+    }
+
+    Buf img = {0};
+    snapshot_image(t, pc, &img);
+    const char *why = NULL;
+    for (int w = 0; w < nshards && !why; w++)
+        if (wire_send(shard_fd[w], WIRE_IMAGE, img.data, img.len) != 0) why = "a worker is gone";
+    free(img.data);
+
+    /* hand out chunks as workers come free, until one fails or the run
+       goes over a limit; the time limit is kept here too */
+    int busy[MAX_SHARDS], next = 0, pending = 0, failed = 0, over = 0;
+    for (int w = 0; w < nshards; w++) {
+        busy[w] = -1;
+        if (!why && next < nchunks) {
+            if (chunk_send(shard_fd[w], &ch[next], run, from, step, to) != 0) why = "a worker is gone";
+            busy[w] = next++;
+            pending++;
+        }
+    }
+    while (pending > 0 && !why && !over) {
+        struct pollfd pf[MAX_SHARDS];
+        for (int w = 0; w < nshards; w++) {
+            pf[w].fd = busy[w] >= 0 ? shard_fd[w] : -1;
+            pf[w].events = POLLIN;
+        }
+        int wait = -1;
+        if (run->deadline) {
+            double left = run->deadline - clock_now();
+            wait = left > 0 ? (int)(left * 1000) + 1 : 0;
+        }
+        int ready = poll(pf, nshards, wait);
+        if (ready < 0) {
+            if (errno != EINTR) why = strerror(errno);
+            continue;
+        }
+        if (ready == 0) { over = run_over_limit(run); continue; }
+        for (int w = 0; w < nshards && !why && !over; w++) {
+            if (busy[w] < 0 || !pf[w].revents) continue;
+            Chunk *done = &ch[busy[w]];
+            if (chunk_read(shard_fd[w], done) != 0) { why = "a worker died"; break; }
+            atomic_fetch_add(&run->steps, done->steps);
+            busy[w] = -1;
+            pending--;
+            if (done->status != 0) failed = 1;
+            else over = run_over_limit(run);
+            if (next < nchunks && !failed && !over) {
+                if (chunk_send(shard_fd[w], &ch[next], run, from, step, to) != 0) why = "a worker is gone";
+                busy[w] = next++;
+                pending++;
+            }
+        }
+    }
+    if (why || pending) shards_stop();     /* chunks still out are abandoned */
+    pthread_mutex_unlock(&shard_lock);
+
+    /* output in iteration order, up to a chunk that did not finish */
+    int status = 0;
+    for (c = 0; c < nchunks && !why && ch[c].done; c++) {
+        if (ch[c].out.len) run_write(run, ch[c].out.data, ch[c].out.len);
+        if (ch[c].err.len) run_write_err(run, ch[c].err.data, ch[c].err.len);
+        if (ch[c].status != 0) { status = ch[c].status; break; }
+        const unsigned char *p = (unsigned char *)ch[c].arrays.data;
+        const unsigned char *end = p + ch[c].arrays.len;
+        for (int g = 0; g < ins->nargs && !why; g++)
+            if (gather_get(in, &p, end, array_ref(in, ins->args[g].slot)) != 0) why = "garbled results";
+    }
+    if (!why && status == 0 && over) {
+        run_exceeded(run, over);
+        status = -1;
+    } else if (!why && status == 0) {
+        Var *v = var_ref(in, ins->dst);
+        v->val.type = TYPE_NUM;
+        v->val.num  = for_value(from, step, to, count - 1);
+    }
+    for (c = 0; c < nchunks; c++) {
+        free(ch[c].out.data);
+        free(ch[c].err.data);
+        free(ch[c].arrays.data);
+    }
+    free(ch);
+    if (why) {
+        diag(run, "Error: distributed loop on line %d failed: %s\n", pc + 1, why);
+        status = 1;
+    }
+    if (status != 0) {
+        if (status > 0) run_halt(run, status);
+        return -1;
+    }
+    return 0;
+}
+
+/* A distributed loop run here keeps the state it started from, and on the
+   way out puts back everything but the arrays it gathers into and its
+   variable, so the script sees what it would with shards.  Returns 0 if
+   that copy would go over the memory limit. */
+static int dist_keep(Task *t, LoopFrame *lf) {
+    if (!run_fits(t->run, context_bytes(t->in))) return 0;
+    t->kept = xrealloc(t->kept, (t->nkept + 1) * sizeof(Interp *));
+    t->kept[t->nkept++] = interp_clone(t->in);
+    lf->keeps = 1;
+    return 1;
+}
+
+static void dist_restore(Task *t, const Instr *head) {
+    Interp *in = t->in, *kept = t->kept[--t->nkept];
+    const Program *prog = in->prog;
+    for (int i = 0; i < prog->var_count; i++)
+        if (i != head->dst) in->vars[i] = kept->vars[i];
+    in->var_count = kept->var_count;
+    for (int i = 0; i < prog->array_count; i++) {
+        int gathered = 0;
+        for (int g = 0; g < head->nargs; g++) gathered |= head->args[g].slot == i;
+        if (gathered) continue;
+        Array a = in->arrays[i];
+        in->arrays[i] = kept->arrays[i];
+        kept->arrays[i] = a;    /* freed with kept */
+    }
+    memcpy(in->mem, kept->mem, sizeof in->mem);
+    memcpy(in->data_stack, kept->data_stack, sizeof in->data_stack);
+    in->stack_top = kept->stack_top;
+    interp_free(kept);
+}
+
+/* The worker side: run each chunk asked for on `fd` until it closes. */
+static void shard_chunk(int fd, const Buf *img, Program **prog, const unsigned char *budget,
+                        const unsigned char *msg) {
+    Run *run = snapshot_load(img->data, img->len, prog, "shard image");
+    const Instr *ins = run ? &(*prog)->code[run->main->pc] : NULL;
+    if (!ins || ins->op != OP_FOR) {
+        static const char msg_bad[] = "Error: shard worker got no usable image\n";
+        wire_send(fd, WIRE_ERR, msg_bad, sizeof msg_bad - 1);
+        wire_send_int(fd, WIRE_EXIT, 1);
+        if (run) run_free(run);
+        return;
+    }
+    Task *t = run->main;
+    Interp *in = t->in;
+    Var *v = &in->vars[ins->dst];
+    if (!v->used) { v->used = 1; in->var_count++; }
+    LoopFrame *lf = push_loop(t);
+    lf->from  = wire_get_double(msg);
+    lf->step  = wire_get_double(msg + 8);
+    lf->to    = wire_get_double(msg + 16);
+    lf->k     = (long long)wire_get64(msg + 24);
+    lf->trips = lf->k + (long long)wire_get64(msg + 32);
+    v->val.type = TYPE_NUM;
+    v->val.num  = for_value(lf->from, lf->step, lf->to, lf->k);
+    t->stop_pc = ins->target;
+    t->pc++;
+
+    int *start = calloc(ins->nargs + 1, sizeof(int));
+    for (int g = 0; g < ins->nargs; g++) {
+        const Array *a = &in->arrays[ins->args[g].slot];
+        start[g] = a->used ? a->size : 0;
+    }
+    if (budget) {
+        Limits lim;
+        lim.steps   = (long long)wire_get64(budget);
+        lim.memory  = wire_get64(budget + 8);
+        lim.seconds = wire_get_double(budget + 16);
+        atomic_store(&run->steps, (long long)wire_get64(budget + 24));
+        run->started = clock_now() - wire_get_double(budget + 32);
+        run->untrusted = budget[40];
+        run_limit(run, &lim);
+    }
+    run->capture = 1;
+    run->chunk   = 1;
+    run_main(run);
+
+    Buf gathered = {0};
+    for (int g = 0; g < ins->nargs; g++)
+        gather_put(&gathered, &in->arrays[ins->args[g].slot], start[g]);
+    if (run->out.len) wire_send(fd, WIRE_OUT, run->out.data, run->out.len);
+    if (run->err.len) wire_send(fd, WIRE_ERR, run->err.data, run->err.len);
+    if (gathered.len) wire_send(fd, WIRE_ARRAY, gathered.data, gathered.len);
+    unsigned char used[41];
+    budget_put(used, run);
+    wire_send(fd, WIRE_BUDGET, used, sizeof used);
+    wire_send_int(fd, WIRE_EXIT, run->status);
+    free(gathered.data);
+    free(start);
+    run_free(run);
+}
+
+static int shard_worker(int fd) {
+    Buf img = {0};
+    int img_done = 0;       /* a chunk came, so the next IMAGE is a new one */
+    unsigned char budget[41];
+    int budgeted = 0;
+    Program *prog = NULL;
+    char *data;
+    size_t len;
+    int type;
+    while ((type = wire_recv(fd, &data, &len)) > 0) {
+        if (type == WIRE_IMAGE) {
+            if (img_done) {
+                img.len = 0;
+                img_done = 0;
+                if (prog) free_program(prog);
+                prog = NULL;
+            }
+            buf_append(&img, data, len);
+        } else if (type == WIRE_BUDGET && len == 41) {
+            memcpy(budget, data, sizeof budget);
+            budgeted = 1;
+        } else if (type == WIRE_CHUNK && len == 40) {
+            img_done = 1;
+            shard_chunk(fd, &img, &prog, budgeted ? budget : NULL, (unsigned char *)data);
+            budgeted = 0;
+        }
+        free(data);
+    }
+    if (prog) free_program(prog);
+    free(img.data);
+    return 0;
+}
+
+/* ─── Interpreter loop ─── */
+static VMResult vm_exec(Task *t);
+
+/* Tasks are charged one step per back-edge and call.  After SLICE_STEPS of
+   them a task gives its thread up if anything else is waiting to run, so
+   one busy loop can't starve the rest; no timers or signals are involved. */
+#define SLICE_STEPS 10000
+
+static void vm_charge(Task *t) {
+    Run *run = t->run;
+    long long steps = atomic_fetch_add_explicit(&run->steps, t->slice - t->fuel, memory_order_relaxed)
+                    + t->slice - t->fuel;
+    int fuel = SLICE_STEPS;
+    if (run->limits.steps && run->limits.steps - steps < fuel)
+        fuel = steps < run->limits.steps ? (int)(run->limits.steps - steps) : 0;
+    t->slice = t->fuel = fuel;
+}
+
+/* The slow path of the back-edge/call check.  Returns nonzero, with the
+   result in *r, if the task has to stop now.  A slice never outlasts the
+   run's step limit, so limits cost nothing on the fast path. */
+static int vm_tick(Task *t, VMResult *r) {
+    vm_charge(t);
+    int over = run_over_limit(t->run);
+    if (over) run_exceeded(t->run, over);
+    if (atomic_load_explicit(&t->run->halted, memory_order_relaxed)) { *r = VM_HALTED; return 1; }
+    if (atomic_load_explicit(&rq_len, memory_order_relaxed) > 0) { *r = VM_YIELD; return 1; }
+    return 0;
+}
+
+/* Runs `t` until it finishes, halts, has to wait or yields.  Instructions
+   that wait leave pc in place and are executed again once the task is
+   woken.  A fatal error halts the task's run with status 1. */
+static VMResult vm_run(Task *t) {
+    Interp *in = t->in;
+    jmp_buf fault, *outer = in->on_fault;
+    t->slice = t->fuel = 0;
+    vm_charge(t);
+    if (setjmp(fault)) {
+        in->on_fault = outer;
+        vm_charge(t);
+        run_halt(t->run, 1);
+        return VM_HALTED;
+    }
+    in->on_fault = &fault;
+    VMResult r = vm_exec(t);
+    in->on_fault = outer;
+    vm_charge(t);
+    return r;
+}
+
+/* ─── IR listing ─── */
+/* --dump-ir prints what each line compiled to at the chosen -O level, one
+   instruction per source line: the opcode, its operands marked as constants,
+   variables (":num" once proven numeric), arrays or channels, the line a
+   block jumps to, the function a call is bound to, and any statements
+   hoisted onto a loop head.  Lines that will not compile are reported the
+   way running them would, so they show up before the script is run. */
+static const char *const op_names[OP_COUNT] = {
+    "nop", "unknown",
+    "set", "add", "sub", "mul", "div", "mod", "pow", "concat",
+    "inc", "dec",
+    "print", "say", "ask",
+    "if", "jump", "while", "repeat", "repeat_end", "for", "for_next",
+    "call", "ret", "return",
+    "push", "pop", "store", "load",
+    "newarray", "append", "getelem", "setelem", "size",
+    "sqrt", "abs", "len", "tonum", "tostr",
+    "find", "split", "replace", "substr", "extract", "format",
+    "spawn", "await", "newchan", "send", "recv",
+    "reduce", "map",
+    "snapshot",
+    "inc_while", "dec_while", "mod_if",
+    "for_count",
+    "add_n", "sub_n", "mul_n", "div_n", "mod_n",
+    "set_n", "while_end",
+    "powi",
+    "getelem_u", "setelem_u",
+    "stop"
+};
+
+/* A variable that share_temporaries put in another's slot shows as
+   name@slot, e.g. c@a. */
+static const char *dump_var(const Program *p, const char *name, int slot) {
+    static char buf[2 * MAX_NAME + 2];
+    const char *in = p->var_names[slot];
+    if (!name || strcmp(name, in) == 0) return in;
+    snprintf(buf, sizeof buf, "%s@%s", name, in);
+    return buf;
+}
+
+static int dump_operand(FILE *f, const Program *p, const Operand *o) {
+    switch (o->kind) {
+    case OPD_NUM: return fprintf(f, "const %.17g", o->num);
+    case OPD_STR: return fprintf(f, "const \"%s\"", o->str);
+    case OPD_VAR: return fprintf(f, "var %s%s", dump_var(p, o->str, o->slot), o->typed ? ":num" : "");
+    }
+    return 0;
+}
+
+/* How many of a, b, c the opcode reads as values. */
+static int dump_arity(OpCode op) {
+    switch (op) {
+    case OP_SET: case OP_SET_N: case OP_INC: case OP_DEC: case OP_ASK: case OP_REPEAT:
+    case OP_RETURN: case OP_PUSH: case OP_LOAD: case OP_APPEND: case OP_GETELEM: case OP_GETELEM_U:
+    case OP_SQRT: case OP_ABS: case OP_LEN: case OP_SNAPSHOT: case OP_AWAIT: case OP_SEND:
+    case OP_INC_WHILE: case OP_DEC_WHILE:
+        return 1;
+    case OP_ADD: case OP_SUB: case OP_MUL: case OP_DIV: case OP_MOD: case OP_POW: case OP_CONCAT:
+    case OP_ADD_N: case OP_SUB_N: case OP_MUL_N: case OP_DIV_N: case OP_MOD_N: case OP_POWI:
+    case OP_MOD_IF: case OP_STORE: case OP_SETELEM: case OP_SETELEM_U: case OP_FIND: case OP_SPLIT:
+        return 2;
+    case OP_FOR: case OP_REPLACE: case OP_SUBSTR:
+        return 3;
+    default:
+        return 0;
+    }
+}
+
+/* Returns the width printed. */
+static int dump_instr(FILE *f, const Program *p, const Instr *ins) {
+    static const char *const cmp_names[] = { "never", "?", ">", "<", ">=", "<=", "=", "empty", "zero", "matches" };
+    static const char *const reductions[] = { "sum", "product", "min", "max" };
+    int chan = ins->op == OP_NEWCHAN || ins->op == OP_SEND || ins->op == OP_RECV;
+    int n = fprintf(f, "%-10s", op_names[ins->op]);
+    if (ins->dst >= 0) n += fprintf(f, " var %s <-", dump_var(p, ins->dst_name, ins->dst));
+    const Operand *o[3] = { &ins->a, &ins->b, &ins->c };
+    for (int k = 0; k < dump_arity(ins->op); k++) {
+        n += fprintf(f, "%s", k ? ", " : " ");
+        n += dump_operand(f, p, o[k]);
+    }
+    if (ins->op == OP_IF || ins->op == OP_WHILE || ins->op == OP_EXTRACT) {
+        n += fprintf(f, " %s", ins->cond.neg ? "not " : "");
+        n += dump_operand(f, p, &ins->cond.lhs);
+        n += fprintf(f, " %s", cmp_names[ins->cond.op]);
+        if ((ins->cond.op >= CMP_GT && ins->cond.op <= CMP_EQ) || ins->cond.op == CMP_MATCH) {
+            n += fprintf(f, " ");
+            n += dump_operand(f, p, &ins->cond.rhs);
+        }
+    }
+    if (ins->op == OP_PRINT || ins->op == OP_SAY || ins->op == OP_CALL || ins->op == OP_SPAWN ||
+        ins->op == OP_NEWCHAN || ins->op == OP_FORMAT)
+        for (int k = 0; k < ins->nargs; k++) {
+            n += fprintf(f, "%s", k ? ", " : " ");
+            n += dump_operand(f, p, &ins->args[k]);
+            const FmtSpec *fs = ins->op == OP_FORMAT ? &ins->fmt[k] : NULL;
+            if (fs && (fs->width || fs->prec >= 0 || fs->align || fs->zero)) {
+                n += fprintf(f, " :%s%s", fs->align ? (fs->align == '<' ? "<" : ">") : "", fs->zero ? "0" : "");
+                if (fs->width) n += fprintf(f, "%d", fs->width);
+                if (fs->prec >= 0) n += fprintf(f, ".%d", fs->prec);
+            }
+        }
+    if (ins->arr >= 0)
+        n += fprintf(f, " %s %s", chan ? "channel" : "array", chan ? p->chan_names[ins->arr] : p->array_names[ins->arr]);
+    if (ins->arr2 >= 0) n += fprintf(f, " into array %s", p->array_names[ins->arr2]);
+    if (ins->op == OP_REDUCE) n += fprintf(f, " with %s", reductions[ins->aux]);
+    if (ins->op == OP_FOR && ins->aux) {
+        n += fprintf(f, " distributed");
+        for (int k = 0; k < ins->nargs; k++)
+            n += fprintf(f, "%s array %s", k ? "," : " gathering", p->array_names[ins->args[k].slot]);
+    }
+    if (ins->target >= 0) n += fprintf(f, " -> %d", ins->target + 1);
+    if (ins->op == OP_CALL || ins->op == OP_SPAWN || ins->op == OP_MAP) {
+        if (ins->func >= 0) n += fprintf(f, " bound to %s", p->funcs[ins->func].name);
+        else n += fprintf(f, " bound to nothing ('%s' is not defined)", ins->a.str);
+    }
+    for (int k = 0; k < ins->nbounds; k++)
+        n += fprintf(f, "%s%s", k ? ", " : ", checks once: array ", p->array_names[ins->bounds[k]]);
+    return n;
+}
+
+/* Returns 1 if some line will not compile, else 0. */
+static int dump_program(FILE *f, const Program *p, const Instr *code, const char *name) {
+    int unknown = 0;
+    fprintf(f, "; %s at -O%d: %d lines, %d variables, %d arrays, %d channels, %d functions\n", name,
+            opt_level, p->line_count, p->var_count, p->array_count, p->chan_count, p->func_count);
+    for (int k = 0; k < p->func_count; k++) {
+        const FuncDef *fd = &p->funcs[k];
+        fprintf(f, "; define %s, lines %d-%d", fd->name, fd->start_line + 1, fd->end_line + 1);
+        for (int j = 0; j < fd->param_count; j++)
+            fprintf(f, "%s var %s", j ? "," : ", with", p->var_names[fd->param_slots[j]]);
+        fputc('\n', f);
+    }
+    for (int i = 0; i < p->line_count; i++) {
+        const Instr *ins = &code[i];
+        if (ins->op == OP_NOP && !p->lines[i][0]) continue;
+        fprintf(f, "%5d  ", i + 1);
+        int w = dump_instr(f, p, ins);
+        fprintf(f, "%*s; %s\n", w < 44 ? 44 - w : 1, "", p->lines[i]);
+        for (int k = 0; k < ins->npre; k++) {
+            fputs("     + ", f);
+            w = dump_instr(f, p, &ins->pre[k]);
+            fprintf(f, "%*s; hoisted\n", w < 44 ? 44 - w : 1, "");
+        }
+        if (ins->op == OP_UNKNOWN) {
+            fprintf(stderr, "Warning: unknown instruction on line %d: '%s'\n", i + 1, p->lines[i]);
+            unknown = 1;
+        }
+        if (ins->cond.op == CMP_MATCH && ins->cond.rhs.kind == OPD_STR && !ins->cond.re) {
+            const char *err = "";
+            regexes_free(regex_compile(ins->cond.rhs.str, &err));   /* fails again, saying why */
+            fprintf(stderr, "Warning: bad pattern on line %d: %s\n", i + 1, err);
+            unknown = 1;
+        }
+    }
+    return unknown;
+}
+
+#ifdef PROFILE_PAIRS
+/* Built with -DPROFILE_PAIRS (make englang-profile), the interpreter counts
+   which instruction follows which and prints the most frequent pairs when
+   it exits.  Superinstructions are chosen from these counts. */
+static _Thread_local int prev_op = OP_NOP;
+static atomic_ulong pair_count[OP_COUNT][OP_COUNT];
+
+static void profile_pair(int op) {
+    atomic_fetch_add_explicit(&pair_count[prev_op][op], 1, memory_order_relaxed);
+    prev_op = op;
+}
+
+static void profile_report(void) {
+    unsigned long total = 0;
+    for (int a = 0; a < OP_COUNT; a++)
+        for (int b = 0; b < OP_COUNT; b++) total += pair_count[a][b];
+    fprintf(stderr, "%lu instructions executed; most frequent pairs:\n", total);
+    for (int k = 0; k < 20 && total > 0; k++) {
+        int ba = 0, bb = 0;
+        for (int a = 0; a < OP_COUNT; a++)
+            for (int b = 0; b < OP_COUNT; b++)
+                if (pair_count[a][b] > pair_count[ba][bb]) { ba = a; bb = b; }
+        if (!pair_count[ba][bb]) break;
+        fprintf(stderr, "  %-12s %-12s %12lu  %5.1f%%\n", op_names[ba], op_names[bb],
+                (unsigned long)pair_count[ba][bb], 100.0 * pair_count[ba][bb] / total);
+        pair_count[ba][bb] = 0;
+    }
+}
+#endif
+
+static void run_hoisted(Interp *in, const Instr *head) {
+    for (int k = 0; k < head->npre; k++) {
+        const Instr *ins = &head->pre[k];
+        double r = arith(ins->op, opd_num(in, &ins->a), opd_num(in, &ins->b));
+        Var *v = var_ref(in, ins->dst);
+        v->val.type = TYPE_NUM;
+        v->val.num  = r;
+    }
+}
+
+/* ─── Tiers ─── */
+/* At -O2 a script starts on its -O1 code, which is cheap to build, and
+   counts calls to each function and back-edges of each loop.  Once one of
+   them is hot the script is compiled again at -O2 (those passes look at the
+   whole program, so the whole program is recompiled) and the task moves
+   over: at the first line of a hot function, or at the start of the next
+   iteration of a hot loop, so a long while loop changes tier in the middle
+   of its run.  Both forms keep each line at its index and agree on every
+   variable live where a run of lines begins, which is where the switch
+   happens; statements the -O2 code hoists onto the loop head are worked out
+   on the way in.
+
+   The -O2 code also speculates on the types the task saw when it got hot
+   (see types_speculate), and each place it can be entered checks that.  A
+   loop head whose check fails sends the task back to the -O1 code at the
+   same line, and the -O2 code is compiled afresh, from what the next task
+   to get hot sees, up to MAX_RESPECS times; after that it speculates on
+   nothing.  A task keeps the code it moved onto until it moves again, so
+   replaced code lives as long as the program. */
+#define HOT_CALLS 100
+#define HOT_LOOPS 1000
+#define MAX_RESPECS 4
+
+static pthread_mutex_t tier_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static const Instr *hot_code(const Program *prog, const Interp *seen) {
+    Program *p = (Program *)prog;
+    Instr *code = atomic_load_explicit(&p->hot_code, memory_order_acquire);
+    if (code) return code;
+    pthread_mutex_lock(&tier_lock);
+    code = atomic_load_explicit(&p->hot_code, memory_order_relaxed);
+    if (!code) {
+        /* compile into a copy: other tasks go on running p->code meanwhile */
+        Program *q = xrealloc(NULL, sizeof *q);
+        memcpy(q, p, sizeof *q);
+        q->code = prog_alloc(q, (p->line_count + 1) * sizeof(Instr));
+        compile_code(q, 2, p->respecs < MAX_RESPECS ? seen : NULL);
+        code = q->code;
+        p->allocs      = q->allocs;
+        p->alloc_count = q->alloc_count;
+        p->alloc_cap   = q->alloc_cap;
+        p->regexes     = q->regexes;
+        free(q);
+        atomic_store_explicit(&p->hot_code, code, memory_order_release);
+    }
+    pthread_mutex_unlock(&tier_lock);
+    return code;
+}
+
+/* A guard failed in `code`: retire it, unless it already has been. */
+static void respecialize(const Program *prog, const Instr *code) {
+    Program *p = (Program *)prog;
+    pthread_mutex_lock(&tier_lock);
+    if (atomic_load_explicit(&p->hot_code, memory_order_relaxed) == code) {
+        atomic_store_explicit(&p->hot_code, NULL, memory_order_release);
+        p->respecs++;
+    }
+    pthread_mutex_unlock(&tier_lock);
+}
+
+/* Whether what the -O2 code speculated on at `ins` still holds. */
+static int guard_holds(const Interp *in, const Instr *ins) {
+    for (int k = 0; k < ins->nguard; k++) {
+        int g = ins->guard[k];
+        if (g >= 0 ? in->vars[g].val.type != TYPE_NUM : in->arrays[~g].nstr > 0)
+            return 0;
+    }
+    return 1;
+}
+
+/* Counts a call or back-edge at `line`; nonzero once it is hot. */
+static inline int heat_up(const Program *p, int line, unsigned hot) {
+    atomic_uint *h = &p->heat[line];
+    if (atomic_load_explicit(h, memory_order_relaxed) >= hot) return 1;
+    return atomic_fetch_add_explicit(h, 1, memory_order_relaxed) + 1 >= hot;
+}
+
+/* Moves `t` onto the -O2 code, about to run `pc`: the head of the loop at
+   `head`, the first line of its body, or (head -1) a function's first line.
+   Returns NULL, leaving it where it is, if that code speculated wrongly. */
+static const Instr *tier_up(Task *t, int pc) {
+    const Instr *code = hot_code(t->in->prog, t->in);
+    if (!guard_holds(t->in, &code[pc])) {
+        respecialize(t->in->prog, code);
+        return NULL;
+    }
+    /* what the -O2 code hoisted onto the head of each loop the task is
+       inside (outermost first) never ran in the -O1 code; a loop with a
+       call in it hoists nothing, so the lines that called here need none */
+    for (int h = 0; h < pc; h++)
+        if (code[h].npre && pc < code[h].target) run_hoisted(t->in, &code[h]);
+    t->hot = code;
+    return code;
+}
+
+static VMResult vm_exec(Task *t) {
+    Interp *in = t->in;
+    Run *run = t->run;
+    const Program *prog = in->prog;
+    const Instr *code = t->hot ? t->hot : prog->code;
+    int tiering = !t->hot && prog->heat;
+    const int n = prog->line_count;
+    int pc = t->pc;
+    char sb[256];
+
+#define HALT_CHECK() \
+    if (--t->fuel <= 0 || atomic_load_explicit(&run->halted, memory_order_relaxed)) { \
+        VMResult r_; \
+        t->pc = pc; \
+        if (vm_tick(t, &r_)) return r_; \
+    }
+#define TIER_CHECK(line, hot) \
+    if (tiering && heat_up(prog, line, hot)) { \
+        const Instr *up_ = tier_up(t, pc); \
+        if (up_) { code = up_; tiering = 0; } \
+    }
+/* a loop head whose speculation failed goes on at the same line in -O1 code */
+#define DEOPT_CHECK() \
+    if (ins->nguard && !guard_holds(in, ins)) { \
+        respecialize(prog, code); \
+        code = prog->code; \
+        t->hot = NULL; \
+        tiering = 1; \
+        break; \
+    }
+
+    for (;;) {
+        if (pc >= n) {
+            /* a define without "end define" runs to the end of the file */
+            if (t->rsp > 0) { pc = t->rets[--t->rsp]; continue; }
+            t->pc = pc;
+            return VM_DONE;
+        }
+        const Instr *ins = &code[pc];
+#ifdef PROFILE_PAIRS
+        profile_pair(ins->op);
+#endif
+        switch (ins->op) {
+        case OP_NOP:
+            pc++;
+            break;
+
+        case OP_SET: {
+            Var *v = var_ref(in, ins->dst);
+            v->val = opd_value(in, &ins->a);
+            pc++;
+            break;
+        }
+        case OP_ADD: case OP_SUB: case OP_MUL: case OP_DIV: case OP_MOD: case OP_POW: {
+            Var *v = var_ref(in, ins->dst);
+            double a = opd_num(in, &ins->a), b = opd_num(in, &ins->b), r = 0;
+            switch (ins->op) {
+            case OP_ADD: r = a + b; break;
+            case OP_SUB: r = a - b; break;
+            case OP_MUL: r = a * b; break;
+            case OP_DIV: r = (b != 0) ? a / b : 0; break;
+            case OP_MOD: r = long_mod(a, b, ins->c.num); break;
+            default: r = pow(a, b); break;
+            }
+            v->val.type = TYPE_NUM;
+            v->val.num  = r;
+            pc++;
+            break;
+        }
+        case OP_ADD_N: case OP_SUB_N: case OP_MUL_N: case OP_DIV_N: case OP_MOD_N: {
+            /* both operands are literals or variables proven to be numbers */
+            Var *v = var_ref(in, ins->dst);
+            double a = ins->a.kind == OPD_NUM ? ins->a.num : in->vars[ins->a.slot].val.num;
+            double b = ins->b.kind == OPD_NUM ? ins->b.num : in->vars[ins->b.slot].val.num;
+            double r;
+            switch (ins->op) {
+            case OP_ADD_N: r = a + b; break;
+            case OP_SUB_N: r = a - b; break;
+            case OP_MUL_N: r = a * b; break;
+            case OP_DIV_N: r = (b != 0) ? a / b : 0; break;
+            default: r = long_mod(a, b, ins->c.num); break;
+            }
+            v->val.type = TYPE_NUM;
+            v->val.num  = r;
+            pc++;
+            break;
+        }
+        case OP_SET_N: {
+            /* an earlier result, a folded literal or an identity's operand */
+            double x = opd_num(in, &ins->a);
+            Var *v = var_ref(in, ins->dst);
+            v->val.type = TYPE_NUM;
+            v->val.num  = x;
+            pc++;
+            break;
+        }
+        case OP_POWI: {
+            double x = opd_num(in, &ins->a);
+            Var *v = var_ref(in, ins->dst);
+            v->val.type = TYPE_NUM;
+            v->val.num  = powi(x, (int)ins->b.num, ins->c.num);
+            pc++;
+            break;
+        }
+        case OP_CONCAT: {
+            Var *v = var_ref(in, ins->dst);
+            char lb[256], rb[256], out[256];
+            snprintf(out, 256, "%s%s", opd_str(in, &ins->a, lb, 256), opd_str(in, &ins->b, rb, 256));
+            v->val.type = TYPE_STR;
+            v->val.text = 0;
+            strcpy(v->val.str, out);
+            pc++;
+            break;
+        }
+        case OP_INC: case OP_DEC: {
+            Var *v = var_ref(in, ins->dst);
+            double by = opd_num(in, &ins->a);
+            v->val.type = TYPE_NUM;
+            if (ins->op == OP_INC) v->val.num += by;
+            else v->val.num -= by;
+            pc++;
+            break;
+        }
+        case OP_INC_WHILE: case OP_DEC_WHILE: {
+            /* the increment, "end while" and the while test in one step */
+            Var *v = var_ref(in, ins->dst);
+            double by = opd_num(in, &ins->a);
+            v->val.type = TYPE_NUM;
+            if (ins->op == OP_INC_WHILE) v->val.num += by;
+            else v->val.num -= by;
+            int head = pc = ins->target;
+            HALT_CHECK();
+            pc = eval_condition(in, &code[pc].cond) ? pc + 1 : code[pc].target;
+            if (pc == head + 1) TIER_CHECK(head, HOT_LOOPS);
+            break;
+        }
+        case OP_MOD_IF: {
+            Var *v = var_ref(in, ins->dst);
+            double a = opd_num(in, &ins->a), b = opd_num(in, &ins->b);
+            double r = long_mod(a, b, ins->c.num);
+            v->val.type = TYPE_NUM;
+            v->val.num  = r;
+            const Instr *next = &code[pc + 1];
+            int taken = ins->aux ? (r == 0) != next->cond.neg : eval_condition(in, &next->cond);
+            pc = taken ? pc + 2 : next->target;
+            break;
+        }
+
+        case OP_PRINT: case OP_SAY: {
+            /* build the whole line so concurrent tasks never interleave */
+            char out[MAX_TOKENS * 258];
+            int len = 0;
+            for (int i = 0; i < ins->nargs; i++) {
+                const char *s = opd_str(in, &ins->args[i], sb, 256);
+                if (ins->op == OP_PRINT && i > 0) out[len++] = ' ';
+                size_t sl = strlen(s);
+                memcpy(out + len, s, sl);
+                len += sl;
+                if (ins->op == OP_SAY) out[len++] = ' ';
+            }
+            out[len++] = '\n';
+            run_write(run, out, len);
+            pc++;
+            break;
+        }
+        case OP_ASK: {
+            const char *prompt = opd_str(in, &ins->a, sb, 256);
+            run_write(run, prompt, strlen(prompt));
+            run_write(run, " ", 1);
+            if (!run->capture) fflush(stdout);
+            char input[256];
+            if (run_read_line(run, input, 256)) {
+                char *nl = strchr(input, '\n');
+                if (nl) *nl = '\0';
+                parse_input(input, &var_ref(in, ins->dst)->val);
+            }
+            pc++;
+            break;
+        }
+
+        case OP_IF:
+            pc = eval_condition(in, &ins->cond) ? pc + 1 : ins->target;
+            break;
+        case OP_WHILE:
+            DEOPT_CHECK();
+            if (!eval_condition(in, &ins->cond)) { pc = ins->target; break; }
+            if (ins->npre) run_hoisted(in, ins);
+            pc++;
+            break;
+        case OP_WHILE_END:
+            /* a loop with hoisted statements: back to the test, not the head */
+            pc = ins->target;
+            HALT_CHECK();
+            pc = eval_condition(in, &code[pc].cond) ? pc + 1 : code[pc].target;
+            break;
+        case OP_JUMP:
+            if (ins->target > pc) { pc = ins->target; break; }
+            HALT_CHECK();
+            pc = ins->target;
+            TIER_CHECK(pc, HOT_LOOPS);    /* "end while": the test runs on the new code */
+            break;
+        case OP_REPEAT: {
+            DEOPT_CHECK();
+            int count = (int)opd_num(in, &ins->a);
+            if (count <= 0) { pc = ins->target; break; }
+            push_loop(t)->count = count;
+            if (ins->npre) run_hoisted(in, ins);
+            pc++;
+            break;
+        }
+        case OP_REPEAT_END: {
+            LoopFrame *lf = &t->loops[t->lsp - 1];
+            if (--lf->count > 0) {
+                pc = ins->target + 1;
+                HALT_CHECK();   /* after the update: a yielded task resumes at pc */
+                TIER_CHECK(ins->target, HOT_LOOPS);
+            } else {
+                t->lsp--;
+                pc++;
+            }
+            break;
+        }
+        case OP_FOR: {
+            DEOPT_CHECK();
+            double from = opd_num(in, &ins->a);
+            double to   = opd_num(in, &ins->b);
+            double step = opd_num(in, &ins->c);
+            Var *v = var_ref(in, ins->dst);
+            v->val.type = TYPE_NUM;
+            long long trips = for_trips(from, to, step);
+            if (trips == 0) { pc = ins->target; break; }
+            if (ins->aux && opt_shards > 0) {
+                vm_charge(t);       /* the shards start from the run's steps so far */
+                int r = dist_for(t, pc, from, step, to, trips);
+                vm_charge(t);       /* and the slice from what they left */
+                if (r < 0) { t->pc = pc; return VM_HALTED; }
+                if (r == 0) { pc = ins->target; break; }
+            }
+            LoopFrame *lf = push_loop(t);
+            lf->from  = from;
+            lf->step  = step;
+            lf->to    = to;
+            lf->k     = 0;
+            lf->trips = trips;
+            lf->in_bounds = ins->nbounds && for_in_bounds(in, ins, from, step, to, trips);
+            if (ins->aux && !dist_keep(t, lf)) {
+                t->lsp--;
+                t->pc = pc;
+                vm_charge(t);
+                run_exceeded(run, 'm');
+                return VM_HALTED;
+            }
+            v->val.num = from;
+            if (ins->npre) run_hoisted(in, ins);
+            pc++;
+            break;
+        }
+        case OP_FOR_NEXT: {
+            LoopFrame *lf = &t->loops[t->lsp - 1];
+            if (++lf->k < lf->trips) {
+                Var *v = var_ref(in, code[ins->target].dst);
+                v->val.type = TYPE_NUM;
+                v->val.num  = for_value(lf->from, lf->step, lf->to, lf->k);
+                pc = ins->target + 1;
+                HALT_CHECK();
+                TIER_CHECK(ins->target, HOT_LOOPS);
+            } else {
+                if (lf->keeps) dist_restore(t, &code[ins->target]);
+                t->lsp--;
+                pc++;
+                if (pc == t->stop_pc) { t->pc = pc; return VM_DONE; }
+            }
+            break;
+        }
+        case OP_FOR_COUNT: {
+            LoopFrame *lf = &t->loops[t->lsp - 1];
+            if (++lf->k < lf->trips) {
+                pc = ins->target + 1;
+                HALT_CHECK();
+                TIER_CHECK(ins->target, HOT_LOOPS);
+            } else {
+                if (lf->keeps) dist_restore(t, &code[ins->target]);
+                /* the value the last iteration would have seen */
+                Var *v = var_ref(in, code[ins->target].dst);
+                v->val.type = TYPE_NUM;
+                v->val.num  = for_value(lf->from, lf->step, lf->to, lf->trips - 1);
+                t->lsp--;
+                pc++;
+            }
+            break;
+        }
+
+        case OP_CALL: {
+            if (ins->func < 0) {
+                diag(run, "Error: undefined function '%s'\n", ins->a.str);
+                pc++;
+                break;
+            }
+            HALT_CHECK();
+            const FuncDef *f = &prog->funcs[ins->func];
+            bind_params(in, in, f, ins);
+            if (!push_ret(t, pc + 1)) {
+                diag(run, "Error: call stack overflow on line %d\n", pc + 1);
+                t->pc = pc;
+                run_halt(run, 1);
+                return VM_HALTED;
+            }
+            pc = f->start_line;
+            TIER_CHECK(pc - 1, HOT_CALLS);     /* counted on the define line */
+            break;
+        }
+        case OP_RET:
+            if (t->rsp == 0) { t->pc = pc; return VM_DONE; }
+            pc = t->rets[--t->rsp];
+            break;
+        case OP_RETURN: {
+            Var *rv = var_ref(in, ins->dst);
+            rv->val = opd_value(in, &ins->a);
+            pc++;
+            break;
+        }
+
+        case OP_SPAWN: {
+            if (ins->func < 0) {
+                diag(run, "Error: undefined function '%s'\n", ins->a.str);
+                pc++;
+                break;
+            }
+            const FuncDef *f = &prog->funcs[ins->func];
+            if (!run_fits(run, context_bytes(in) + sizeof(Task))) {
+                t->pc = pc;
+                vm_charge(t);
+                run_exceeded(run, 'm');
+                return VM_HALTED;
+            }
+            Interp *child = interp_clone(in);
+            Task *c = task_new(run, child, f->start_line);
+            int id = run_register(run, c);
+            bind_params(child, in, f, ins);
+            if (t->hot && guard_holds(child, &code[f->start_line])) c->hot = t->hot;
+            if (ins->dst >= 0) {
+                Var *v = var_ref(in, ins->dst);
+                v->val.type = TYPE_NUM;
+                v->val.num  = id;
+            }
+            start_workers();
+            task_schedule(c);
+            pc++;
+            break;
+        }
+        case OP_AWAIT: {
+            int id = (int)opd_num(in, &ins->a);
+            Task *w = run_lookup(run, id);
+            if (!w || w == t) {
+                diag(run, "Error: no task %d to await on line %d\n", id, pc + 1);
+                pc++;
+                break;
+            }
+            pthread_mutex_lock(&w->lock);
+            if (w->state != TASK_DONE) {
+                t->next = w->waiters;
+                w->waiters = t;
+                t->park_lock = &w->lock;
+                t->pc = pc;
+                return VM_PARKED;
+            }
+            Value r = w->result;
+            pthread_mutex_unlock(&w->lock);
+            if (ins->dst >= 0) var_ref(in, ins->dst)->val = r;
+            pc++;
+            break;
+        }
+
+        case OP_NEWCHAN: {
+            int capacity = ins->nargs ? (int)opd_num(in, &ins->args[0]) : 0;
+            if (ins->nargs && !atomic_load_explicit(&run->chans[ins->arr], memory_order_acquire) &&
+                !run_fits(run, (long long)(capacity > 0 ? capacity : 1) * sizeof(Cell))) {
+                t->pc = pc;
+                vm_charge(t);
+                run_exceeded(run, 'm');
+                return VM_HALTED;
+            }
+            run_channel(run, ins->arr, ins->aux, ins->nargs > 0, capacity);
+            pc++;
+            break;
+        }
+        case OP_SEND: {
+            Channel *ch = run_channel(run, ins->arr, -1, 0, 0);
+            Value v = opd_value(in, &ins->a);
+            if (ch->kind >= 0 && (int)v.type != ch->kind) {
+                diag(run, "Error: channel '%s' carries %s, on line %d\n", ch->name,
+                     ch->kind == TYPE_NUM ? "numbers" : "strings", pc + 1);
+                t->pc = pc;
+                run_halt(run, 1);
+                return VM_HALTED;
+            }
+            int sent = chan_send(t, ch, &v);
+            if (sent < 0) {
+                t->pc = pc;
+                vm_charge(t);
+                run_exceeded(run, 'm');
+                return VM_HALTED;
+            }
+            if (!sent) { t->pc = pc; return VM_PARKED; }
+            pc++;
+            break;
+        }
+        case OP_RECV: {
+            Channel *ch = run_channel(run, ins->arr, -1, 0, 0);
+            Value v;
+            if (!chan_recv(t, ch, &v)) { t->pc = pc; return VM_PARKED; }
+            var_ref(in, ins->dst)->val = v;
+            pc++;
+            break;
+        }
+
+        case OP_PUSH:
+            if (in->stack_top < MAX_STACK)
+                in->data_stack[in->stack_top++] = opd_num(in, &ins->a);
+            pc++;
+            break;
+        case OP_POP: {
+            Var *v = var_ref(in, ins->dst);
+            v->val.type = TYPE_NUM;
+            v->val.num  = (in->stack_top > 0) ? in->data_stack[--in->stack_top] : 0;
+            pc++;
+            break;
+        }
+        case OP_STORE: {
+            int addr = (int)opd_num(in, &ins->b);
+            if (addr >= 0 && addr < MAX_MEM)
+                in->mem[addr] = opd_num(in, &ins->a);
+            pc++;
+            break;
+        }
+        case OP_LOAD: {
+            int addr = (int)opd_num(in, &ins->a);
+            Var *v = var_ref(in, ins->dst);
+            v->val.type = TYPE_NUM;
+            v->val.num  = (addr >= 0 && addr < MAX_MEM) ? in->mem[addr] : 0;
+            pc++;
+            break;
+        }
+
+        case OP_NEWARRAY:
+            array_ref(in, ins->arr);
+            pc++;
+            break;
+        case OP_APPEND: {
+            Array *a = array_ref(in, ins->arr);
+            if (a->size < MAX_ARRAY_SIZE) {
+                Value v = opd_value(in, &ins->a);
+                if (!array_fits(in, a, a->size)) {
+                    t->pc = pc;
+                    vm_charge(t);
+                    run_exceeded(run, 'm');
+                    return VM_HALTED;
+                }
+                array_reserve(in, a, a->size);
+                array_put(in, a, a->size++, &v);
+            }
+            pc++;
+            break;
+        }
+        case OP_GETELEM_U:
+            if (t->loops[t->lsp - 1].in_bounds) {
+                /* the for line checked every index this will see */
+                Var *v = var_ref(in, ins->dst);
+                array_get(&in->arrays[ins->arr], (int)opd_num(in, &ins->a), &v->val);
+                pc++;
+                break;
+            }
+            /* fall through */
+        case OP_GETELEM: {
+            int i = (int)opd_num(in, &ins->a);
+            Array *a = find_array(in, ins->arr);
+            Var *v = var_ref(in, ins->dst);
+            if (a && i >= 0 && i < a->size)
+                array_get(a, i, &v->val);
+            else { v->val.type = TYPE_NUM; v->val.num = 0; }
+            pc++;
+            break;
+        }
+        case OP_SETELEM_U:
+            if (t->loops[t->lsp - 1].in_bounds) {
+                Value v = opd_value(in, &ins->b);
+                array_put(in, &in->arrays[ins->arr], (int)opd_num(in, &ins->a), &v);
+                pc++;
+                break;
+            }
+            /* fall through */
+        case OP_SETELEM: {
+            int i = (int)opd_num(in, &ins->a);
+            Array *a = array_ref(in, ins->arr);
+            if (i >= 0 && i < MAX_ARRAY_SIZE) {
+                Value v = opd_value(in, &ins->b);
+                if (!array_fits(in, a, i)) {
+                    t->pc = pc;
+                    vm_charge(t);
+                    run_exceeded(run, 'm');
+                    return VM_HALTED;
+                }
+                array_reserve(in, a, i);
+                array_put(in, a, i, &v);
+                if (i >= a->size) a->size = i + 1;
+            }
+            pc++;
+            break;
+        }
+        case OP_REDUCE: {
+            double r = array_reduce(t, find_array(in, ins->arr), (ReduceOp)ins->aux);
+            Var *v = var_ref(in, ins->dst);
+            v->val.type = TYPE_NUM;
+            v->val.num  = r;
+            pc++;
+            break;
+        }
+        case OP_MAP: {
+            if (ins->func < 0) {
+                diag(run, "Error: undefined function '%s'\n", ins->a.str);
+                pc++;
+                break;
+            }
+            const FuncDef *f = &prog->funcs[ins->func];
+            if (f->waits) {
+                diag(run, "Error: cannot map with '%s' on line %d: it waits on tasks or channels\n",
+                     f->name, pc + 1);
+                t->pc = pc;
+                run_halt(run, 1);
+                return VM_HALTED;
+            }
+            const Array *src = find_array(in, ins->arr);
+            if (!run_fits(run, map_bytes(t, src))) {
+                t->pc = pc;
+                vm_charge(t);
+                run_exceeded(run, 'm');
+                return VM_HALTED;
+            }
+            Array *dst = array_ref(in, ins->arr2);
+            if (!array_map(t, f, src, dst)) {
+                t->pc = pc;
+                return VM_HALTED;
+            }
+            pc++;
+            break;
+        }
+        case OP_SIZE: {
+            Array *a = find_array(in, ins->arr);
+            Var *v = var_ref(in, ins->dst);
+            v->val.type = TYPE_NUM;
+            v->val.num  = a ? a->size : 0;
+            pc++;
+            break;
+        }
+
+        case OP_SQRT: case OP_ABS: {
+            Var *v = var_ref(in, ins->dst);
+            double x = opd_num(in, &ins->a);
+            v->val.type = TYPE_NUM;
+            v->val.num  = (ins->op == OP_SQRT) ? sqrt(x) : fabs(x);
+            pc++;
+            break;
+        }
+        case OP_LEN: {
+            const char *str = opd_str(in, &ins->a, sb, 256);
+            size_t len = text_chars(str, strlen(str));
+            Var *v = var_ref(in, ins->dst);
+            v->val.type = TYPE_NUM;
+            v->val.num  = len;
+            pc++;
+            break;
+        }
+        case OP_FIND: {
+            char nb[256];
+            const char *nd = opd_str(in, &ins->a, nb, 256), *h = opd_str(in, &ins->b, sb, 256);
+            size_t hn = strlen(h);
+            const char *hit = text_find(h, hn, nd, strlen(nd));
+            Var *v = var_ref(in, ins->dst);
+            v->val.type = TYPE_NUM;
+            v->val.num  = hit ? (double)text_index(h, hn, hit - h) : -1;
+            pc++;
+            break;
+        }
+        case OP_SPLIT: {
+            char pb[256];
+            const char *str = opd_str(in, &ins->a, sb, 256), *sep = opd_str(in, &ins->b, pb, 256);
+            if (!text_split(in, array_ref(in, ins->arr), str, sep)) {
+                t->pc = pc;
+                vm_charge(t);
+                run_exceeded(run, 'm');
+                return VM_HALTED;
+            }
+            pc++;
+            break;
+        }
+        case OP_REPLACE: {
+            char fb[256], tb[256], out[256];
+            text_replace(opd_str(in, &ins->c, sb, 256), opd_str(in, &ins->a, fb, 256),
+                         opd_str(in, &ins->b, tb, 256), out);
+            Var *v = var_ref(in, ins->dst);
+            v->val.type = TYPE_STR;
+            v->val.text = 0;
+            strcpy(v->val.str, out);
+            pc++;
+            break;
+        }
+        case OP_SUBSTR: {
+            const char *str = opd_str(in, &ins->a, sb, 256);
+            size_t n = strlen(str);
+            double len = text_chars(str, n), from = opd_num(in, &ins->b), to = opd_num(in, &ins->c);
+            if (!(from > 0)) from = 0;
+            if (from > len) from = len;
+            if (!(to < len)) to = len;
+            if (to < from) to = from;
+            Var *v = var_ref(in, ins->dst);
+            int i = text_offset(str, n, (size_t)from), j = text_offset(str, n, (size_t)to);
+            memmove(v->val.str, str + i, j - i);   /* str may be v's own text */
+            v->val.str[j - i] = '\0';
+            v->val.type = TYPE_STR;
+            v->val.text = 0;
+            pc++;
+            break;
+        }
+        case OP_EXTRACT: {
+            Regex *fresh;
+            const Regex *re = cond_regex(in, &ins->cond, &fresh);
+            if (re && !text_extract(in, array_ref(in, ins->arr), re, opd_str(in, &ins->cond.lhs, sb, 256))) {
+                if (fresh) regex_free(fresh);
+                t->pc = pc;
+                vm_charge(t);
+                run_exceeded(run, 'm');
+                return VM_HALTED;
+            }
+            if (fresh) regex_free(fresh);
+            pc++;
+            break;
+        }
+        case OP_FORMAT: {
+            char out[256];   /* an argument may be the destination itself */
+            text_format(in, ins, out);
+            Var *v = var_ref(in, ins->dst);
+            v->val.type = TYPE_STR;
+            v->val.text = 0;
+            strcpy(v->val.str, out);
+            pc++;
+            break;
+        }
+        case OP_TONUM: {
+            Var *v = var_ref(in, ins->dst);
+            if (v->val.type == TYPE_STR) {
+                v->val.num  = atof(v->val.str);
+                v->val.type = TYPE_NUM;
+            }
+            pc++;
+            break;
+        }
+        case OP_TOSTR: {
+            Var *v = var_ref(in, ins->dst);
+            if (v->val.type == TYPE_NUM) {
+                num_text(&v->val);
+                v->val.type = TYPE_STR;
+                v->val.text = 0;
+            }
+            pc++;
+            break;
+        }
+
+        case OP_SNAPSHOT: {
+            /* other tasks' state can't be saved, so they must be over */
+            int busy = 0;
+            pthread_mutex_lock(&run->lock);
+            for (int i = 0; i < run->ntasks; i++) {
+                pthread_mutex_lock(&run->tasks[i]->lock);
+                if (run->tasks[i]->state != TASK_DONE) busy = 1;
+                pthread_mutex_unlock(&run->tasks[i]->lock);
+            }
+            pthread_mutex_unlock(&run->lock);
+            const char *path = opd_str(in, &ins->a, sb, 256);
+            const char *why = run->untrusted ? "not allowed in a batch or served run"
+                            : t != run->main ? "only the main program can snapshot"
+                            : t->nkept || run->chunk ? "a distributed loop is in progress"
+                            : busy ? "tasks are still running" : NULL;
+            if (!why && snapshot_write(t, pc + 1, path) != 0) why = strerror(errno);
+            if (why) {
+                diag(run, "Error: cannot snapshot to '%s' on line %d: %s\n", path, pc + 1, why);
+                t->pc = pc;
+                run_halt(run, 1);
+                return VM_HALTED;
+            }
+            pc++;
+            break;
+        }
+
+        case OP_STOP:
+            t->pc = pc;
+            run_halt(run, 0);
+            return VM_HALTED;
+
+        case OP_UNKNOWN:
+            diag(run, "Warning: unknown instruction on line %d: '%s'\n", pc + 1, prog->lines[pc]);
+            pc++;
+            break;
+        }
+    }
+#undef HALT_CHECK
+#undef TIER_CHECK
+#undef DEOPT_CHECK
+}
+
+/* ─── Batch mode ─── */
+/* Every script of a batch gets its own Run, all of them sharing the worker
+   pool.  Output is held per run and printed in script order; scripts with
+   identical source are compiled once and share the Program. */
+typedef struct {
+    uint64_t  hash;
+    char     *text;
+    size_t    len;
+    Program  *prog;
+} Source;
+
+static uint64_t fnv1a(const char *s, size_t n) {
+    uint64_t h = 1469598103934665603ULL;
+    for (size_t i = 0; i < n; i++) {
+        h ^= (unsigned char)s[i];
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+static int cmp_path(const void *a, const void *b) {
+    return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+/* The scripts named by `arg`: the .eng files of a directory in name order,
+   or the paths listed one per line in a file (blank lines and # comments
+   are skipped).  Returns the count, or -1 if `arg` cannot be read. */
+static int batch_paths(const char *arg, char ***out) {
+    struct stat st;
+    if (stat(arg, &st) != 0) { perror(arg); return -1; }
+    char **paths = NULL;
+    int n = 0, cap = 0;
+    char buf[4096];
+    if (S_ISDIR(st.st_mode)) {
+        DIR *d = opendir(arg);
+        if (!d) { perror(arg); return -1; }
+        struct dirent *e;
+        while ((e = readdir(d))) {
+            size_t l = strlen(e->d_name);
+            if (l < 5 || strcmp(e->d_name + l - 4, ".eng") != 0) continue;
+            if (n == cap) paths = xrealloc(paths, (cap = cap ? cap * 2 : 64) * sizeof(char *));
+            snprintf(buf, sizeof buf, "%s/%s", arg, e->d_name);
+            paths[n++] = strdup(buf);
+        }
+        closedir(d);
+        if (n > 1) qsort(paths, n, sizeof(char *), cmp_path);
+    } else {
+        FILE *f = fopen(arg, "r");
+        if (!f) { perror(arg); return -1; }
+        while (fgets(buf, sizeof buf, f)) {
+            buf[strcspn(buf, "\r\n")] = '\0';
+            char *p = trim(buf);
+            if (!*p || *p == '#') continue;
+            if (n == cap) paths = xrealloc(paths, (cap = cap ? cap * 2 : 64) * sizeof(char *));
+            paths[n++] = strdup(p);
+        }
+        fclose(f);
+    }
+    *out = paths;
+    return n;
+}
+
+typedef struct {
+    int    n, next;     /* scripts, and the first not yet printed */
+    char **paths;
+    Run  **runs;        /* NULL once printed, or if unreadable */
+    int   *status;
+    int   *err;         /* errno from reading the script, or 0 */
+} Batch;
+
+/* Print every finished script from b->next on, stopping at the first one
+   still running. */
+static void batch_emit(Batch *b) {
+    for (; b->next < b->n; b->next++) {
+        int i = b->next;
+        Run *run = b->runs[i];
+        if (!run) {
+            fprintf(stderr, "%s: %s\n", b->paths[i], strerror(b->err[i]));
+            continue;
+        }
+        if (!atomic_load(&run->done)) break;
+        if (run->out.len) {
+            fwrite(run->out.data, 1, run->out.len, stdout);
+            fflush(stdout);
+        }
+        if (run->err.len) fwrite(run->err.data, 1, run->err.len, stderr);
+        b->status[i] = run->status;
+        run_free(run);
+        b->runs[i] = NULL;
+    }
+}
+
+static int run_batch(const char *arg) {
+    Batch b = {0};
+    b.n = batch_paths(arg, &b.paths);
+    if (b.n < 0) return 1;
+    int n = b.n;
+    b.runs   = calloc(n + 1, sizeof(Run *));
+    b.status = calloc(n + 1, sizeof(int));
+    b.err    = calloc(n + 1, sizeof(int));
+    Source *srcs = calloc(n + 1, sizeof(Source));
+    int nsrc = 0;
+    atomic_int remaining = 0;
+
+    /* load and compile everything before anything runs */
+    for (int i = 0; i < n; i++) {
+        size_t len;
+        char *text = read_source(b.paths[i], &len);
+        if (!text) {
+            b.err[i] = errno;
+            b.status[i] = 1;
+            continue;
+        }
+        uint64_t h = fnv1a(text, len);
+        Source *src = NULL;
+        for (int k = 0; k < nsrc && !src; k++)
+            if (srcs[k].hash == h && srcs[k].len == len && memcmp(srcs[k].text, text, len) == 0)
+                src = &srcs[k];
+        if (src) {
+            free(text);
+        } else {
+            src = &srcs[nsrc++];
+            src->hash = h;
+            src->text = text;
+            src->len  = len;
+            src->prog = compile_source(text, len);
+        }
+        b.runs[i] = run_new(src->prog);
+        b.runs[i]->capture   = 1;
+        b.runs[i]->untrusted = 1;
+        b.runs[i]->remaining = &remaining;
+        atomic_fetch_add(&remaining, 1);
+    }
+
+    start_workers();
+    for (int i = 0; i < n; i++)
+        if (b.runs[i]) task_schedule(b.runs[i]->main);
+    Task *t;
+    while ((t = rq_pop(&remaining))) {
+        run_task(t);
+        batch_emit(&b);
+    }
+    batch_emit(&b);
+
+    int failed = 0;
+    for (int i = 0; i < n; i++)
+        if (b.status[i] != 0) failed++;
+    fprintf(stderr, "\n%d scripts, %d failed\n", n, failed);
+    for (int i = 0; i < n; i++)
+        fprintf(stderr, "%4d  %s\n", b.status[i], b.paths[i]);
+
+    for (int k = 0; k < nsrc; k++) {
+        free_program(srcs[k].prog);
+        free(srcs[k].text);
+    }
+    for (int i = 0; i < n; i++) free(b.paths[i]);
+    free(b.paths);
+    free(b.runs);
+    free(b.status);
+    free(b.err);
+    free(srcs);
+    return failed ? 1 : 0;
+}
+
+/* ─── Server mode ─── */
+/* A resident process answers run requests (see englang-wire.h) on a Unix
+   socket.  Compiled scripts are cached by path and reused until the file's
+   modification time or size changes; each request gets its own Run on the
+   worker pool and the reply is sent by whichever worker finishes it. */
+#define SCRIPT_BUCKETS 256
+
+typedef struct Script {
+    char          *path;
+    struct timespec mtime;
+    off_t          size;
+    Program       *prog;
+    int            refs;        /* one for the cache, one per run using it */
+    struct Script *next;
+} Script;
+
+typedef struct {
+    int     fd;
+    Script *script;
+} Client;
+
+static pthread_mutex_t script_lock = PTHREAD_MUTEX_INITIALIZER;
+static Script *scripts[SCRIPT_BUCKETS];
+
+static void script_unref(Script *s) {
+    pthread_mutex_lock(&script_lock);
+    int last = --s->refs == 0;
+    pthread_mutex_unlock(&script_lock);
+    if (last) {
+        free_program(s->prog);
+        free(s->path);
+        free(s);
+    }
+}
+
+/* The compiled script at `path`, compiling it if it is new or has changed.
+   Returns NULL with errno set if it cannot be read. */
+static Script *script_get(const char *path) {
+    struct stat st;
+    if (stat(path, &st) != 0) return NULL;
+    Script **bucket = &scripts[fnv1a(path, strlen(path)) % SCRIPT_BUCKETS];
+    Script *stale = NULL;
+    pthread_mutex_lock(&script_lock);
+    for (Script **sp = bucket; *sp; sp = &(*sp)->next) {
+        Script *s = *sp;
+        if (strcmp(s->path, path) != 0) continue;
+        if (s->size == st.st_size && s->mtime.tv_sec == st.st_mtim.tv_sec &&
+            s->mtime.tv_nsec == st.st_mtim.tv_nsec) {
+            s->refs++;
+            pthread_mutex_unlock(&script_lock);
+            return s;
+        }
+        *sp = s->next;          /* changed on disk: drop it from the cache */
+        stale = s;
+        break;
+    }
+    pthread_mutex_unlock(&script_lock);
+    if (stale) script_unref(stale);
+
+    size_t len;
+    char *text = read_source(path, &len);
+    if (!text) return NULL;
+    Script *s = calloc(1, sizeof(Script));
+    s->path  = strdup(path);
+    s->mtime = st.st_mtim;
+    s->size  = st.st_size;
+    s->prog  = compile_source(text, len);
+    s->refs  = 2;
+    free(text);
+    pthread_mutex_lock(&script_lock);
+    s->next = *bucket;
+    *bucket = s;
+    pthread_mutex_unlock(&script_lock);
+    return s;
+}
+
+/* One run request as read off the wire. */
+typedef struct {
+    char  *path;
+    char **args;
+    int    nargs, argcap;
+    Buf    input;
+    Limits limits;
+} Request;
+
+static void request_free(Request *r) {
+    free(r->path);
+    for (int i = 0; i < r->nargs; i++) free(r->args[i]);
+    free(r->args);
+    free(r->input.data);
+}
+
+/* A client gets this long to send its whole request, and this many bytes
+   (script path, arguments and input together), however it spaces them out,
+   then this long again to take the whole reply.  Requests are read side by
+   side and replies written against the deadline, so a slow client only
+   holds up itself. */
+#define REQUEST_SECONDS 5
+#define REPLY_SECONDS   10
+#define REQUEST_BYTES   WIRE_MAX_FRAME
+#define MAX_PENDING     256     /* connections being read at once; more wait in the backlog */
+
+/* A connection whose request is still coming in. */
+typedef struct {
+    int           fd;
+    double        deadline;     /* clock_now() by which the request must be in */
+    Request       req;
+    unsigned char head[5];      /* type and length of the frame being read */
+    char         *data;         /* its body, once the head is in */
+    size_t        len, have;    /* body length; bytes of head or body read so far */
+    size_t        total;        /* body bytes so far, for REQUEST_BYTES */
+} Pending;
+
+static Pending pending[MAX_PENDING];
+static int     npending;
+
+/* Take one frame into `r`, which keeps `data` or frees it.  Returns 1 once
+   the request is complete, -1 if it is not a valid one, else 0. */
+static int request_frame(Request *r, int type, char *data, size_t len) {
+    if (type == WIRE_SCRIPT) {
+        free(r->path);
+        r->path = data;
+        return 0;
+    }
+    if (type == WIRE_ARG) {
+        if (r->nargs == r->argcap)
+            r->args = xrealloc(r->args, (r->argcap = r->argcap ? r->argcap * 2 : 8) * sizeof(char *));
+        r->args[r->nargs++] = data;
+        return 0;
+    }
+    if (type == WIRE_INPUT) buf_append(&r->input, data, len);
+    if (type == WIRE_LIMITS && len == 24) {
+        const unsigned char *b = (unsigned char *)data;
+        r->limits.steps   = (long long)wire_get64(b);
+        r->limits.memory  = (size_t)wire_get64(b + 8);
+        r->limits.seconds = wire_get_double(b + 16);
+    }
+    free(data);
+    if (type == WIRE_GO) return r->path ? 1 : -1;
+    return 0;
+}
+
+/* Read what has arrived on `p`'s (nonblocking) connection.  Returns 1 once
+   the whole request is in, 0 if more is to come, -1 if the client went away
+   or sent something invalid or too big. */
+static int request_feed(Pending *p) {
+    for (;;) {
+        if (p->data && p->have == p->len) {
+            char *data = p->data;
+            data[p->len] = '\0';
+            p->data = NULL;
+            p->have = 0;
+            int done = request_frame(&p->req, p->head[0], data, p->len);
+            if (done) return done;
+            continue;
+        }
+        char  *at   = p->data ? p->data + p->have : (char *)p->head + p->have;
+        size_t want = p->data ? p->len - p->have : 5 - p->have;
+        ssize_t got = read(p->fd, at, want);
+        if (got < 0 && errno == EINTR) continue;
+        if (got < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return 0;
+        if (got <= 0) return -1;
+        p->have += got;
+        if (!p->data && p->have == 5) {
+            p->len = wire_get32(p->head + 1);
+            if (p->len > REQUEST_BYTES - p->total) return -1;   /* too big: checked before allocating */
+            p->total += p->len;
+            if (!(p->data = malloc(p->len + 1))) return -1;
+            p->have = 0;
+        }
+    }
+}
+
+static void pending_close(Pending *p) {
+    close(p->fd);
+    request_free(&p->req);
+    free(p->data);
+}
+
+/* A run of `prog` with the request's arguments, input and limits.  A
+   client can only tighten the limits the server was started with. */
+static Run *request_run(Request *r, const Program *prog) {
+    Run *run = run_new(prog);
+    Limits lim = opt_limits;
+    if (r->limits.steps > 0 && (!lim.steps || r->limits.steps < lim.steps))
+        lim.steps = r->limits.steps;
+    if (r->limits.seconds > 0 && (!lim.seconds || r->limits.seconds < lim.seconds))
+        lim.seconds = r->limits.seconds;
+    if (r->limits.memory > 0 && (!lim.memory || r->limits.memory < lim.memory))
+        lim.memory = r->limits.memory;
+    run_limit(run, &lim);
+    run->capture   = 1;
+    run->untrusted = 1;
+    run->input     = 1;
+    run->in        = r->input;
+    memset(&r->input, 0, sizeof r->input);
+    run_set_args(run, r->nargs, r->args);
+    return run;
+}
+
+/* Write to a client's (nonblocking) connection, waiting for room until
+   `deadline`.  Returns -1 if the client is gone or has not taken it by then. */
+static int reply_write(int fd, const void *data, size_t n, double deadline) {
+    const char *p = data;
+    while (n > 0) {
+        ssize_t w = send(fd, p, n, MSG_NOSIGNAL);
+        if (w < 0 && errno == EINTR) continue;
+        if (w < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            double left = deadline - clock_now();
+            struct pollfd pf = { .fd = fd, .events = POLLOUT };
+            if (left <= 0 || (poll(&pf, 1, (int)(left * 1000) + 1) < 0 && errno != EINTR)) return -1;
+            continue;
+        }
+        if (w <= 0) return -1;
+        p += w;
+        n -= w;
+    }
+    return 0;
+}
+
+/* wire_send against a deadline. */
+static int reply_send(int fd, int type, const void *data, size_t len, double deadline) {
+    const char *p = data;
+    do {
+        size_t n = len > WIRE_MAX_FRAME ? WIRE_MAX_FRAME : len;
+        unsigned char head[5];
+        head[0] = type;
+        wire_put32(head + 1, n);
+        if (reply_write(fd, head, 5, deadline) < 0 || reply_write(fd, p, n, deadline) < 0)
+            return -1;
+        p += n;
+        len -= n;
+    } while (len > 0);
+    return 0;
+}
+
+static void send_reply(int fd, Run *run) {
+    double deadline = clock_now() + REPLY_SECONDS;
+    unsigned char status[4];
+    wire_put32(status, (uint32_t)run->status);
+    if (run->out.len && reply_send(fd, WIRE_OUT, run->out.data, run->out.len, deadline) < 0) return;
+    if (run->err.len && reply_send(fd, WIRE_ERR, run->err.data, run->err.len, deadline) < 0) return;
+    reply_send(fd, WIRE_EXIT, status, 4, deadline);
+}
+
+static void send_failure(int fd, const char *path) {
+    double deadline = clock_now() + REPLY_SECONDS;
+    char msg[512];
+    unsigned char status[4];
+    snprintf(msg, sizeof msg, "%s: %s\n", path, strerror(errno));
+    wire_put32(status, 1);
+    if (reply_send(fd, WIRE_ERR, msg, strlen(msg), deadline) == 0)
+        reply_send(fd, WIRE_EXIT, status, 4, deadline);
+}
+
+/* on_end hook of a served run: reply to the client and clean up. */
+static void serve_reply(Run *run) {
+    Client *c = run->owner;
+    send_reply(c->fd, run);
+    close(c->fd);
+    run_free(run);
+    script_unref(c->script);
+    free(c);
+}
+
+/* Worker side of a served request: find the script, compiling it if it is
+   new, and start the run.  Returns once it is queued. */
+static void serve_job(void *arg) {
+    Pending *p = arg;
+    Script *s = script_get(p->req.path);
+    if (!s) {
+        send_failure(p->fd, p->req.path);
+        close(p->fd);
+    } else {
+        Client *c = calloc(1, sizeof(Client));
+        c->fd     = p->fd;
+        c->script = s;
+        Run *run = request_run(&p->req, s->prog);
+        run->on_end = serve_reply;
+        run->owner  = c;
+        task_schedule(run->main);
+    }
+    request_free(&p->req);
+    free(p);
+}
+
+/* A request is in: hand it to the workers, keeping the reading thread free
+   for the other connections. */
+static void serve_start(int ls, Pending *p) {
+    (void)ls;
+    Pending *job = malloc(sizeof *job);
+    *job = *p;
+    job_schedule(serve_job, job);
+}
+
+/* Fork-server flavour: the single-threaded parent compiles (or finds) the
+   script, then a forked child runs it against the parent's memory,
+   copy-on-write, and exits. */
+static void fork_start(int ls, Pending *p) {
+    Script *s = script_get(p->req.path);
+    if (!s) {
+        send_failure(p->fd, p->req.path);
+    } else {
+        pid_t pid = fork();
+        if (pid == 0) {
+            close(ls);
+            for (int i = 0; i < npending; i++)     /* other clients' connections */
+                if (pending[i].fd != p->fd) close(pending[i].fd);
+            Run *run = request_run(&p->req, s->prog);
+            run_main(run);
+            send_reply(p->fd, run);
+            _exit(0);
+        }
+        if (pid < 0) send_failure(p->fd, p->req.path);
+        script_unref(s);
+    }
+    close(p->fd);
+    request_free(&p->req);
+}
+
+static int listen_on(const char *sock_path) {
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof addr);
+    addr.sun_family = AF_UNIX;
+    if (strlen(sock_path) >= sizeof addr.sun_path) {
+        fprintf(stderr, "%s: socket path too long\n", sock_path);
+        return -1;
+    }
+    strcpy(addr.sun_path, sock_path);
+    int ls = socket(AF_UNIX, SOCK_STREAM, 0);
+    unlink(sock_path);
+    if (ls < 0 || bind(ls, (struct sockaddr *)&addr, sizeof addr) < 0 || listen(ls, 128) < 0) {
+        perror(sock_path);
+        return -1;
+    }
+    signal(SIGPIPE, SIG_IGN);   /* a client that goes away must not kill us */
+    return ls;
+}
+
+static int accept_one(int ls) {
+    int fd = accept(ls, NULL, NULL);
+    if (fd < 0 && errno != EINTR) perror("accept");
+    return fd;
+}
+
+/* Compile `paths` ahead of the first request for them. */
+static void preload(char **paths, int n) {
+    for (int i = 0; i < n; i++) {
+        char full[PATH_MAX];
+        Script *s = realpath(paths[i], full) ? script_get(full) : NULL;
+        if (!s) perror(paths[i]);
+        else script_unref(s);
+    }
+}
+
+/* Accept connections on `ls` and read their requests side by side, each
+   against its own deadline; `start` takes over the fd, still nonblocking,
+   and request of every one that comes in whole. */
+static void serve_loop(int ls, void (*start)(int ls, Pending *p)) {
+    static struct pollfd pfd[MAX_PENDING + 1];
+    for (;;) {
+        double now = clock_now();
+        int ms = -1;
+        for (int i = 0; i < npending; ) {
+            if (pending[i].deadline <= now) {
+                pending_close(&pending[i]);
+                pending[i] = pending[--npending];
+                continue;
+            }
+            int left = (int)((pending[i].deadline - now) * 1000) + 1;
+            if (ms < 0 || left < ms) ms = left;
+            i++;
+        }
+        pfd[0] = (struct pollfd){ .fd = npending < MAX_PENDING ? ls : -1, .events = POLLIN };
+        for (int i = 0; i < npending; i++)
+            pfd[i + 1] = (struct pollfd){ .fd = pending[i].fd, .events = POLLIN };
+        if (poll(pfd, npending + 1, ms) < 0) {
+            if (errno != EINTR) perror("poll");
+            continue;
+        }
+        /* backwards, so that moving the last one into a freed slot skips nothing */
+        for (int i = npending - 1; i >= 0; i--) {
+            if (!pfd[i + 1].revents) continue;
+            int got = request_feed(&pending[i]);
+            if (got == 0) continue;
+            if (got < 0) {
+                pending_close(&pending[i]);
+            } else {
+                start(ls, &pending[i]);
+            }
+            pending[i] = pending[--npending];
+        }
+        if (pfd[0].revents) {
+            int fd = accept_one(ls);
+            if (fd < 0) continue;
+            fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+            memset(&pending[npending], 0, sizeof pending[npending]);
+            pending[npending].fd       = fd;
+            pending[npending].deadline = clock_now() + REQUEST_SECONDS;
+            npending++;
+        }
+    }
+}
+
+static int serve(const char *sock_path, char **paths, int npaths) {
+    int ls = listen_on(sock_path);
+    if (ls < 0) return 1;
+    preload(paths, npaths);
+
+    /* this thread only accepts, so start a full pool of workers now */
+    start_workers();
+    pthread_t th;
+    if (pthread_create(&th, NULL, worker_main, NULL) == 0)
+        pthread_detach(th);
+
+    serve_loop(ls, serve_start);
+    return 0;
+}
+
+static int fork_serve(const char *sock_path, char **paths, int npaths) {
+    int ls = listen_on(sock_path);
+    if (ls < 0) return 1;
+    preload(paths, npaths);
+    signal(SIGCHLD, SIG_IGN);   /* children are never waited for */
+
+    /* no threads may exist here: a child gets only the forking one */
+    serve_loop(ls, fork_start);
+    return 0;
+}
+
+/* Take a --max-steps, --max-time or --max-memory option into *lim.
+   Returns 0 if the value is not a valid one. */
+static int limit_option(const char *opt, const char *val, Limits *lim) {
+    char *end;
+    errno = 0;
+    if (strcmp(opt, "--max-steps") == 0) {
+        long long n = strtoll(val, &end, 10);
+        if (end == val || *end || n <= 0 || errno) return 0;
+        lim->steps = n;
+    } else if (strcmp(opt, "--max-time") == 0) {
+        double d = strtod(val, &end);
+        if (end == val || *end || !(d > 0) || errno) return 0;
+        lim->seconds = d;
+    } else {
+        unsigned long long n;
+        if (wire_parse_bytes(val, &n) != 0 || n == 0 || n > SIZE_MAX) return 0;
+        lim->memory = n;
+    }
+    return 1;
+}
+
+static void usage(const char *argv0) {
+    fprintf(stderr, "ENGLANG Interpreter v1.0\nUsage: %s [options] [--shards N] <script.eng> [args...]\n"
+                    "       %s [options] --restore <snapshot>\n"
+                    "       %s [options] --batch <dir | list-file>\n"
+                    "       %s [options] --serve <socket> [preload.eng...]\n"
+                    "       %s [options] --fork-serve <socket> [preload.eng...]\n"
+                    "       %s [-O0|-O1|-O2] --dump-ir <script.eng>\n"
+                    "Options: -j workers, -O0|-O1|-O2, --max-steps N, --max-time seconds,\n"
+                    "         --max-memory bytes[K|M|G]\n",
+                    argv0, argv0, argv0, argv0, argv0, argv0);
+    fprintf(stderr, "\nLanguage Quick Reference:\n");
+    fprintf(stderr, "  set x to 42\n");
+    fprintf(stderr, "  set greeting to \"Hello, World!\"\n");
+    fprintf(stderr, "  add x and y into result\n");
+    fprintf(stderr, "  subtract a from b into diff\n");
+    fprintf(stderr, "  multiply x by y into product\n");
+    fprintf(stderr, "  divide a by b into quotient\n");
+    fprintf(stderr, "  increment counter\n");
+    fprintf(stderr, "  decrement counter by 5\n");
+    fprintf(stderr, "  print x and y\n");
+    fprintf(stderr, "  ask \"Enter a number:\" into num\n");
+    fprintf(stderr, "  if x is greater than 5 then\n");
+    fprintf(stderr, "    print x\n");
+    fprintf(stderr, "  otherwise\n");
+    fprintf(stderr, "    print \"small\"\n");
+    fprintf(stderr, "  end if\n");
+    fprintf(stderr, "  while x is less than 100 then\n");
+    fprintf(stderr, "    increment x\n");
+    fprintf(stderr, "  end while\n");
+    fprintf(stderr, "  repeat 10 times\n");
+    fprintf(stderr, "    print x\n");
+    fprintf(stderr, "  end repeat\n");
+    fprintf(stderr, "  for i from 1 to 10 step 1 then\n");
+    fprintf(stderr, "    print i\n");
+    fprintf(stderr, "  end for\n");
+    fprintf(stderr, "  for i from 1 to 1000 distributed gathering results then\n");
+    fprintf(stderr, "    append i to array results\n");
+    fprintf(stderr, "  end for\n");
+    fprintf(stderr, "  define factorial with n as\n");
+    fprintf(stderr, "    ...\n");
+    fprintf(stderr, "  end define\n");
+    fprintf(stderr, "  call factorial with 5\n");
+    fprintf(stderr, "  spawn call factorial with 5 into job\n");
+    fprintf(stderr, "  await job into result\n");
+    fprintf(stderr, "  create channel jobs with capacity 16\n");
+    fprintf(stderr, "  send x to channel jobs\n");
+    fprintf(stderr, "  receive from channel jobs into x\n");
+    fprintf(stderr, "  push 42 onto stack\n");
+    fprintf(stderr, "  pop from stack into x\n");
+    fprintf(stderr, "  store x at address 0\n");
+    fprintf(stderr, "  load from address 0 into y\n");
+    fprintf(stderr, "  create array nums\n");
+    fprintf(stderr, "  append 10 to array nums\n");
+    fprintf(stderr, "  get element 0 of array nums into val\n");
+    fprintf(stderr, "  reduce array nums with sum into total\n");
+    fprintf(stderr, "  map array nums with double into array doubled\n");
+    fprintf(stderr, "  snapshot to \"state.img\"\n");
+    fprintf(stderr, "  square root of x into root\n");
+    fprintf(stderr, "  length of mystring into len\n");
+    fprintf(stderr, "  find \":\" in line into pos\n");
+    fprintf(stderr, "  split line by \",\" into array fields\n");
+    fprintf(stderr, "  replace \"-\" with \" \" in line\n");
+    fprintf(stderr, "  substring of line from 0 to pos into key\n");
+    fprintf(stderr, "  format \"{name:<10} {total:8.2}\" into row\n");
+    fprintf(stderr, "  if line matches \"^ERROR\" then ... end if\n");
+    fprintf(stderr, "  extract \"(\\d+)\" from line into array nums\n");
+}
+
+int main(int argc, char *argv[]) {
+#ifdef PROFILE_PAIRS
+    atexit(profile_report);
+#endif
+    const char *script = NULL, *batch = NULL, *sock = NULL, *image = NULL;
+    int forking = 0, dump_ir = 0;
+    int first_arg = argc;
+    for (int i = 1; i < argc && !script; i++) {
+        if (strcmp(argv[i], "-j") == 0 && i + 1 < argc)
+            opt_jobs = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--batch") == 0 && i + 1 < argc)
+            batch = argv[++i];
+        else if (strcmp(argv[i], "--restore") == 0 && i + 1 < argc)
+            image = argv[++i];
+        else if (strcmp(argv[i], "--shards") == 0 && i + 1 < argc)
+            opt_shards = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--dump-ir") == 0)
+            dump_ir = 1;
+        else if (strncmp(argv[i], "-O", 2) == 0 && argv[i][2] >= '0' && argv[i][2] <= '2' && !argv[i][3])
+            opt_level = argv[i][2] - '0';
+        else if ((strcmp(argv[i], "--max-steps") == 0 || strcmp(argv[i], "--max-time") == 0 ||
+                  strcmp(argv[i], "--max-memory") == 0) && i + 1 < argc) {
+            if (!limit_option(argv[i], argv[i + 1], &opt_limits)) {
+                fprintf(stderr, "Error: bad value '%s' for %s\n", argv[i + 1], argv[i]);
+                return 1;
+            }
+            i++;
+        }
+        else if (strcmp(argv[i], "--shard-worker") == 0 && i + 1 < argc)
+            return shard_worker(atoi(argv[++i]));   /* started by shards_start */
+        else if ((strcmp(argv[i], "--serve") == 0 || strcmp(argv[i], "--fork-serve") == 0) && i + 1 < argc) {
+            forking = argv[i][2] == 'f';
+            sock = argv[++i];
+        }
+        else {
+            script = argv[i];
+            first_arg = i + 1;
+        }
+    }
+    if (batch) return run_batch(batch);
+    if (sock) {
+        /* any script names are compiled up front */
+        char **paths = argv + first_arg - (script != NULL);
+        int npaths = argc - first_arg + (script != NULL);
+        return forking ? fork_serve(sock, paths, npaths) : serve(sock, paths, npaths);
+    }
+    if (!script && !image) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    Program *prog;
+    Run *run;
+    if (dump_ir && script) {
+        /* compile only: the listing is the output */
+        prog = load_file(script);
+        int status = dump_program(stdout, prog, prog->heat ? hot_code(prog, NULL) : prog->code, script);
+        free_program(prog);
+        return status;
+    }
+    if (image) {
+        /* arguments were part of the state that was saved */
+        if (!(run = snapshot_restore(image, &prog))) return 1;
+    } else {
+        prog = load_file(script);
+        run = run_new(prog);
+        run_set_args(run, argc - first_arg, argv + first_arg);
+    }
+    int status = run_main(run);
+    fflush(stdout);
+    run_free(run);
+    free_program(prog);
+    return status;
+}